@@ -40,12 +40,14 @@
 #include <stdexcept>
 #include <boost/thread.hpp>
 
+#include "config.h"
 #include "curl_easy_handle.h"
 #include "logger.h"
 
 using boost::mutex;
 using std::runtime_error;
 
+using s3::base::config;
 using s3::base::curl_easy_handle;
 
 namespace
@@ -53,6 +55,41 @@ namespace
   mutex s_init_mutex;
   int s_init_count = 0;
 
+  // DNS lookups and TLS sessions are shared among all handles, so that a 
+  // new handle (e.g., in a respawned worker) can skip the lookup and resume
+  // a session rather than do a full handshake. libcurl doesn't support 
+  // sharing connections among threads, so each handle still keeps its own
+  // (except for those run by the transfer reactor, which share the multi
+  // handle's).
+  CURLSH *s_share = NULL;
+  mutex s_share_mutexes[CURL_LOCK_DATA_LAST];
+
+  void share_lock(CURL *, curl_lock_data data, curl_lock_access, void *)
+  {
+    s_share_mutexes[data].lock();
+  }
+
+  void share_unlock(CURL *, curl_lock_data data, void *)
+  {
+    s_share_mutexes[data].unlock();
+  }
+
+  void init_share()
+  {
+    if (!config::get_share_connection_state())
+      return;
+
+    s_share = curl_share_init();
+
+    if (!s_share)
+      throw runtime_error("curl_share_init() failed.");
+
+    curl_share_setopt(s_share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(s_share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(s_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(s_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+
   #ifdef HAVE_OPENSSL
     pthread_mutex_t *s_openssl_locks = NULL;
 
@@ -123,6 +160,11 @@ namespace
 
   void cleanup()
   {
+    if (s_share) {
+      curl_share_cleanup(s_share);
+      s_share = NULL;
+    }
+
     #ifdef HAVE_OPENSSL
       if (s_openssl_locks) {
         CRYPTO_set_id_callback(NULL);
@@ -143,13 +185,18 @@ curl_easy_handle::curl_easy_handle()
 {
   mutex::scoped_lock lock(s_init_mutex);
 
-  if (s_init_count++ == 0)
+  if (s_init_count++ == 0) {
     pre_init();
+    init_share();
+  }
 
   _handle = curl_easy_init();
 
   if (!_handle)
     throw runtime_error("curl_easy_init() failed.");
+
+  if (s_share && curl_easy_setopt(_handle, CURLOPT_SHARE, s_share) != CURLE_OK)
+    throw runtime_error("failed to set CURLOPT_SHARE.");
 }
 
 curl_easy_handle::~curl_easy_handle()
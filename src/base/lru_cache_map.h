@@ -23,8 +23,8 @@
 #ifndef S3_BASE_LRU_CACHE_MAP_H
 #define S3_BASE_LRU_CACHE_MAP_H
 
-#include <map>
 #include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
 
 namespace s3
 {
@@ -33,6 +33,15 @@ namespace s3
     template <class T>
     inline bool default_removable_test(const T &t) { return true; }
 
+    // entries are kept in two lists: the LRU list, and a list of "pinned"
+    // entries found not to be removable while looking for something to 
+    // evict. pinned entries go back on the LRU list when they're next used,
+    // so eviction doesn't have to walk past the same open objects on every
+    // insert. pinned entries are treated as older than anything on the LRU
+    // list.
+    //
+    // entries are evicted to keep to max_size entries and, if it's set, to
+    // max_total_size in total of the sizes given to set_entry_size().
     template
     <
       class key_type, 
@@ -44,10 +53,10 @@ namespace s3
     public:
       typedef boost::function2<void, const key_type &, const value_type &> itor_callback_fn;
 
-      inline lru_cache_map(size_t max_size)
+      inline lru_cache_map(size_t max_size, size_t max_total_size = 0)
         : _max_size(max_size),
-          _newest(NULL),
-          _oldest(NULL)
+          _max_total_size(max_total_size),
+          _total_size(0)
       {
       }
 
@@ -61,20 +70,31 @@ namespace s3
           e->key = key;
           e->valid = true;
 
-          if (_map.size() > _max_size) {
-            entry *to_remove = get_removable();
-
-            if (to_remove)
-              erase(to_remove->key);
-          }
+          trim(e);
         }
 
-        make_newest(e);
+        push_newest(&_lru, e);
 
         return e->value;
       }
 
       inline void erase(const key_type &key)
+      {
+        typename map::iterator itor = _map.find(key);
+
+        if (itor == _map.end())
+          return;
+
+        _total_size -= itor->second.size;
+
+        unlink(&itor->second);
+        _map.erase(itor);
+      }
+
+      // sets the size counted against max_total_size for the entry at key 
+      // (if there is one), evicting others if that puts us over. this 
+      // counts as a use of the entry.
+      inline void set_entry_size(const key_type &key, size_t size)
       {
         typename map::iterator itor = _map.find(key);
         entry *e = NULL;
@@ -84,30 +104,31 @@ namespace s3
 
         e = &itor->second;
 
+        _total_size += size - e->size;
+        e->size = size;
+
         unlink(e);
-        _map.erase(itor);
+        push_newest(&_lru, e);
+
+        trim(e);
       }
 
       inline void for_each_newest(const itor_callback_fn &cb) const
       {
-        entry *e = _newest;
-
-        while (e) {
+        for (entry *e = _lru.newest; e; e = e->older)
           cb(e->key, e->value);
 
-          e = e->older;
-        }
+        for (entry *e = _pinned.newest; e; e = e->older)
+          cb(e->key, e->value);
       }
 
       inline void for_each_oldest(const itor_callback_fn &cb) const
       {
-        entry *e = _oldest;
-
-        while (e) {
+        for (entry *e = _pinned.oldest; e; e = e->newer)
           cb(e->key, e->value);
 
-          e = e->newer;
-        }
+        for (entry *e = _lru.oldest; e; e = e->newer)
+          cb(e->key, e->value);
       }
 
       inline size_t get_size()
@@ -115,6 +136,11 @@ namespace s3
         return _map.size();
       }
 
+      inline size_t get_total_size()
+      {
+        return _total_size;
+      }
+
       inline bool find(const key_type &key, value_type *t)
       {
         typename map::iterator itor = _map.find(key);
@@ -133,25 +159,43 @@ namespace s3
         key_type key;
         value_type value;
         entry *older, *newer;
-        bool valid;
+        size_t size;
+        bool valid, pinned;
 
         entry()
           : older(NULL),
             newer(NULL),
-            valid(false)
+            size(0),
+            valid(false),
+            pinned(false)
         {
         }
       };
 
-      typedef std::map<key_type, entry> map;
+      struct entry_list
+      {
+        entry *newest, *oldest;
+
+        entry_list()
+          : newest(NULL),
+            oldest(NULL)
+        {
+        }
+      };
+
+      // elements of an unordered_map stay put when it rehashes, so entries
+      // can link to each other
+      typedef boost::unordered_map<key_type, entry> map;
 
       inline void unlink(entry *e)
       {
-        if (e == _oldest)
-          _oldest = e->newer;
+        entry_list *list = e->pinned ? &_pinned : &_lru;
+
+        if (e == list->oldest)
+          list->oldest = e->newer;
 
-        if (e == _newest)
-          _newest = e->older;
+        if (e == list->newest)
+          list->newest = e->older;
 
         if (e->older)
           e->older->newer = e->newer;
@@ -160,38 +204,68 @@ namespace s3
           e->newer->older = e->older;
 
         e->newer = e->older = NULL;
+        e->pinned = false;
       }
 
-      inline void make_newest(entry *e)
+      inline void push_newest(entry_list *list, entry *e)
       {
-        e->older = _newest;
+        e->older = list->newest;
+        e->pinned = (list == &_pinned);
 
-        if (_newest)
-          _newest->newer = e;
+        if (list->newest)
+          list->newest->newer = e;
 
-        _newest = e;
+        list->newest = e;
 
-        if (!_oldest)
-          _oldest = e;
+        if (!list->oldest)
+          list->oldest = e;
       }
 
       inline entry * get_removable()
       {
-        entry *e = _oldest;
+        entry *e = _pinned.oldest;
 
-        while (e) {
+        // pinned entries don't get looked at again unless they're used, so
+        // check one of them (in turn) each time, in case it's since become
+        // removable without being used
+        if (e) {
           if (is_removable_fn(e->value))
-            break;
+            return e;
+
+          unlink(e);
+          push_newest(&_pinned, e);
+        }
+
+        // each entry found not to be removable here is moved to the pinned
+        // list, so is passed over at most once until it's used again
+        while ((e = _lru.oldest)) {
+          if (is_removable_fn(e->value))
+            return e;
 
-          e = e->newer;
+          unlink(e);
+          push_newest(&_pinned, e);
         }
 
-        return e;
+        return NULL;
+      }
+
+      // evicts entries, other than keep, until we're within our limits or
+      // nothing else can be removed
+      inline void trim(const entry *keep)
+      {
+        while (_map.size() > _max_size || (_max_total_size && _total_size > _max_total_size)) {
+          entry *e = get_removable();
+
+          if (!e || e == keep)
+            break;
+
+          erase(e->key);
+        }
       }
 
       map _map;
-      size_t _max_size;
-      entry *_newest, *_oldest;
+      size_t _max_size, _max_total_size, _total_size;
+      entry_list _lru, _pinned;
     };
   }
 }
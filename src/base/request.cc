@@ -19,11 +19,14 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <stdint.h>
 #include <string.h>
 
 #include <stdexcept>
+#include <boost/bind.hpp>
 #include <boost/detail/atomic_count.hpp>
+#include <boost/thread/condition.hpp>
 
 #include "config.h"
 #include "logger.h"
@@ -31,7 +34,11 @@
 #include "request_hook.h"
 #include "statistics.h"
 #include "timer.h"
+#include "transfer_reactor.h"
+#include "transfer_scheduler.h"
 
+using boost::bind;
+using boost::condition;
 using boost::mutex;
 using boost::detail::atomic_count;
 using std::min;
@@ -40,41 +47,20 @@ using std::runtime_error;
 using std::setprecision;
 using std::string;
 
+using s3::base::config;
 using s3::base::request;
 using s3::base::statistics;
 using s3::base::timer;
+using s3::base::transfer_reactor;
+using s3::base::transfer_scheduler;
 
 #define TEST_OK(x) do { if ((x) != CURLE_OK) throw runtime_error("call to " #x " failed."); } while (0)
 
 namespace
 {
-  class curl_slist_wrapper
-  {
-  public:
-    curl_slist_wrapper()
-      : _list(NULL)
-    {
-    }
-
-    ~curl_slist_wrapper()
-    {
-      if (_list)
-        curl_slist_free_all(_list);
-    }
-
-    inline void append(const char *item)
-    {
-      _list = curl_slist_append(_list, item);
-    }
-
-    inline const curl_slist * get() const
-    {
-      return _list;
-    }
-
-  private:
-    curl_slist *_list;
-  };
+  // input sources are read in pieces of this size. it's a multiple of the
+  // hash list chunk size, since sources backed by files hash what they read.
+  const size_t INPUT_SOURCE_PIECE_SIZE = 128 * 1024;
 
   uint64_t s_run_count = 0;
   uint64_t s_total_bytes = 0;
@@ -82,6 +68,7 @@ namespace
   atomic_count s_curl_failures(0), s_request_failures(0);
   atomic_count s_timeouts(0), s_aborts(0), s_hook_retries(0);
   atomic_count s_rewinds(0);
+  atomic_count s_connections_reused(0), s_connections_new(0), s_tls_handshakes(0);
   mutex s_stats_mutex;
 
   void statistics_writer(ostream *o)
@@ -100,10 +87,70 @@ namespace
       "  timeouts: " << s_timeouts << "\n"
       "  aborts: " << s_aborts << "\n"
       "  hook retries: " << s_hook_retries << "\n"
-      "  rewinds: " << s_rewinds << "\n";
+      "  rewinds: " << s_rewinds << "\n"
+      "  connections reused: " << s_connections_reused << ", new: " << s_connections_new << "\n"
+      "  tls handshakes: " << s_tls_handshakes << "\n";
   }
 
   statistics::writers::entry s_writer(statistics_writer, 0);
+
+  bool is_http2_enabled()
+  {
+    static int s_enabled = -1;
+
+    if (s_enabled == -1) {
+      curl_version_info_data *ver = curl_version_info(CURLVERSION_NOW);
+
+      s_enabled = config::get_http2() && ver && (ver->features & CURL_VERSION_HTTP2);
+
+      if (config::get_http2() && !s_enabled)
+        S3_LOG(LOG_WARNING, "request::request", "http2 is enabled, but libcurl doesn't support it.\n");
+    }
+
+    return s_enabled;
+  }
+
+  // request::run_on_reactor() hands the reactor a pointer to a request it 
+  // doesn't own
+  struct null_deleter
+  {
+    inline void operator()(request *) const { }
+  };
+
+  class run_waiter
+  {
+  public:
+    inline run_waiter()
+      : _done(false),
+        _r(0)
+    {
+    }
+
+    inline void complete(int r)
+    {
+      mutex::scoped_lock lock(_mutex);
+
+      _r = r;
+      _done = true;
+      _condition.notify_all();
+    }
+
+    inline int wait()
+    {
+      mutex::scoped_lock lock(_mutex);
+
+      while (!_done)
+        _condition.wait(lock);
+
+      return _r;
+    }
+
+  private:
+    mutex _mutex;
+    condition _condition;
+    bool _done;
+    int _r;
+  };
 }
 
 size_t request::header_process(char *data, size_t size, size_t items, void *context)
@@ -156,10 +203,34 @@ size_t request::output_write(char *data, size_t size, size_t items, void *contex
   if (req->_canceled)
     return 0; // abort!
 
+  // curl hands us the same data again once transfer_progress() resumes us
+  if (transfer_scheduler::is_over_cap(transfer_scheduler::TD_DOWNLOAD)) {
+    req->_attempt_paused |= CURLPAUSE_RECV;
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  if (req->_output_sink) {
+    long response_code = 0;
+
+    curl_easy_getinfo(req->_curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+    if (response_code == req->_output_sink_response_code) {
+      if (req->_output_sink(data, size, req->_output_sink_size))
+        return 0; // abort!
+
+      req->_output_sink_size += size;
+      transfer_scheduler::charge(transfer_scheduler::TD_DOWNLOAD, size);
+
+      return size;
+    }
+  }
+
   old_size = req->_output_buffer.size();
   req->_output_buffer.resize(old_size + size);
   memcpy(&req->_output_buffer[old_size], data, size);
 
+  transfer_scheduler::charge(transfer_scheduler::TD_DOWNLOAD, size);
+
   return size;
 }
 
@@ -173,6 +244,27 @@ size_t request::input_read(char *data, size_t size, size_t items, void *context)
   if (req->_canceled)
     return 0; // abort!
 
+  if (transfer_scheduler::is_over_cap(transfer_scheduler::TD_UPLOAD)) {
+    req->_attempt_paused |= CURLPAUSE_SEND;
+    return CURL_READFUNC_PAUSE;
+  }
+
+  if (req->_input_source && req->_input_remaining == 0 && req->_input_source_offset < req->_input_source_size) {
+    size_t piece = min(INPUT_SOURCE_PIECE_SIZE, req->_input_source_size - req->_input_source_offset);
+
+    if (
+      req->_input_source(piece, req->_input_source_offset, req->_input_source_buffer) ||
+      req->_input_source_buffer->size() != piece)
+    {
+      S3_LOG(LOG_WARNING, "request::input_read", "failed to read input at offset %zu for [%s].\n", req->_input_source_offset, req->_url.c_str());
+      return CURL_READFUNC_ABORT;
+    }
+
+    req->_input_pos = &(*req->_input_source_buffer)[0];
+    req->_input_remaining = piece;
+    req->_input_source_offset += piece;
+  }
+
   remaining = min(req->_input_remaining, size);
 
   memcpy(data, req->_input_pos, remaining);
@@ -180,9 +272,38 @@ size_t request::input_read(char *data, size_t size, size_t items, void *context)
   req->_input_pos += remaining;
   req->_input_remaining -= remaining;
 
+  transfer_scheduler::charge(transfer_scheduler::TD_UPLOAD, remaining);
+
   return remaining;
 }
 
+int request::transfer_progress(void *context, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+  request *req = static_cast<request *>(context);
+  int paused = req->_attempt_paused;
+
+  if (req->_canceled)
+    return 1; // abort!
+
+  if (!paused)
+    return 0;
+
+  // curl calls this periodically even while we're paused, so it's where we
+  // resume once the caps allow
+  if ((paused & CURLPAUSE_RECV) && !transfer_scheduler::is_over_cap(transfer_scheduler::TD_DOWNLOAD))
+    paused &= ~CURLPAUSE_RECV;
+
+  if ((paused & CURLPAUSE_SEND) && !transfer_scheduler::is_over_cap(transfer_scheduler::TD_UPLOAD))
+    paused &= ~CURLPAUSE_SEND;
+
+  if (paused != req->_attempt_paused) {
+    req->_attempt_paused = paused;
+    curl_easy_pause(req->_curl, paused);
+  }
+
+  return 0;
+}
+
 int request::input_seek(void *context, curl_off_t offset, int origin)
 {
   request *req = static_cast<request *>(context);
@@ -204,13 +325,15 @@ request::request()
     _total_run_time(0.0),
     _run_count(0),
     _total_bytes_transferred(0),
-    _canceled(false),
-    _timeout(0)
+    _canceled(0),
+    _abandoned(0),
+    _timeout(0),
+    _attempt_headers(NULL),
+    _attempt_paused(0)
 {
   // stuff that's set in the ctor shouldn't be modified elsewhere, since the call to init() won't reset it
 
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_VERBOSE, config::get_verbose_requests()));
-  TEST_OK(curl_easy_setopt(_curl, CURLOPT_NOPROGRESS, true));
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_FOLLOWLOCATION, true));
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_ERRORBUFFER, _curl_error));
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_FILETIME, true));
@@ -223,10 +346,24 @@ request::request()
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_READDATA, this));
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_SEEKFUNCTION, &request::input_seek));
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_SEEKDATA, this));
+  TEST_OK(curl_easy_setopt(_curl, CURLOPT_XFERINFOFUNCTION, &request::transfer_progress));
+  TEST_OK(curl_easy_setopt(_curl, CURLOPT_XFERINFODATA, this));
+
+  #if LIBCURL_VERSION_NUM >= 0x072f00
+    if (is_http2_enabled()) {
+      TEST_OK(curl_easy_setopt(_curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS));
+
+      // wait for a connection that can be multiplexed rather than open another
+      TEST_OK(curl_easy_setopt(_curl, CURLOPT_PIPEWAIT, 1L));
+    }
+  #endif
 }
 
 request::~request()
 {
+  if (_attempt_headers)
+    curl_slist_free_all(_attempt_headers);
+
   if (_total_bytes_transferred > 0) {
     mutex::scoped_lock lock(s_stats_mutex);
 
@@ -245,11 +382,16 @@ void request::init(http_method method)
   _url.clear();
   _curl_url.clear();
   _output_buffer.clear();
+  _output_sink.clear();
+  _output_sink_response_code = 0;
+  _output_sink_size = 0;
   _response_headers.clear();
   _response_code = 0;
   _last_modified = 0;
   _headers.clear();
   _input_buffer.reset();
+  _input_source.clear();
+  _input_source_buffer.reset();
 
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_CUSTOMREQUEST, NULL));
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_UPLOAD, false));
@@ -296,7 +438,7 @@ bool request::check_timeout()
   if (_timeout && time(NULL) > _timeout) {
     S3_LOG(LOG_WARNING, "request::check_timeout", "timed out on [%s] [%s].\n", _method.c_str(), _url.c_str());
 
-    _canceled = true;
+    ++_canceled;
     return true;
   }
 
@@ -305,11 +447,77 @@ bool request::check_timeout()
 
 void request::run(int timeout_in_s)
 {
-  int r = CURLE_OK;
-  int iter;
-  double elapsed_time = 0.0;
-  uint64_t bytes_transferred = 0;
+  // libcurl only multiplexes requests that share a multi handle, so with 
+  // http/2 we have the reactor run the request and wait for it here. bodies
+  // read from input sources stay off the reactor thread, though.
+  if (is_http2_enabled() && !_input_source && transfer_reactor::is_running() && !transfer_reactor::is_reactor_thread()) {
+    run_on_reactor(timeout_in_s);
+    return;
+  }
+
+  begin_run(timeout_in_s);
+
+  while (true) {
+    attempt_result ar;
+
+    begin_attempt();
+    ar = end_attempt(curl_easy_perform(_curl));
+
+    if (ar == AR_DONE)
+      break;
+
+    if (ar == AR_RETRY_AFTER_DELAY)
+      timer::sleep(1);
+  }
+
+  end_run();
+}
+
+void request::run_async(const completion_fn &on_complete, int timeout_in_s)
+{
+  int r = 0;
+
+  try {
+    if (transfer_reactor::is_running()) {
+      begin_run(timeout_in_s);
+      transfer_reactor::add(shared_from_this(), on_complete);
+
+      return;
+    }
+
+    // without the reactor, all we can do is block
+    run(timeout_in_s);
+
+  } catch (const std::exception &e) {
+    S3_LOG(LOG_WARNING, "request::run_async", "caught exception: %s\n", e.what());
+    r = _canceled ? -ETIMEDOUT : -ECANCELED;
+  }
+
+  on_complete(r);
+}
+
+void request::run_on_reactor(int timeout_in_s)
+{
+  run_waiter waiter;
+  int r;
+
+  begin_run(timeout_in_s);
+
+  // we wait until the reactor's done with the request, so it doesn't need a
+  // reference
+  transfer_reactor::add(ptr(this, null_deleter()), bind(&run_waiter::complete, &waiter, _1));
+
+  r = waiter.wait();
 
+  if (r == -ETIMEDOUT)
+    throw runtime_error("request timed out.");
+
+  if (r)
+    throw runtime_error(_curl_error[0] ? _curl_error : "request failed.");
+}
+
+void request::begin_run(int timeout_in_s)
+{
   // sanity
   if (_url.empty())
     throw runtime_error("call set_url() first!");
@@ -322,108 +530,154 @@ void request::run(int timeout_in_s)
 
   TEST_OK(curl_easy_setopt(_curl, CURLOPT_URL, _curl_url.c_str()));
 
+  // the bandwidth caps are charged as data goes by, and requests pause in
+  // output_write() and input_read() while the total is over a cap, so the
+  // cap holds however many requests are running. transfer_progress() 
+  // resumes them, and is only needed when there's a cap.
+  TEST_OK(curl_easy_setopt(_curl, CURLOPT_NOPROGRESS, 
+    (transfer_scheduler::get_max_rate(transfer_scheduler::TD_UPLOAD) || transfer_scheduler::get_max_rate(transfer_scheduler::TD_DOWNLOAD)) ? 0L : 1L));
+
   if (_method == "PUT")
-    TEST_OK(curl_easy_setopt(_curl, CURLOPT_INFILESIZE_LARGE, _input_buffer ? static_cast<curl_off_t>(_input_buffer->size()) : 0));
+    TEST_OK(curl_easy_setopt(_curl, CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(get_input_size())));
   else if (_method == "POST")
-    TEST_OK(curl_easy_setopt(_curl, CURLOPT_POSTFIELDSIZE_LARGE, _input_buffer ? static_cast<curl_off_t>(_input_buffer->size()) : 0));
-  else if (_input_buffer && !_input_buffer->empty())
+    TEST_OK(curl_easy_setopt(_curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(get_input_size())));
+  else if (get_input_size())
     throw runtime_error("can't set input data for non-POST/non-PUT request.");
 
-  for (iter = 0; iter < config::get_max_transfer_retries(); iter++) {
-    curl_slist_wrapper headers;
-    uint64_t request_size = 0;
-   
-    _output_buffer.clear();
-    _response_headers.clear();
+  _run_timeout_in_s = (timeout_in_s == DEFAULT_REQUEST_TIMEOUT) ? config::get_request_timeout_in_s() : timeout_in_s;
+  _run_attempts = 0;
+  _run_result = CURLE_OK;
+  _run_elapsed_time = 0.0;
+  _run_first_byte_time = 0.0;
+  _run_bytes_transferred = 0;
+}
 
-    if (_hook)
-      _hook->pre_run(this, iter);
+void request::begin_attempt()
+{
+  _output_buffer.clear();
+  _output_sink_size = 0; // the sink sees the body again from offset zero
+  _response_headers.clear();
 
-    for (header_map::const_iterator itor = _headers.begin(); itor != _headers.end(); ++itor) {
-      string header = itor->first + ": " + itor->second;
+  if (_hook)
+    _hook->pre_run(this, _run_attempts);
 
-      headers.append(header.c_str());
-      request_size += header.size();
-    }
+  if (_attempt_headers) {
+    curl_slist_free_all(_attempt_headers);
+    _attempt_headers = NULL;
+  }
 
-    TEST_OK(curl_easy_setopt(_curl, CURLOPT_HTTPHEADER, headers.get()));
+  _attempt_request_size = 0;
+  _attempt_paused = 0;
 
-    if (_input_buffer)
-      request_size += _input_buffer->size();
+  for (header_map::const_iterator itor = _headers.begin(); itor != _headers.end(); ++itor) {
+    string header = itor->first + ": " + itor->second;
 
-    rewind();
+    _attempt_headers = curl_slist_append(_attempt_headers, header.c_str());
+    _attempt_request_size += header.size();
+  }
 
-    _timeout = time(NULL) + ((timeout_in_s == DEFAULT_REQUEST_TIMEOUT) ? config::get_request_timeout_in_s() : timeout_in_s);
-    r = curl_easy_perform(_curl);
-    _timeout = 0; // reset this here so that subsequent calls to check_timeout() don't fail
+  TEST_OK(curl_easy_setopt(_curl, CURLOPT_HTTPHEADER, _attempt_headers));
 
-    if (_canceled) {
-      ++s_timeouts;
-      throw runtime_error("request timed out.");
-    }
+  _attempt_request_size += get_input_size();
 
-    if (
-      r == CURLE_COULDNT_RESOLVE_PROXY || 
-      r == CURLE_COULDNT_RESOLVE_HOST || 
-      r == CURLE_COULDNT_CONNECT || 
-      r == CURLE_PARTIAL_FILE || 
-      r == CURLE_UPLOAD_FAILED || 
-      r == CURLE_OPERATION_TIMEDOUT || 
-      r == CURLE_SSL_CONNECT_ERROR || 
-      r == CURLE_GOT_NOTHING || 
-      r == CURLE_SEND_ERROR || 
-      r == CURLE_RECV_ERROR || 
-      r == CURLE_BAD_CONTENT_ENCODING)
-    {
-      ++s_curl_failures;
-      S3_LOG(LOG_WARNING, "request::run", "got error [%s]. retrying.\n", _curl_error);
-      timer::sleep(1);
+  rewind();
 
-      continue;
-    }
+  _timeout = time(NULL) + _run_timeout_in_s;
+}
 
-    if (r == CURLE_OK) {
-      double this_iter_et = 0.0;
+request::attempt_result request::end_attempt(int r)
+{
+  int iter = _run_attempts++;
+  bool can_retry = (_run_attempts < config::get_max_transfer_retries());
+
+  _timeout = 0; // reset this here so that subsequent calls to check_timeout() don't fail
+  _run_result = r;
+
+  if (_abandoned)
+    throw runtime_error("request canceled.");
+
+  if (_canceled) {
+    ++s_timeouts;
+    throw runtime_error("request timed out.");
+  }
+
+  if (
+    r == CURLE_COULDNT_RESOLVE_PROXY || 
+    r == CURLE_COULDNT_RESOLVE_HOST || 
+    r == CURLE_COULDNT_CONNECT || 
+    r == CURLE_PARTIAL_FILE || 
+    r == CURLE_UPLOAD_FAILED || 
+    r == CURLE_OPERATION_TIMEDOUT || 
+    r == CURLE_SSL_CONNECT_ERROR || 
+    r == CURLE_GOT_NOTHING || 
+    r == CURLE_SEND_ERROR || 
+    r == CURLE_RECV_ERROR || 
+    r == CURLE_BAD_CONTENT_ENCODING)
+  {
+    ++s_curl_failures;
+    S3_LOG(LOG_WARNING, "request::end_attempt", "got error [%s]. retrying.\n", _curl_error);
+
+    return can_retry ? AR_RETRY_AFTER_DELAY : AR_DONE;
+  }
 
-      TEST_OK(curl_easy_getinfo(_curl, CURLINFO_RESPONSE_CODE, &_response_code));
-      TEST_OK(curl_easy_getinfo(_curl, CURLINFO_TOTAL_TIME, &this_iter_et));
-      TEST_OK(curl_easy_getinfo(_curl, CURLINFO_FILETIME, &_last_modified));
+  if (r == CURLE_OK) {
+    double this_iter_et = 0.0, tls_time = 0.0;
+    long connects = 0;
 
-      elapsed_time += this_iter_et;
-      bytes_transferred += request_size + _output_buffer.size();
+    TEST_OK(curl_easy_getinfo(_curl, CURLINFO_RESPONSE_CODE, &_response_code));
+    TEST_OK(curl_easy_getinfo(_curl, CURLINFO_TOTAL_TIME, &this_iter_et));
+    TEST_OK(curl_easy_getinfo(_curl, CURLINFO_FILETIME, &_last_modified));
 
-      if (_hook && _hook->should_retry(this, iter)) {
-        ++s_hook_retries;
-        continue;
-      }
+    // a request that didn't have to connect went out on a cached connection
+    if (curl_easy_getinfo(_curl, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK) {
+      if (connects)
+        ++s_connections_new;
+      else
+        ++s_connections_reused;
     }
 
-    // break on CURLE_OK or some other error where we don't want to try the request again
-    break;
+    if (curl_easy_getinfo(_curl, CURLINFO_APPCONNECT_TIME, &tls_time) == CURLE_OK && tls_time > 0.0)
+      ++s_tls_handshakes;
+
+    TEST_OK(curl_easy_getinfo(_curl, CURLINFO_STARTTRANSFER_TIME, &_run_first_byte_time));
+
+    _run_elapsed_time += this_iter_et;
+    _run_bytes_transferred += _attempt_request_size + _output_buffer.size() + _output_sink_size;
+
+    if (_hook && _hook->should_retry(this, iter)) {
+      ++s_hook_retries;
+      return can_retry ? AR_RETRY : AR_DONE;
+    }
   }
 
-  if (r != CURLE_OK) {
+  // done on CURLE_OK or some other error where we don't want to try the request again
+  return AR_DONE;
+}
+
+void request::end_run()
+{
+  if (_run_result != CURLE_OK) {
     ++s_aborts;
     throw runtime_error(_curl_error);
   }
 
   // don't save the time for the first request since it's likely to be disproportionately large
   if (_run_count > 0) {
-    _total_run_time += elapsed_time;
-    _total_bytes_transferred += bytes_transferred;
+    _total_run_time += _run_elapsed_time;
+    _total_bytes_transferred += _run_bytes_transferred;
   }
 
   // but save it in _current_run_time since it's compared to overall function time (i.e., it's relative)
-  _current_run_time += elapsed_time;
+  _current_run_time += _run_elapsed_time;
 
-  _run_count += iter + 1;
+  _run_count += _run_attempts;
 
   if (_response_code >= HTTP_SC_BAD_REQUEST && _response_code != HTTP_SC_NOT_FOUND) {
     ++s_request_failures;
 
     S3_LOG(
       LOG_WARNING, 
-      "request::run", 
+      "request::end_run", 
       "request for [%s] [%s] failed with code %i and response: %s\n", 
       _method.c_str(),
       _url.c_str(), 
@@ -431,4 +685,3 @@ void request::run(int timeout_in_s)
       get_output_string().c_str());
   }
 }
-
@@ -29,6 +29,7 @@
 #include <string>
 #include <vector>
 #include <boost/function.hpp>
+#include <boost/detail/atomic_count.hpp>
 #include <boost/smart_ptr.hpp>
 #include <boost/utility.hpp>
 
@@ -70,14 +71,28 @@ namespace s3
     typedef boost::shared_ptr<char_vector> char_vector_ptr;
 
     class request_hook;
+    class transfer_reactor;
 
-    class request : boost::noncopyable
+    class request : public boost::enable_shared_from_this<request>, boost::noncopyable
     {
     public:
       static const int DEFAULT_REQUEST_TIMEOUT = -1;
 
       typedef boost::shared_ptr<request> ptr;
 
+      // called with zero once the request has run (at which point the 
+      // response can be inspected just as after run()), or with a negative
+      // error code.
+      typedef boost::function1<void, int> completion_fn;
+
+      // receives the response body in pieces, along with the offset of each
+      // piece within the body. returns non-zero to abort the request.
+      typedef boost::function3<int, const char *, size_t, size_t> output_sink_fn;
+
+      // fills buffer with size bytes of the request body, starting at offset.
+      // returns non-zero to abort the request.
+      typedef boost::function3<int, size_t, off_t, const char_vector_ptr &> input_source_fn;
+
       inline static std::string url_encode(const std::string &url)
       {
         const char *HEX = "0123456789ABCDEF";
@@ -119,6 +134,17 @@ namespace s3
       inline void set_input_buffer(const char_vector_ptr &buffer = char_vector_ptr())
       {
         _input_buffer = buffer;
+        _input_source.clear();
+      }
+
+      // rather than hold the whole body in memory, read it from source in 
+      // pieces as libcurl asks for it
+      inline void set_input_source(const input_source_fn &source, size_t size)
+      {
+        _input_buffer.reset();
+        _input_source = source;
+        _input_source_size = size;
+        _input_source_buffer.reset(new char_vector());
       }
 
       inline void set_input_buffer(const std::string &str)
@@ -132,6 +158,16 @@ namespace s3
 
       inline const std::vector<char> & get_output_buffer() { return _output_buffer; }
 
+      // the body of a response with the given status code goes to sink rather
+      // than to the output buffer (which still gets error responses)
+      inline void set_output_sink(const output_sink_fn &sink, long response_code)
+      {
+        _output_sink = sink;
+        _output_sink_response_code = response_code;
+      }
+
+      inline size_t get_output_sink_size() { return _output_sink_size; }
+
       inline std::string get_output_string()
       {
         std::string s;
@@ -151,22 +187,60 @@ namespace s3
       inline void reset_current_run_time() { _current_run_time = 0.0; }
       inline double get_current_run_time() { return _current_run_time; }
 
+      // for the last call to run(): total time across attempts, and the 
+      // time it took the successful attempt to get the first byte back
+      inline double get_last_run_time() { return _run_elapsed_time; }
+      inline double get_last_run_first_byte_time() { return _run_first_byte_time; }
+
       bool check_timeout();
 
       void run(int timeout_in_s = DEFAULT_REQUEST_TIMEOUT);
 
+      // runs the request on the transfer reactor rather than on the calling
+      // thread. the request must be held by a shared_ptr, and shouldn't be
+      // touched until on_complete is called (on a reactor thread, so it
+      // mustn't block).
+      void run_async(const completion_fn &on_complete, int timeout_in_s = DEFAULT_REQUEST_TIMEOUT);
+
     private:
+      friend class transfer_reactor;
+
+      enum attempt_result
+      {
+        AR_DONE,
+        AR_RETRY,
+        AR_RETRY_AFTER_DELAY
+      };
+
       static size_t header_process(char *data, size_t size, size_t items, void *context);
       static size_t output_write(char *data, size_t size, size_t items, void *context);
       static size_t input_read(char *data, size_t size, size_t items, void *context);
       static int input_seek(void *context, curl_off_t offset, int origin);
+      static int transfer_progress(void *context, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
 
       inline void rewind()
       {
         _input_pos = (_input_buffer ? &(*_input_buffer)[0] : NULL);
         _input_remaining = (_input_buffer ? _input_buffer->size() : 0);
+        _input_source_offset = 0;
+      }
+
+      inline size_t get_input_size()
+      {
+        if (_input_source)
+          return _input_source_size;
+
+        return _input_buffer ? _input_buffer->size() : 0;
       }
 
+      void run_on_reactor(int timeout_in_s);
+
+      // run() and the transfer reactor both drive requests through these
+      void begin_run(int timeout_in_s);
+      void begin_attempt();
+      attempt_result end_attempt(int curl_result);
+      void end_run();
+
       // not reset by init()
       curl_easy_handle _curl;
 
@@ -176,7 +250,12 @@ namespace s3
       uint64_t _run_count;
       uint64_t _total_bytes_transferred;
 
-      bool _canceled;
+      // set by transfer_reactor::cancel() and by watchdogs on other threads
+      boost::detail::atomic_count _canceled;
+
+      // also set by transfer_reactor::cancel(), to tell cancellations apart 
+      // from timeouts
+      boost::detail::atomic_count _abandoned;
       time_t _timeout;
 
       std::string _tag;
@@ -190,6 +269,10 @@ namespace s3
 
       std::vector<char> _output_buffer;
 
+      output_sink_fn _output_sink;
+      long _output_sink_response_code;
+      size_t _output_sink_size;
+
       long _response_code;
       time_t _last_modified;
 
@@ -198,6 +281,19 @@ namespace s3
       char_vector_ptr _input_buffer;
       const char *_input_pos;
       size_t _input_remaining;
+
+      input_source_fn _input_source;
+      size_t _input_source_size, _input_source_offset;
+      char_vector_ptr _input_source_buffer;
+
+      // reset by begin_run()
+      int _run_timeout_in_s;
+      int _run_attempts;
+      int _run_result;
+      double _run_elapsed_time, _run_first_byte_time;
+      uint64_t _run_bytes_transferred, _attempt_request_size;
+      curl_slist *_attempt_headers;
+      int _attempt_paused; // CURLPAUSE_RECV and/or CURLPAUSE_SEND, while over a bandwidth cap
     };
   }
 }
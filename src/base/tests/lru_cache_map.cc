@@ -1,10 +1,12 @@
 #include <string>
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 #include <gtest/gtest.h>
 
 #include "base/lru_cache_map.h"
 
 using boost::bind;
+using boost::lexical_cast;
 using std::string;
 
 using s3::base::lru_cache_map;
@@ -20,6 +22,35 @@ void append_to_string(const string &key, const int &i, string *str)
   *str += key;
 }
 
+size_t s_removable_checks = 0;
+
+inline bool count_checks_and_remove_if_over_100(const int &i)
+{
+  s_removable_checks++;
+
+  return (i > 100);
+}
+
+// returns the number of removability checks made while adding num_inserts
+// entries to a full map of which the oldest num_pinned entries aren't
+// removable
+size_t count_insert_checks(size_t max_size, size_t num_pinned, size_t num_inserts)
+{
+  lru_cache_map<string, int, count_checks_and_remove_if_over_100> c(max_size);
+
+  for (size_t i = 0; i < max_size; i++)
+    c["init" + lexical_cast<string>(i)] = (i < num_pinned) ? 1 : 101;
+
+  s_removable_checks = 0;
+
+  for (size_t i = 0; i < num_inserts; i++)
+    c["key" + lexical_cast<string>(i)] = 101;
+
+  EXPECT_EQ(max_size, c.get_size());
+
+  return s_removable_checks;
+}
+
 template <class T>
 string oldest(const T &t)
 {
@@ -169,3 +200,53 @@ TEST(lru_cache_map, remove_if_over_100)
   EXPECT_EQ(string("e1,e8,e5,e7,e6"), newest(c)) << "re-add e1, newest";
   EXPECT_EQ(string("e6,e7,e5,e8,e1"), oldest(c)) << "re-add e1, oldest";
 }
+
+TEST(lru_cache_map, eviction_checks)
+{
+  const size_t MAX_SIZE = 1000;
+  const size_t NUM_PINNED = 500;
+  const size_t NUM_INSERTS = 2000;
+
+  // one check per eviction when everything's removable
+  EXPECT_EQ(NUM_INSERTS, count_insert_checks(MAX_SIZE, 0, NUM_INSERTS));
+
+  // eviction shouldn't have to walk past pinned entries on every insert --
+  // each pinned entry is passed over once, and after that each insert 
+  // checks one pinned entry in addition to the entry it evicts
+  EXPECT_GE(NUM_PINNED + 2 * NUM_INSERTS, count_insert_checks(MAX_SIZE, NUM_PINNED, NUM_INSERTS));
+}
+
+TEST(lru_cache_map, max_total_size)
+{
+  lru_cache_map<string, int, remove_if_over_100> c(10, 100);
+
+  c["e1"] = 1;
+  c.set_entry_size("e1", 40);
+  c["e2"] = 102;
+  c.set_entry_size("e2", 30);
+  c["e3"] = 103;
+  c.set_entry_size("e3", 30);
+
+  EXPECT_EQ(static_cast<size_t>(100), c.get_total_size());
+  EXPECT_EQ(string("e3,e2,e1"), newest(c)) << "init, newest";
+
+  c["e4"] = 104;
+  c.set_entry_size("e4", 20);
+
+  EXPECT_EQ(static_cast<size_t>(90), c.get_total_size()) << "add e4";
+  EXPECT_EQ(string("e4,e3,e1"), newest(c)) << "add e4, newest";
+
+  c.set_entry_size("e3", 80);
+
+  EXPECT_EQ(static_cast<size_t>(120), c.get_total_size()) << "grow e3";
+  EXPECT_EQ(string("e3,e1"), newest(c)) << "grow e3, newest";
+
+  c.set_entry_size("e3", 100);
+
+  EXPECT_EQ(static_cast<size_t>(140), c.get_total_size()) << "grow e3 again";
+  EXPECT_EQ(string("e3,e1"), newest(c)) << "grow e3 again, newest";
+
+  c.erase("e3");
+
+  EXPECT_EQ(static_cast<size_t>(40), c.get_total_size()) << "erase e3";
+}
@@ -1,11 +1,292 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <fstream>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <boost/bind.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
 #include <gtest/gtest.h>
 
+#include "base/config.h"
 #include "base/request.h"
+#include "base/statistics.h"
+#include "base/timer.h"
+#include "base/transfer_reactor.h"
 
+using boost::bind;
+using boost::condition;
+using boost::lexical_cast;
+using boost::mutex;
+using boost::thread;
+using boost::detail::atomic_count;
+using std::istringstream;
+using std::ofstream;
+using std::ostringstream;
 using std::runtime_error;
+using std::string;
 
+using s3::base::config;
 using s3::base::request;
+using s3::base::statistics;
+using s3::base::timer;
+using s3::base::transfer_reactor;
+
+namespace
+{
+  class completion
+  {
+  public:
+    completion()
+      : _done(false),
+        _r(0)
+    {
+    }
+
+    void complete(int r)
+    {
+      mutex::scoped_lock lock(_mutex);
+
+      _r = r;
+      _done = true;
+      _condition.notify_all();
+    }
+
+    int wait()
+    {
+      mutex::scoped_lock lock(_mutex);
+
+      while (!_done)
+        _condition.wait(lock);
+
+      return _r;
+    }
+
+  private:
+    mutex _mutex;
+    condition _condition;
+    bool _done;
+    int _r;
+  };
+
+  int run_async(const request::ptr &r)
+  {
+    completion c;
+
+    r->run_async(bind(&completion::complete, &c, _1));
+
+    return c.wait();
+  }
+
+  // answers every request with body (a tiny one by default), and keeps 
+  // connections open until the client closes them
+  class local_server
+  {
+  public:
+    explicit local_server(const string &body = "ok")
+      : _connections(0),
+        _response("HTTP/1.1 200 OK\r\nContent-Length: " + lexical_cast<string>(body.size()) + "\r\n\r\n" + body)
+    {
+      // boost::bind is in scope too
+      int (*bind_socket)(int, const sockaddr *, socklen_t) = ::bind;
+      sockaddr_in addr;
+      socklen_t addr_len = sizeof(addr);
+
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+      _fd = socket(AF_INET, SOCK_STREAM, 0);
+
+      if (_fd == -1 || bind_socket(_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) || listen(_fd, 16))
+        throw runtime_error("failed to start local server.");
+
+      getsockname(_fd, reinterpret_cast<sockaddr *>(&addr), &addr_len);
+      _url = "http://127.0.0.1:" + lexical_cast<string>(ntohs(addr.sin_port)) + "/";
+
+      _thread.reset(new thread(bind(&local_server::accept_connections, this)));
+    }
+
+    ~local_server()
+    {
+      shutdown(_fd, SHUT_RDWR);
+      _thread->join();
+      close(_fd);
+    }
+
+    inline const string & get_url() { return _url; }
+    inline long get_connections() { return _connections; }
+
+  private:
+    void accept_connections()
+    {
+      int fd;
+
+      while ((fd = accept(_fd, NULL, NULL)) != -1) {
+        ++_connections;
+        thread(bind(&local_server::serve, fd, _response)).detach();
+      }
+    }
+
+    static void serve(int fd, const string &response)
+    {
+      string pending;
+      char buffer[1024];
+      ssize_t r;
+
+      while ((r = read(fd, buffer, sizeof(buffer))) > 0) {
+        size_t end;
+
+        pending.append(buffer, r);
+
+        while ((end = pending.find("\r\n\r\n")) != string::npos) {
+          pending.erase(0, end + 4);
+
+          if (write(fd, response.c_str(), response.size()) == -1)
+            break;
+        }
+      }
+
+      close(fd);
+    }
+
+    int _fd;
+    string _url;
+    atomic_count _connections;
+    string _response;
+    boost::scoped_ptr<thread> _thread;
+  };
+
+  void set_max_download_rate(int kb_per_s)
+  {
+    const char *TEMP_FILE = "/tmp/s3fuse.test-request_rate";
+
+    ofstream f(TEMP_FILE, ofstream::out | ofstream::trunc);
+
+    f <<
+      "bucket_name=test\n"
+      "service=aws\n"
+      "max_download_rate_in_kb_per_s=" << kb_per_s << "\n";
+
+    f.close();
+
+    config::init(TEMP_FILE);
+    unlink(TEMP_FILE);
+  }
+
+  void download(const string &url, size_t *size)
+  {
+    request r;
+
+    try {
+      r.init(s3::base::HTTP_GET);
+      r.set_url(url);
+      r.run();
+
+      *size = r.get_output_buffer().size();
+    } catch (...) {
+      *size = 0;
+    }
+  }
+
+  // accepts connections (or rather, lets the kernel do so) but never 
+  // answers, so requests to it stay in flight
+  class silent_server
+  {
+  public:
+    silent_server()
+    {
+      int (*bind_socket)(int, const sockaddr *, socklen_t) = ::bind;
+      sockaddr_in addr;
+      socklen_t addr_len = sizeof(addr);
+
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+      _fd = socket(AF_INET, SOCK_STREAM, 0);
+
+      if (_fd == -1 || bind_socket(_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) || listen(_fd, 16))
+        throw runtime_error("failed to start silent server.");
+
+      getsockname(_fd, reinterpret_cast<sockaddr *>(&addr), &addr_len);
+      _url = "http://127.0.0.1:" + lexical_cast<string>(ntohs(addr.sin_port)) + "/";
+    }
+
+    ~silent_server()
+    {
+      close(_fd);
+    }
+
+    inline const string & get_url() { return _url; }
+
+  private:
+    int _fd;
+    string _url;
+  };
+
+  // what all the statistics writers report
+  string get_statistics()
+  {
+    ostringstream out;
+
+    for (statistics::writers::const_iterator itor = statistics::writers::begin(); itor != statistics::writers::end(); ++itor)
+      itor->second(&out);
+
+    return out.str();
+  }
+
+  struct connection_counts
+  {
+    long reused, opened, tls_handshakes;
+  };
+
+  // reads the counts from what the request statistics writer reports
+  connection_counts get_connection_counts()
+  {
+    connection_counts c = { -1, -1, -1 };
+    istringstream in(get_statistics());
+    string line;
+
+    while (getline(in, line)) {
+      sscanf(line.c_str(), "  connections reused: %li, new: %li", &c.reused, &c.opened);
+      sscanf(line.c_str(), "  tls handshakes: %li", &c.tls_handshakes);
+    }
+
+    return c;
+  }
+
+  struct failure_counts
+  {
+    long request_timeouts, reactor_failures, reactor_timeouts, reactor_cancellations;
+  };
+
+  // reads the counts from what the request and transfer reactor statistics
+  // writers report
+  failure_counts get_failure_counts()
+  {
+    failure_counts c = { -1, -1, -1, -1 };
+    istringstream in(get_statistics());
+    string line;
+
+    while (getline(in, line)) {
+      sscanf(line.c_str(), "  timeouts: %li", &c.request_timeouts);
+      sscanf(line.c_str(), "  requests: %*d, failed: %li, timed out: %li", &c.reactor_failures, &c.reactor_timeouts);
+      sscanf(line.c_str(), "  retries: %*d, cancellations: %li", &c.reactor_cancellations);
+    }
+
+    return c;
+  }
+}
 
 TEST(request, bad_url)
 {
@@ -39,3 +320,173 @@ TEST(request, valid_page)
   ASSERT_EQ(s3::base::HTTP_SC_OK, r.get_response_code());
   ASSERT_FALSE(r.get_output_string().empty());
 }
+
+TEST(request, async_bad_url_without_reactor)
+{
+  request::ptr r(new request());
+
+  r->init(s3::base::HTTP_GET);
+  r->set_url("some:bad:url");
+
+  ASSERT_EQ(-ECANCELED, run_async(r));
+}
+
+TEST(request, async_bad_url)
+{
+  request::ptr r(new request());
+
+  transfer_reactor::init();
+
+  r->init(s3::base::HTTP_GET);
+  r->set_url("some:bad:url");
+
+  EXPECT_EQ(-ECANCELED, run_async(r));
+
+  transfer_reactor::terminate();
+}
+
+TEST(request, async_valid_pages)
+{
+  const int COUNT = 16;
+
+  request::ptr r[COUNT];
+  completion c[COUNT];
+
+  transfer_reactor::init();
+
+  for (int i = 0; i < COUNT; i++) {
+    r[i].reset(new request());
+    r[i]->init(s3::base::HTTP_GET);
+    r[i]->set_url("http://www.google.com/");
+    r[i]->run_async(bind(&completion::complete, &c[i], _1));
+  }
+
+  for (int i = 0; i < COUNT; i++) {
+    EXPECT_EQ(0, c[i].wait());
+    EXPECT_EQ(s3::base::HTTP_SC_OK, r[i]->get_response_code());
+    EXPECT_FALSE(r[i]->get_output_string().empty());
+  }
+
+  transfer_reactor::terminate();
+}
+
+TEST(request, async_cancel)
+{
+  silent_server server;
+  request::ptr r(new request());
+  completion c;
+  failure_counts before, after;
+
+  transfer_reactor::init();
+
+  before = get_failure_counts();
+
+  ASSERT_NE(-1, before.request_timeouts);
+  ASSERT_NE(-1, before.reactor_timeouts);
+  ASSERT_NE(-1, before.reactor_cancellations);
+
+  r->init(s3::base::HTTP_GET);
+  r->set_url(server.get_url());
+  r->run_async(bind(&completion::complete, &c, _1));
+
+  transfer_reactor::cancel(r);
+
+  EXPECT_EQ(-ECANCELED, c.wait());
+
+  after = get_failure_counts();
+
+  // counted once, as a cancellation rather than a failure or a timeout
+  EXPECT_EQ(1, after.reactor_cancellations - before.reactor_cancellations);
+  EXPECT_EQ(0, after.reactor_failures - before.reactor_failures);
+  EXPECT_EQ(0, after.reactor_timeouts - before.reactor_timeouts);
+  EXPECT_EQ(0, after.request_timeouts - before.request_timeouts);
+
+  transfer_reactor::terminate();
+}
+
+TEST(request, connection_statistics)
+{
+  local_server server;
+  connection_counts before, after;
+  request r;
+
+  before = get_connection_counts();
+
+  ASSERT_NE(-1, before.reused);
+  ASSERT_NE(-1, before.tls_handshakes);
+
+  for (int i = 0; i < 3; i++) {
+    r.init(s3::base::HTTP_GET);
+    r.set_url(server.get_url());
+    ASSERT_NO_THROW(r.run());
+
+    ASSERT_EQ(s3::base::HTTP_SC_OK, r.get_response_code());
+  }
+
+  after = get_connection_counts();
+
+  // a handle keeps its connection between requests
+  EXPECT_EQ(1, server.get_connections());
+  EXPECT_EQ(1, after.opened - before.opened);
+  EXPECT_EQ(2, after.reused - before.reused);
+  EXPECT_EQ(0, after.tls_handshakes - before.tls_handshakes);
+}
+
+TEST(request, handles_dont_share_connections)
+{
+  local_server server;
+  connection_counts before, after;
+  request r1, r2;
+
+  before = get_connection_counts();
+
+  r1.init(s3::base::HTTP_GET);
+  r1.set_url(server.get_url());
+  ASSERT_NO_THROW(r1.run());
+
+  // both handles are attached to the share (share_connection_state is on by
+  // default), but it only holds DNS lookups and TLS sessions, so this 
+  // request can't use r1's idle connection
+  r2.init(s3::base::HTTP_GET);
+  r2.set_url(server.get_url());
+  ASSERT_NO_THROW(r2.run());
+
+  after = get_connection_counts();
+
+  EXPECT_EQ(2, server.get_connections());
+  EXPECT_EQ(2, after.opened - before.opened);
+  EXPECT_EQ(0, after.reused - before.reused);
+}
+
+TEST(request, download_cap_is_shared)
+{
+  const int RATE_IN_KB = 1024;
+  const int TRANSFERS = 8;
+  const size_t BODY_SIZE = RATE_IN_KB * 1024 / 4;
+
+  local_server server(string(BODY_SIZE, 'x'));
+  boost::thread_group threads;
+  size_t sizes[TRANSFERS];
+  double start, elapsed;
+
+  set_max_download_rate(RATE_IN_KB);
+
+  start = timer::get_current_time();
+
+  for (int i = 0; i < TRANSFERS; i++)
+    threads.create_thread(bind(&download, server.get_url(), &sizes[i]));
+
+  threads.join_all();
+  elapsed = timer::get_current_time() - start;
+
+  set_max_download_rate(0);
+
+  for (int i = 0; i < TRANSFERS; i++)
+    EXPECT_EQ(BODY_SIZE, sizes[i]);
+
+  // that's two seconds' worth at the cap, one of which the bucket starts 
+  // with. capping each request at the full rate would let them all finish 
+  // in about a quarter of a second.
+  EXPECT_LT(0.75, elapsed);
+  EXPECT_GT(3.0, elapsed);
+}
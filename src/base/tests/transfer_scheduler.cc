@@ -0,0 +1,186 @@
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
+#include <gtest/gtest.h>
+
+#include "base/config.h"
+#include "base/transfer_scheduler.h"
+
+using boost::thread;
+
+using s3::base::config;
+using s3::base::transfer_scheduler;
+
+namespace
+{
+  typedef transfer_scheduler::transfer transfer;
+
+  void acquire_and_record(transfer *t, boost::mutex *m, std::vector<transfer *> *order)
+  {
+    t->acquire_slot(true);
+
+    boost::mutex::scoped_lock lock(*m);
+    order->push_back(t);
+  }
+
+  void acquire_in_background(transfer **t, boost::mutex *m, std::vector<transfer *> *order, boost::condition *created)
+  {
+    transfer_scheduler::background_scope background;
+
+    {
+      boost::mutex::scoped_lock lock(*m);
+
+      *t = new transfer(transfer_scheduler::TD_UPLOAD);
+      created->notify_all();
+    }
+
+    acquire_and_record(*t, m, order);
+  }
+
+  void fill(transfer *t)
+  {
+    while (t->acquire_slot(false))
+      ;
+  }
+
+  void release_all(transfer *t)
+  {
+    while (t->get_slots())
+      t->release_slot();
+  }
+
+  void wait_for_waiters(size_t count)
+  {
+    while (transfer_scheduler::get_waiter_count() != count)
+      boost::this_thread::yield();
+  }
+}
+
+TEST(transfer_scheduler, lone_transfer_gets_every_slot)
+{
+  transfer t(transfer_scheduler::TD_DOWNLOAD);
+
+  fill(&t);
+
+  EXPECT_EQ(static_cast<size_t>(config::get_max_transfers_in_progress()), t.get_slots());
+  EXPECT_EQ(transfer_scheduler::TP_INTERACTIVE, t.get_priority());
+
+  release_all(&t);
+}
+
+TEST(transfer_scheduler, waiters_go_ahead_of_hogs)
+{
+  transfer hog(transfer_scheduler::TD_DOWNLOAD), waiter(transfer_scheduler::TD_DOWNLOAD);
+  boost::mutex m;
+  std::vector<transfer *> order;
+  thread th;
+
+  fill(&hog);
+
+  th = thread(boost::bind(&acquire_and_record, &waiter, &m, &order));
+
+  wait_for_waiters(1);
+
+  hog.release_slot();
+
+  // the hog can't take its slot back from the waiter
+  EXPECT_FALSE(hog.acquire_slot(false));
+
+  th.join();
+
+  ASSERT_EQ(1u, order.size());
+  EXPECT_EQ(1u, waiter.get_slots());
+
+  release_all(&waiter);
+  release_all(&hog);
+}
+
+TEST(transfer_scheduler, interactive_transfers_share_evenly)
+{
+  transfer first(transfer_scheduler::TD_DOWNLOAD), second(transfer_scheduler::TD_DOWNLOAD);
+  const size_t fair_share = config::get_max_transfers_in_progress() / 2;
+
+  fill(&first);
+
+  // each time one of the first transfer's parts finishes, the slot goes to 
+  // the second transfer (which was turned away) until they're even
+  while (second.get_slots() < fair_share) {
+    EXPECT_FALSE(second.acquire_slot(false));
+
+    first.release_slot();
+
+    EXPECT_FALSE(first.acquire_slot(false));
+    EXPECT_TRUE(second.acquire_slot(false));
+  }
+
+  EXPECT_EQ(fair_share, first.get_slots());
+  EXPECT_EQ(fair_share, second.get_slots());
+
+  // once it has its share, being turned away doesn't hold anyone else back
+  EXPECT_FALSE(second.acquire_slot(false));
+
+  first.release_slot();
+
+  EXPECT_TRUE(first.acquire_slot(false));
+
+  release_all(&first);
+  release_all(&second);
+}
+
+TEST(transfer_scheduler, interactive_before_background)
+{
+  transfer hog(transfer_scheduler::TD_DOWNLOAD), interactive(transfer_scheduler::TD_DOWNLOAD);
+  transfer *background = NULL;
+  boost::mutex m;
+  boost::condition created;
+  std::vector<transfer *> order;
+  thread bg_th, int_th;
+
+  fill(&hog);
+
+  {
+    boost::mutex::scoped_lock lock(m);
+
+    bg_th = thread(boost::bind(&acquire_in_background, &background, &m, &order, &created));
+
+    while (!background)
+      created.wait(lock);
+  }
+
+  EXPECT_EQ(transfer_scheduler::TP_BACKGROUND, background->get_priority());
+
+  wait_for_waiters(1);
+
+  int_th = thread(boost::bind(&acquire_and_record, &interactive, &m, &order));
+
+  wait_for_waiters(2);
+
+  // one slot at a time, so that the order is clear
+  hog.release_slot();
+
+  while (true) {
+    boost::mutex::scoped_lock lock(m);
+
+    if (order.size() == 1)
+      break;
+
+    lock.unlock();
+    boost::this_thread::yield();
+  }
+
+  hog.release_slot();
+
+  bg_th.join();
+  int_th.join();
+
+  ASSERT_EQ(2u, order.size());
+  EXPECT_EQ(&interactive, order[0]);
+  EXPECT_EQ(background, order[1]);
+
+  release_all(&interactive);
+  release_all(background);
+  release_all(&hog);
+
+  delete background;
+}
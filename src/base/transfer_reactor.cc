@@ -0,0 +1,413 @@
+/*
+ * base/transfer_reactor.cc
+ * -------------------------------------------------------------------------
+ * Multi-interface transfer loop (implementation).
+ * -------------------------------------------------------------------------
+ * 
+ * Copyright (c) 2013, Tarick Bedeir.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+
+#include <stdexcept>
+#include <boost/bind.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+#include "config.h"
+#include "curl_easy_handle.h"
+#include "logger.h"
+#include "request.h"
+#include "statistics.h"
+#include "transfer_reactor.h"
+
+using boost::bind;
+using boost::mutex;
+using boost::scoped_ptr;
+using boost::shared_ptr;
+using boost::thread;
+using boost::detail::atomic_count;
+using std::ostream;
+using std::runtime_error;
+
+using s3::base::config;
+using s3::base::curl_easy_handle;
+using s3::base::request;
+using s3::base::statistics;
+using s3::base::transfer_reactor;
+
+namespace
+{
+  // how long the loop waits for activity before checking for timeouts and
+  // delayed retries (and, with older versions of libcurl that can't be
+  // woken up, for newly-added requests)
+  const int WAIT_TIMEOUT_IN_MS = 100;
+
+  atomic_count s_requests(0), s_failures(0), s_timeouts(0), s_retries(0), s_cancellations(0);
+  atomic_count s_in_flight(0);
+  long s_max_in_flight = 0; // guarded by s_max_in_flight_mutex
+  mutex s_max_in_flight_mutex;
+
+  // curl_easy_handle takes care of libcurl's global init and cleanup, so we
+  // hang on to one for as long as the multi handle is around
+  scoped_ptr<curl_easy_handle> s_init_ref;
+
+  void update_max_in_flight()
+  {
+    long in_flight = s_in_flight;
+    mutex::scoped_lock lock(s_max_in_flight_mutex);
+
+    if (in_flight > s_max_in_flight)
+      s_max_in_flight = in_flight;
+  }
+
+  void statistics_writer(ostream *o)
+  {
+    mutex::scoped_lock lock(s_max_in_flight_mutex);
+
+    *o <<
+      "transfer reactor:\n"
+      "  requests: " << s_requests << ", failed: " << s_failures << ", timed out: " << s_timeouts << "\n"
+      "  retries: " << s_retries << ", cancellations: " << s_cancellations << "\n"
+      "  max in flight: " << s_max_in_flight << "\n";
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
+}
+
+mutex transfer_reactor::s_mutex;
+transfer_reactor::loop_list transfer_reactor::s_loops;
+size_t transfer_reactor::s_next_loop = 0;
+bool transfer_reactor::s_done = false;
+
+void transfer_reactor::init()
+{
+  mutex::scoped_lock lock(s_mutex);
+  size_t threads = config::get_reactor_threads();
+
+  if (!s_loops.empty())
+    throw runtime_error("can't call transfer_reactor::init() more than once!");
+
+  s_init_ref.reset(new curl_easy_handle());
+  s_done = false;
+  s_next_loop = 0;
+
+  for (size_t i = 0; i < threads; i++) {
+    loop_ptr l(new loop());
+
+    l->multi = curl_multi_init();
+
+    if (!l->multi)
+      throw runtime_error("curl_multi_init() failed.");
+
+    // the connection limits are for the reactor as a whole, so each loop
+    // gets its share
+    #if LIBCURL_VERSION_NUM >= 0x071e00
+      curl_multi_setopt(l->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, static_cast<long>((config::get_max_reactor_connections() + threads - 1) / threads));
+      curl_multi_setopt(l->multi, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>((config::get_max_connections_per_host() + threads - 1) / threads));
+    #endif
+
+    #if LIBCURL_VERSION_NUM >= 0x072b00
+      if (config::get_http2())
+        curl_multi_setopt(l->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    #endif
+
+    // requests come and go with their handles, so without this the number of
+    // idle connections kept around would shrink along with the number of 
+    // handles in flight
+    curl_multi_setopt(l->multi, CURLMOPT_MAXCONNECTS, static_cast<long>((config::get_max_reactor_connections() + threads - 1) / threads));
+
+    s_loops.push_back(l);
+  }
+
+  for (loop_list::const_iterator itor = s_loops.begin(); itor != s_loops.end(); ++itor)
+    (*itor)->thread.reset(new thread(bind(&transfer_reactor::work, *itor)));
+}
+
+void transfer_reactor::terminate()
+{
+  mutex::scoped_lock lock(s_mutex);
+  loop_list loops;
+
+  if (s_loops.empty())
+    return;
+
+  s_done = true;
+
+  #if LIBCURL_VERSION_NUM >= 0x074400
+    for (loop_list::const_iterator itor = s_loops.begin(); itor != s_loops.end(); ++itor)
+      curl_multi_wakeup((*itor)->multi);
+  #endif
+
+  lock.unlock();
+
+  for (loop_list::const_iterator itor = s_loops.begin(); itor != s_loops.end(); ++itor)
+    (*itor)->thread->join();
+
+  lock.lock();
+
+  loops.swap(s_loops);
+
+  for (loop_list::const_iterator itor = loops.begin(); itor != loops.end(); ++itor)
+    curl_multi_cleanup((*itor)->multi);
+
+  s_init_ref.reset();
+}
+
+bool transfer_reactor::is_running()
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  return !s_loops.empty() && !s_done;
+}
+
+bool transfer_reactor::is_reactor_thread()
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  for (loop_list::const_iterator itor = s_loops.begin(); itor != s_loops.end(); ++itor)
+    if ((*itor)->thread && (*itor)->thread->get_id() == boost::this_thread::get_id())
+      return true;
+
+  return false;
+}
+
+void transfer_reactor::add(const shared_ptr<request> &req, const completion_fn &on_complete)
+{
+  mutex::scoped_lock lock(s_mutex);
+  transfer t;
+  loop_ptr l;
+
+  t.req = req;
+  t.on_complete = on_complete;
+  t.start_after = 0;
+
+  if (s_loops.empty() || s_done) {
+    lock.unlock();
+    complete(t, -ECANCELED);
+
+    return;
+  }
+
+  l = s_loops[s_next_loop++ % s_loops.size()];
+  l->pending.push_back(t);
+
+  #if LIBCURL_VERSION_NUM >= 0x074400
+    curl_multi_wakeup(l->multi);
+  #endif
+}
+
+void transfer_reactor::cancel(const shared_ptr<request> &req)
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  ++s_cancellations;
+
+  // the loops drop canceled requests just as they do timed-out ones. we 
+  // don't keep track of which loop has which request, so wake them all.
+  ++req->_abandoned;
+  ++req->_canceled;
+
+  #if LIBCURL_VERSION_NUM >= 0x074400
+    for (loop_list::const_iterator itor = s_loops.begin(); itor != s_loops.end(); ++itor)
+      curl_multi_wakeup((*itor)->multi);
+  #endif
+}
+
+void transfer_reactor::work(const loop_ptr &l)
+{
+  CURLM *multi = l->multi;
+  transfer_map active;
+  transfer_list delayed, pending;
+  time_t last_timeout_check = 0;
+  size_t max_in_flight = 0;
+
+  while (true) {
+    transfer_list ready;
+    time_t now = time(NULL);
+    CURLMsg *msg = NULL;
+    int running = 0, msgs_left = 0;
+
+    {
+      mutex::scoped_lock lock(s_mutex);
+
+      if (s_done)
+        break;
+
+      ready.splice(ready.end(), l->pending);
+    }
+
+    for (transfer_list::iterator itor = delayed.begin(); itor != delayed.end(); /* do nothing */) {
+      if (itor->start_after > now)
+        ++itor;
+      else
+        ready.splice(ready.end(), delayed, itor++);
+    }
+
+    for (transfer_list::const_iterator itor = ready.begin(); itor != ready.end(); ++itor)
+      start(multi, *itor, &active);
+
+    if (active.size() > max_in_flight) {
+      max_in_flight = active.size();
+      update_max_in_flight();
+    }
+
+    curl_multi_perform(multi, &running);
+
+    while ((msg = curl_multi_info_read(multi, &msgs_left))) {
+      CURL *handle = msg->easy_handle;
+      int curl_result = msg->data.result;
+      transfer_map::iterator itor;
+      transfer t;
+
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+
+      itor = active.find(handle);
+
+      if (itor == active.end())
+        continue;
+
+      // msg isn't valid past this point
+      curl_multi_remove_handle(multi, handle);
+
+      t = itor->second;
+      active.erase(itor);
+      --s_in_flight;
+
+      finish(t, curl_result, &delayed);
+    }
+
+    // the same check that pool watchdogs make of blocking requests, plus
+    // one for canceled requests (which needn't wait for the next second)
+    for (transfer_map::iterator itor = active.begin(); itor != active.end(); /* do nothing */) {
+      const request::ptr &req = itor->second.req;
+      transfer t;
+
+      if (!req->_canceled && (now == last_timeout_check || !req->check_timeout())) {
+        ++itor;
+        continue;
+      }
+
+      t = itor->second;
+
+      curl_multi_remove_handle(multi, itor->first);
+      active.erase(itor++);
+      --s_in_flight;
+
+      finish(t, CURLE_OPERATION_TIMEDOUT, &delayed);
+    }
+
+    last_timeout_check = now;
+
+    #if LIBCURL_VERSION_NUM >= 0x074400
+      curl_multi_poll(multi, NULL, 0, WAIT_TIMEOUT_IN_MS, NULL);
+    #else
+      curl_multi_wait(multi, NULL, 0, WAIT_TIMEOUT_IN_MS, NULL);
+    #endif
+  }
+
+  {
+    mutex::scoped_lock lock(s_mutex);
+
+    pending.swap(l->pending);
+  }
+
+  for (transfer_map::iterator itor = active.begin(); itor != active.end(); ++itor) {
+    curl_multi_remove_handle(multi, itor->first);
+    --s_in_flight;
+    complete(itor->second, -ECANCELED);
+  }
+
+  for (transfer_list::const_iterator itor = delayed.begin(); itor != delayed.end(); ++itor)
+    complete(*itor, -ECANCELED);
+
+  for (transfer_list::const_iterator itor = pending.begin(); itor != pending.end(); ++itor)
+    complete(*itor, -ECANCELED);
+}
+
+void transfer_reactor::start(CURLM *multi, const transfer &t, transfer_map *active)
+{
+  CURL *handle = t.req->_curl;
+
+  try {
+    t.req->begin_attempt();
+
+  } catch (const std::exception &e) {
+    S3_LOG(LOG_WARNING, "transfer_reactor::start", "caught exception: %s\n", e.what());
+    complete(t, -ECANCELED);
+
+    return;
+  }
+
+  if (curl_multi_add_handle(multi, handle) != CURLM_OK) {
+    S3_LOG(LOG_WARNING, "transfer_reactor::start", "failed to add handle for [%s].\n", t.req->get_url().c_str());
+    complete(t, -ECANCELED);
+
+    return;
+  }
+
+  (*active)[handle] = t;
+  ++s_in_flight;
+}
+
+void transfer_reactor::finish(const transfer &t, int curl_result, transfer_list *delayed)
+{
+  int r = 0;
+
+  try {
+    request::attempt_result ar = t.req->end_attempt(curl_result);
+
+    if (ar != request::AR_DONE) {
+      ++s_retries;
+
+      delayed->push_back(t);
+      delayed->back().start_after = (ar == request::AR_RETRY_AFTER_DELAY) ? time(NULL) + 1 : 0;
+
+      return;
+    }
+
+    t.req->end_run();
+
+  } catch (const std::exception &e) {
+    S3_LOG(LOG_WARNING, "transfer_reactor::finish", "caught exception: %s\n", e.what());
+
+    if (t.req->_abandoned) {
+      r = -ECANCELED; // cancel() counted it already
+    } else if (t.req->_canceled) {
+      ++s_timeouts;
+      r = -ETIMEDOUT;
+    } else {
+      ++s_failures;
+      r = -ECANCELED;
+    }
+  }
+
+  complete(t, r);
+}
+
+void transfer_reactor::complete(const transfer &t, int r)
+{
+  ++s_requests;
+
+  try {
+    t.on_complete(r);
+
+  } catch (const std::exception &e) {
+    S3_LOG(LOG_WARNING, "transfer_reactor::complete", "caught exception: %s\n", e.what());
+
+  } catch (...) {
+    S3_LOG(LOG_WARNING, "transfer_reactor::complete", "caught unknown exception.\n");
+  }
+}
@@ -0,0 +1,98 @@
+/*
+ * base/transfer_reactor.h
+ * -------------------------------------------------------------------------
+ * Runs many requests at once on a handful of threads, using libcurl's
+ * multi interface.
+ * -------------------------------------------------------------------------
+ * 
+ * Copyright (c) 2013, Tarick Bedeir.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_BASE_TRANSFER_REACTOR_H
+#define S3_BASE_TRANSFER_REACTOR_H
+
+#include <time.h>
+#include <curl/curl.h>
+
+#include <list>
+#include <map>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/smart_ptr.hpp>
+#include <boost/thread.hpp>
+
+namespace s3
+{
+  namespace base
+  {
+    class request;
+
+    class transfer_reactor
+    {
+    public:
+      typedef boost::function1<void, int> completion_fn;
+
+      static void init();
+      static void terminate();
+
+      static bool is_running();
+      static bool is_reactor_thread();
+
+      // see request::run_async()
+      static void add(const boost::shared_ptr<request> &req, const completion_fn &on_complete);
+
+      // fails req (added with add()) with -ECANCELED without waiting for 
+      // its timeout
+      static void cancel(const boost::shared_ptr<request> &req);
+
+    private:
+      struct transfer
+      {
+        boost::shared_ptr<request> req;
+        completion_fn on_complete;
+        time_t start_after;
+      };
+
+      typedef std::list<transfer> transfer_list;
+      typedef std::map<CURL *, transfer> transfer_map;
+
+      // each loop runs its own multi handle on its own thread, so that the 
+      // work done by output sinks (writes, hashing, decryption) isn't all
+      // stuck on one core
+      struct loop
+      {
+        CURLM *multi;
+        boost::shared_ptr<boost::thread> thread;
+        transfer_list pending;
+      };
+
+      typedef boost::shared_ptr<loop> loop_ptr;
+      typedef std::vector<loop_ptr> loop_list;
+
+      static void work(const loop_ptr &l);
+
+      static void start(CURLM *multi, const transfer &t, transfer_map *active);
+      static void finish(const transfer &t, int curl_result, transfer_list *delayed);
+      static void complete(const transfer &t, int r);
+
+      static boost::mutex s_mutex;
+      static loop_list s_loops;
+      static size_t s_next_loop;
+      static bool s_done;
+    };
+  }
+}
+
+#endif
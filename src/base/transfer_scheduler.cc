@@ -0,0 +1,304 @@
+/*
+ * base/transfer_scheduler.cc
+ * -------------------------------------------------------------------------
+ * Transfer slot and bandwidth scheduling (implementation).
+ * -------------------------------------------------------------------------
+ * 
+ * Copyright (c) 2013, Tarick Bedeir.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <time.h>
+
+#include <boost/detail/atomic_count.hpp>
+
+#include "config.h"
+#include "statistics.h"
+#include "timer.h"
+#include "transfer_scheduler.h"
+
+using boost::condition;
+using boost::mutex;
+using boost::thread_specific_ptr;
+using boost::detail::atomic_count;
+using std::ostream;
+
+using s3::base::config;
+using s3::base::statistics;
+using s3::base::timer;
+using s3::base::transfer_scheduler;
+
+namespace
+{
+  // a token bucket, with up to a second's worth of tokens
+  struct bucket
+  {
+    mutex access_mutex;
+    double tokens;
+    double last_refill;
+
+    inline bucket()
+      : tokens(0.0),
+        last_refill(0.0)
+    {
+    }
+  };
+
+  bucket s_buckets[2]; // indexed by direction
+
+  // set by background_scope
+  thread_specific_ptr<transfer_scheduler::priority> s_thread_priority;
+
+  atomic_count s_slot_waits(0), s_slots_denied(0);
+  atomic_count s_download_throttles(0), s_upload_throttles(0);
+
+  void statistics_writer(ostream *o)
+  {
+    *o <<
+      "transfer scheduler:\n"
+      "  waits for slots: " << s_slot_waits << ", extra slots denied: " << s_slots_denied << "\n"
+      "  downloads throttled: " << s_download_throttles << ", uploads throttled: " << s_upload_throttles << "\n";
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
+
+  inline double get_rate(transfer_scheduler::direction d)
+  {
+    return 1024.0 * ((d == transfer_scheduler::TD_DOWNLOAD)
+      ? config::get_max_download_rate_in_kb_per_s()
+      : config::get_max_upload_rate_in_kb_per_s());
+  }
+
+  // call with b->access_mutex held
+  void refill(bucket *b, double rate)
+  {
+    double now = timer::get_current_time();
+
+    if (b->last_refill == 0.0)
+      b->tokens = rate;
+    else
+      b->tokens += rate * (now - b->last_refill);
+
+    if (b->tokens > rate)
+      b->tokens = rate;
+
+    b->last_refill = now;
+  }
+}
+
+mutex transfer_scheduler::s_mutex;
+condition transfer_scheduler::s_condition;
+size_t transfer_scheduler::s_transfers = 0;
+size_t transfer_scheduler::s_slots_in_use = 0;
+size_t transfer_scheduler::s_wanting = 0;
+transfer_scheduler::transfer_list transfer_scheduler::s_waiting[2];
+
+transfer_scheduler::transfer::transfer(direction d)
+  : _direction(d),
+    _priority(s_thread_priority.get() ? *s_thread_priority : TP_INTERACTIVE),
+    _slots(0),
+    _wanting(false)
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  s_transfers++;
+}
+
+transfer_scheduler::transfer::~transfer()
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  s_transfers--;
+  s_slots_in_use -= _slots;
+
+  if (_wanting)
+    s_wanting--;
+
+  // our share goes to everyone else
+  s_condition.notify_all();
+}
+
+bool transfer_scheduler::transfer::acquire_slot(bool wait)
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  if (!can_grant(this, false)) {
+    if (!wait) {
+      ++s_slots_denied;
+
+      // transfers that don't wait still need to stop everyone else from
+      // holding on to more than their share
+      if (!_wanting && _slots < get_fair_share()) {
+        _wanting = true;
+        s_wanting++;
+      }
+
+      return false;
+    }
+
+    ++s_slot_waits;
+    s_waiting[_priority].push_back(this);
+
+    while (!can_grant(this, true))
+      s_condition.wait(lock);
+
+    s_waiting[_priority].pop_front();
+
+    // there may be enough free slots for the next waiter too
+    s_condition.notify_all();
+  }
+
+  s_slots_in_use++;
+  _slots++;
+
+  if (_wanting) {
+    _wanting = false;
+    s_wanting--;
+  }
+
+  return true;
+}
+
+void transfer_scheduler::transfer::release_slot()
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  s_slots_in_use--;
+  _slots--;
+
+  s_condition.notify_all();
+}
+
+transfer_scheduler::background_scope::background_scope()
+  : _was_background(s_thread_priority.get() && *s_thread_priority == TP_BACKGROUND)
+{
+  s_thread_priority.reset(new priority(TP_BACKGROUND));
+}
+
+transfer_scheduler::background_scope::~background_scope()
+{
+  if (!_was_background)
+    s_thread_priority.reset();
+}
+
+size_t transfer_scheduler::get_fair_share()
+{
+  return config::get_max_transfers_in_progress() / s_transfers;
+}
+
+bool transfer_scheduler::can_grant(const transfer *t, bool waiting)
+{
+  if (s_slots_in_use >= static_cast<size_t>(config::get_max_transfers_in_progress()))
+    return false;
+
+  // waiters are served in order, interactive ones first
+  if (waiting)
+    return
+      s_waiting[t->_priority].front() == t &&
+      (t->_priority == TP_INTERACTIVE || s_waiting[TP_INTERACTIVE].empty());
+
+  for (int p = TP_INTERACTIVE; p <= t->_priority; p++)
+    if (!s_waiting[p].empty())
+      return false;
+
+  // nobody else wants more, so there's no need to share
+  if (s_waiting[TP_BACKGROUND].empty() && s_wanting == (t->_wanting ? 1u : 0u))
+    return true;
+
+  return t->_slots < get_fair_share() || t->_slots == 0;
+}
+
+void transfer_scheduler::charge(direction d, size_t bytes)
+{
+  double rate = get_rate(d);
+  bucket *b = &s_buckets[d];
+
+  if (rate == 0.0)
+    return;
+
+  mutex::scoped_lock lock(b->access_mutex);
+
+  refill(b, rate);
+
+  // this can go negative, in which case the next transfer waits until the
+  // debt is paid off
+  b->tokens -= bytes;
+}
+
+size_t transfer_scheduler::get_waiter_count()
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  return s_waiting[TP_INTERACTIVE].size() + s_waiting[TP_BACKGROUND].size();
+}
+
+size_t transfer_scheduler::get_max_rate(direction d)
+{
+  return static_cast<size_t>(get_rate(d));
+}
+
+bool transfer_scheduler::is_over_cap(direction d)
+{
+  double rate = get_rate(d);
+  bucket *b = &s_buckets[d];
+
+  if (rate == 0.0)
+    return false;
+
+  mutex::scoped_lock lock(b->access_mutex);
+
+  refill(b, rate);
+
+  return b->tokens < 0.0;
+}
+
+void transfer_scheduler::wait_for_bandwidth(direction d)
+{
+  double rate = get_rate(d);
+  bucket *b = &s_buckets[d];
+  bool throttled = false;
+
+  if (rate == 0.0)
+    return;
+
+  mutex::scoped_lock lock(b->access_mutex);
+
+  while (true) {
+    double wait_time;
+    timespec ts;
+
+    refill(b, rate);
+
+    if (b->tokens >= 0.0)
+      break;
+
+    if (!throttled) {
+      throttled = true;
+
+      if (d == TD_DOWNLOAD)
+        ++s_download_throttles;
+      else
+        ++s_upload_throttles;
+    }
+
+    wait_time = -b->tokens / rate;
+
+    ts.tv_sec = static_cast<time_t>(wait_time);
+    ts.tv_nsec = static_cast<long>((wait_time - ts.tv_sec) * 1.0e9);
+
+    lock.unlock();
+    nanosleep(&ts, NULL);
+    lock.lock();
+  }
+}
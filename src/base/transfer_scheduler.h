@@ -0,0 +1,126 @@
+/*
+ * base/transfer_scheduler.h
+ * -------------------------------------------------------------------------
+ * Shares part slots and bandwidth among concurrent file transfers.
+ * -------------------------------------------------------------------------
+ * 
+ * Copyright (c) 2013, Tarick Bedeir.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_BASE_TRANSFER_SCHEDULER_H
+#define S3_BASE_TRANSFER_SCHEDULER_H
+
+#include <list>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/utility.hpp>
+
+namespace s3
+{
+  namespace base
+  {
+    class transfer_scheduler
+    {
+    public:
+      enum direction
+      {
+        TD_DOWNLOAD,
+        TD_UPLOAD
+      };
+
+      enum priority
+      {
+        TP_INTERACTIVE,
+        TP_BACKGROUND
+      };
+
+      // one per multi-part transfer. slots (at most max_transfers_in_progress
+      // of them, across all transfers) go first to transfers waiting with
+      // nothing in progress, interactive ones ahead of background ones, and
+      // a transfer can only take more than its fair share when no one else
+      // is waiting, and no one with less than their share has been turned
+      // away since they last got a slot.
+      class transfer : boost::noncopyable
+      {
+      public:
+        // the priority is that of the calling thread (see background_scope)
+        transfer(direction d);
+        ~transfer();
+
+        // if wait is false, returns false rather than wait for a slot
+        bool acquire_slot(bool wait);
+        void release_slot();
+
+        inline void set_direction(direction d) { _direction = d; }
+        inline void wait_for_bandwidth() { transfer_scheduler::wait_for_bandwidth(_direction); }
+
+        inline priority get_priority() const { return _priority; }
+        inline size_t get_slots() const { return _slots; }
+
+      private:
+        friend class transfer_scheduler;
+
+        direction _direction;
+        priority _priority;
+        size_t _slots;
+        bool _wanting;
+      };
+
+      // transfers set up on this thread while this is in scope (i.e.,
+      // write-backs) yield to everyone else's
+      class background_scope : boost::noncopyable
+      {
+      public:
+        background_scope();
+        ~background_scope();
+
+      private:
+        bool _was_background;
+      };
+
+      // the number of transfers blocked in acquire_slot()
+      static size_t get_waiter_count();
+
+      // counts bytes against the bandwidth cap for direction d, if there is
+      // one (requests call this as they send and receive data)
+      static void charge(direction d, size_t bytes);
+
+      // the bandwidth cap for direction d, in bytes per second, or zero if
+      // there's no cap
+      static size_t get_max_rate(direction d);
+
+      // true if direction d is over its bandwidth cap, in which case 
+      // requests hold off sending or receiving until it isn't
+      static bool is_over_cap(direction d);
+
+      // returns once the bandwidth cap for direction d allows another
+      // transfer to start
+      static void wait_for_bandwidth(direction d);
+
+    private:
+      typedef std::list<transfer *> transfer_list;
+
+      static bool can_grant(const transfer *t, bool waiting);
+      static size_t get_fair_share();
+
+      static boost::mutex s_mutex;
+      static boost::condition s_condition;
+      static size_t s_transfers, s_slots_in_use, s_wanting;
+      static transfer_list s_waiting[2]; // indexed by priority
+    };
+  }
+}
+
+#endif
@@ -19,19 +19,172 @@
  * limitations under the License.
  */
 
+#include <limits.h>
 #include <string.h>
 
+#include <openssl/evp.h>
+
+#include <vector>
+#include <boost/thread/mutex.hpp>
+
 #include "crypto/aes_ctr_256.h"
 #include "crypto/symmetric_key.h"
 
+using boost::mutex;
+using boost::shared_ptr;
 using std::runtime_error;
+using std::vector;
 
 using s3::crypto::aes_ctr_256;
 using s3::crypto::symmetric_key;
 
+namespace
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L
+  // an EVP context that has been given the key (and so has already expanded
+  // it). contexts can't be shared between threads, so each call borrows a 
+  // copy, and copies are kept for later calls rather than freed. EVP picks
+  // AES-NI (or whatever else is fastest) at run time.
+  class key_schedule : public symmetric_key::cipher_state
+  {
+  public:
+    key_schedule(const symmetric_key::ptr &key)
+      : _ctx(EVP_CIPHER_CTX_new())
+    {
+      const EVP_CIPHER *cipher = NULL;
+
+      switch (key->get_key()->size()) {
+        case (128 / 8):
+          cipher = EVP_aes_128_ctr();
+          break;
+
+        case (192 / 8):
+          cipher = EVP_aes_192_ctr();
+          break;
+
+        case (256 / 8):
+          cipher = EVP_aes_256_ctr();
+          break;
+      }
+
+      if (!_ctx)
+        throw runtime_error("EVP_CIPHER_CTX_new() failed in aes_ctr_256");
+
+      if (!cipher || EVP_EncryptInit_ex(_ctx, cipher, NULL, key->get_key()->get(), NULL) == 0) {
+        EVP_CIPHER_CTX_free(_ctx);
+        throw runtime_error("failed to set encryption key for aes_ctr_256");
+      }
+    }
+
+    ~key_schedule()
+    {
+      for (size_t i = 0; i < _idle.size(); i++)
+        EVP_CIPHER_CTX_free(_idle[i]);
+
+      EVP_CIPHER_CTX_free(_ctx);
+    }
+
+    void crypt(const uint8_t *iv, const uint8_t *in, size_t size, uint8_t *out)
+    {
+      EVP_CIPHER_CTX *ctx = acquire();
+      bool ok;
+
+      // setting the iv also starts the counter over
+      ok = EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv);
+
+      while (ok && size) {
+        int piece = (size > INT_MAX / 2) ? INT_MAX / 2 : size;
+        int updated = 0;
+
+        ok = EVP_EncryptUpdate(ctx, out, &updated, in, piece) && updated == piece;
+
+        in += piece;
+        out += piece;
+        size -= piece;
+      }
+
+      if (!ok) {
+        EVP_CIPHER_CTX_free(ctx);
+        throw runtime_error("EVP_EncryptUpdate() failed in aes_ctr_256");
+      }
+
+      release(ctx);
+    }
+
+  private:
+    EVP_CIPHER_CTX * acquire()
+    {
+      EVP_CIPHER_CTX *ctx = NULL;
+
+      {
+        mutex::scoped_lock lock(_mutex);
+
+        if (!_idle.empty()) {
+          ctx = _idle.back();
+          _idle.pop_back();
+
+          return ctx;
+        }
+      }
+
+      ctx = EVP_CIPHER_CTX_new();
+
+      if (!ctx)
+        throw runtime_error("EVP_CIPHER_CTX_new() failed in aes_ctr_256");
+
+      if (!EVP_CIPHER_CTX_copy(ctx, _ctx)) {
+        EVP_CIPHER_CTX_free(ctx);
+        throw runtime_error("EVP_CIPHER_CTX_copy() failed in aes_ctr_256");
+      }
+
+      return ctx;
+    }
+
+    void release(EVP_CIPHER_CTX *ctx)
+    {
+      mutex::scoped_lock lock(_mutex);
+
+      _idle.push_back(ctx);
+    }
+
+    EVP_CIPHER_CTX *_ctx;
+
+    mutex _mutex;
+    vector<EVP_CIPHER_CTX *> _idle;
+  };
+#else
+  // older versions of OpenSSL have no EVP counter mode
+  class key_schedule : public symmetric_key::cipher_state
+  {
+  public:
+    key_schedule(const symmetric_key::ptr &key)
+    {
+      if (AES_set_encrypt_key(key->get_key()->get(), key->get_key()->size() * 8 /* in bits */, &_key) != 0)
+        throw runtime_error("failed to set encryption key for aes_ctr_256");
+    }
+
+    void crypt(const uint8_t *iv, const uint8_t *in, size_t size, uint8_t *out)
+    {
+      uint8_t counter[aes_ctr_256::BLOCK_LEN];
+      uint8_t ecount_buf[aes_ctr_256::BLOCK_LEN];
+      unsigned int num = 0;
+
+      memcpy(counter, iv, sizeof(counter));
+      memset(ecount_buf, 0, sizeof(ecount_buf));
+
+      AES_ctr128_encrypt(in, out, size, &_key, counter, ecount_buf, &num);
+    }
+
+  private:
+    AES_KEY _key;
+  };
+#endif
+}
+
 void aes_ctr_256::crypt(const symmetric_key::ptr &key, uint64_t starting_block, const uint8_t *in, size_t size, uint8_t *out)
 {
   uint8_t iv[BLOCK_LEN];
+  shared_ptr<key_schedule> schedule;
 
   if (key->get_iv()->size() != IV_LEN)
     throw runtime_error("iv length is not valid for aes_ctr_256");
@@ -41,14 +194,14 @@ void aes_ctr_256::crypt(const symmetric_key::ptr &key, uint64_t starting_block,
   memcpy(iv, key->get_iv()->get(), IV_LEN);
   memcpy(iv + IV_LEN, &starting_block, sizeof(starting_block));
 
-  AES_KEY aes_key;
-  uint8_t ecount_buf[BLOCK_LEN];
-  unsigned int num = 0;
-
-  memset(ecount_buf, 0, sizeof(ecount_buf));
+  // expanding the key costs more than encrypting a few blocks, so only do it
+  // once per key
+  schedule = key->get_cipher_state<key_schedule>();
 
-  if (AES_set_encrypt_key(key->get_key()->get(), key->get_key()->size() * 8 /* in bits */, &aes_key) != 0)
-    throw runtime_error("failed to set encryption key for aes_ctr_256");
+  if (!schedule) {
+    schedule.reset(new key_schedule(key));
+    key->set_cipher_state(schedule);
+  }
 
-  AES_ctr128_encrypt(in, out, size, &aes_key, iv, ecount_buf, &num);
+  schedule->crypt(iv, in, size, out);
 }
@@ -25,10 +25,12 @@
 #include <stdexcept>
 #include <string>
 #include <vector>
+#include <boost/bind.hpp>
 #include <boost/smart_ptr.hpp>
 
 #include "crypto/encoder.h"
 #include "crypto/hash.h"
+#include "crypto/hash_pool.h"
 
 namespace s3
 {
@@ -67,6 +69,44 @@ namespace s3
         }
       }
 
+      // as above, but splits the chunks in [offset, offset + size) into up 
+      // to max_threads pieces (or one per core, if max_threads is zero) and
+      // hashes them on hash_pool's threads
+      inline void compute_hash_parallel(size_t offset, const uint8_t *data, size_t size, unsigned int max_threads = 0)
+      {
+        size_t chunk_count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        size_t chunks_per_thread = 0;
+        std::vector<hash_pool::task> tasks;
+
+        if (offset % CHUNK_SIZE)
+          throw std::runtime_error("cannot compute hash if offset is not chunk-aligned");
+
+        if (max_threads == 0)
+          max_threads = hash_pool::get_concurrency();
+
+        if (max_threads > chunk_count)
+          max_threads = chunk_count;
+
+        if (max_threads <= 1) {
+          compute_hash(offset, data, size);
+          return;
+        }
+
+        chunks_per_thread = (chunk_count + max_threads - 1) / max_threads;
+
+        for (size_t first = 0; first < chunk_count; first += chunks_per_thread) {
+          size_t begin = first * CHUNK_SIZE;
+          size_t end = (first + chunks_per_thread) * CHUNK_SIZE;
+
+          if (end > size)
+            end = size;
+
+          tasks.push_back(boost::bind(&hash_list::compute_hash, this, offset + begin, data + begin, end - begin));
+        }
+
+        hash_pool::run(tasks);
+      }
+
       template <class encoder_type>
       inline std::string get_root_hash()
       {
@@ -0,0 +1,183 @@
+/*
+ * crypto/hash_pool.cc
+ * -------------------------------------------------------------------------
+ * Long-lived hashing threads (implementation).
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2013, Tarick Bedeir.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <deque>
+#include <stdexcept>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
+
+#include "crypto/hash_pool.h"
+
+using boost::condition;
+using boost::mutex;
+using boost::thread;
+using std::deque;
+using std::runtime_error;
+using std::vector;
+
+using s3::crypto::hash_pool;
+
+namespace
+{
+  struct job
+  {
+    const vector<hash_pool::task> *tasks;
+    size_t next, remaining;
+    bool failed;
+    condition done;
+  };
+
+  // never freed, since the threads never exit
+  mutex *s_mutex = NULL;
+  condition *s_condition = NULL;
+  deque<job *> *s_jobs = NULL;
+  unsigned int s_concurrency = 0;
+  boost::once_flag s_init_flag = BOOST_ONCE_INIT;
+
+  // takes the next task from the oldest job, if there is one. call with 
+  // s_mutex held.
+  bool take_task(job **j, size_t *index)
+  {
+    if (s_jobs->empty())
+      return false;
+
+    *j = s_jobs->front();
+    *index = (*j)->next++;
+
+    if ((*j)->next == (*j)->tasks->size())
+      s_jobs->pop_front();
+
+    return true;
+  }
+
+  // runs task index of j, then reports back. call with lock held.
+  void run_task(mutex::scoped_lock &lock, job *j, size_t index)
+  {
+    bool ok = true;
+
+    lock.unlock();
+
+    try {
+      (*j->tasks)[index]();
+
+    } catch (...) {
+      ok = false;
+    }
+
+    lock.lock();
+
+    if (!ok)
+      j->failed = true;
+
+    if (--j->remaining == 0)
+      j->done.notify_all();
+  }
+
+  void worker()
+  {
+    mutex::scoped_lock lock(*s_mutex);
+
+    while (true) {
+      job *j = NULL;
+      size_t index = 0;
+
+      if (!take_task(&j, &index)) {
+        s_condition->wait(lock);
+        continue;
+      }
+
+      run_task(lock, j, index);
+    }
+  }
+
+  void init()
+  {
+    s_mutex = new mutex();
+    s_condition = new condition();
+    s_jobs = new deque<job *>();
+
+    s_concurrency = thread::hardware_concurrency();
+
+    if (s_concurrency == 0)
+      s_concurrency = 1;
+
+    // the caller works on its own job too, so one fewer thread than cores
+    for (unsigned int i = 1; i < s_concurrency; i++) {
+      thread t(worker);
+
+      t.detach();
+    }
+  }
+
+  mutex & get_mutex()
+  {
+    boost::call_once(init, s_init_flag);
+
+    return *s_mutex;
+  }
+}
+
+unsigned int hash_pool::get_concurrency()
+{
+  mutex::scoped_lock lock(get_mutex());
+
+  return s_concurrency;
+}
+
+void hash_pool::run(const vector<task> &tasks)
+{
+  mutex::scoped_lock lock(get_mutex());
+  job j;
+
+  if (tasks.empty())
+    return;
+
+  j.tasks = &tasks;
+  j.next = 0;
+  j.remaining = tasks.size();
+  j.failed = false;
+
+  s_jobs->push_back(&j);
+  s_condition->notify_all();
+
+  // rather than sit idle, the caller runs its own tasks (and only its own,
+  // so that it doesn't end up waiting on someone else's) until none are left
+  while (j.next < tasks.size()) {
+    size_t index = j.next++;
+
+    if (j.next == tasks.size()) {
+      for (deque<job *>::iterator itor = s_jobs->begin(); itor != s_jobs->end(); ++itor) {
+        if (*itor == &j) {
+          s_jobs->erase(itor);
+          break;
+        }
+      }
+    }
+
+    run_task(lock, &j, index);
+  }
+
+  while (j.remaining)
+    j.done.wait(lock);
+
+  if (j.failed)
+    throw runtime_error("hashing task failed.");
+}
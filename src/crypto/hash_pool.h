@@ -0,0 +1,50 @@
+/*
+ * crypto/hash_pool.h
+ * -------------------------------------------------------------------------
+ * Long-lived threads for spreading hashing work across cores.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2013, Tarick Bedeir.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_CRYPTO_HASH_POOL_H
+#define S3_CRYPTO_HASH_POOL_H
+
+#include <vector>
+#include <boost/function.hpp>
+
+namespace s3
+{
+  namespace crypto
+  {
+    class hash_pool
+    {
+    public:
+      typedef boost::function0<void> task;
+
+      // the number of threads (including the caller) that run() splits work
+      // between
+      static unsigned int get_concurrency();
+
+      // runs tasks on the pool's threads and on the calling thread, returning
+      // once they've all finished. the threads are started on first use and
+      // kept around, so that callers hashing one write at a time don't pay 
+      // for thread creation on every call.
+      static void run(const std::vector<task> &tasks);
+    };
+  }
+}
+
+#endif
@@ -24,7 +24,6 @@
 #include <stdexcept>
 
 #include <openssl/evp.h>
-#include <openssl/md5.h>
 
 #include "crypto/md5.h"
 
@@ -32,9 +31,40 @@ using std::runtime_error;
 
 using s3::crypto::md5;
 
+md5::context::context()
+  : _ctx(EVP_MD_CTX_create())
+{
+  if (!_ctx)
+    throw runtime_error("EVP_MD_CTX_create() failed in md5");
+
+  reset();
+}
+
+md5::context::~context()
+{
+  EVP_MD_CTX_destroy(_ctx);
+}
+
+void md5::context::reset()
+{
+  if (!EVP_DigestInit_ex(_ctx, EVP_md5(), NULL))
+    throw runtime_error("EVP_DigestInit_ex() failed in md5");
+}
+
+void md5::context::update(const uint8_t *input, size_t size)
+{
+  EVP_DigestUpdate(_ctx, input, size);
+}
+
+void md5::context::finalize(uint8_t *hash)
+{
+  EVP_DigestFinal_ex(_ctx, hash, NULL);
+}
+
 void md5::compute(const uint8_t *input, size_t size, uint8_t *hash)
 {
-  MD5(input, size, hash);
+  if (!EVP_Digest(input, size, hash, NULL, EVP_md5(), NULL))
+    throw runtime_error("EVP_Digest() failed in md5");
 }
 
 void md5::compute(int fd, uint8_t *hash)
@@ -42,10 +72,7 @@ void md5::compute(int fd, uint8_t *hash)
   const ssize_t BUF_LEN = 8 * 1024;
   off_t offset = 0;
   char buf[BUF_LEN];
-
-  EVP_MD_CTX md5_ctx;
-
-  EVP_DigestInit(&md5_ctx, EVP_md5());
+  context ctx;
 
   while (true) {
     ssize_t read_count;
@@ -55,7 +82,7 @@ void md5::compute(int fd, uint8_t *hash)
     if (read_count == -1)
       throw runtime_error("error while computing md5, in pread().");
 
-    EVP_DigestUpdate(&md5_ctx, buf, read_count);
+    ctx.update(reinterpret_cast<const uint8_t *>(buf), read_count);
 
     offset += read_count;
 
@@ -63,5 +90,5 @@ void md5::compute(int fd, uint8_t *hash)
       break;
   }
 
-  EVP_DigestFinal(&md5_ctx, hash, NULL);
+  ctx.finalize(hash);
 }
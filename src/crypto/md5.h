@@ -25,6 +25,9 @@
 #include <stdint.h>
 
 #include <string>
+#include <boost/utility.hpp>
+
+#include <openssl/ossl_typ.h>
 
 namespace s3
 {
@@ -37,6 +40,21 @@ namespace s3
     public:
       enum { HASH_LEN = 128 / 8 };
 
+      // for input that arrives a piece at a time
+      class context : boost::noncopyable
+      {
+      public:
+        context();
+        ~context();
+
+        void reset();
+        void update(const uint8_t *input, size_t size);
+        void finalize(uint8_t *hash);
+
+      private:
+        EVP_MD_CTX *_ctx;
+      };
+
       inline static bool is_valid_quoted_hex_hash(const std::string &hash)
       {
         if (hash.size() != 2 * HASH_LEN + 2) // *2 for hex encoding, +2 for quotes
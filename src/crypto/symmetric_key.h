@@ -25,6 +25,7 @@
 
 #include <string>
 #include <boost/smart_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "crypto/buffer.h"
 
@@ -85,12 +86,42 @@ namespace s3
         return _key->to_string() + ":" + _iv->to_string();
       }
 
+      // ciphers can keep whatever they derive from the key (an expanded key
+      // schedule, say) here rather than derive it on every call. keys are 
+      // only ever used with one cipher, so there's only one slot.
+      class cipher_state
+      {
+      public:
+        typedef boost::shared_ptr<cipher_state> ptr;
+
+        virtual ~cipher_state() { }
+      };
+
+      // returns an empty pointer if no state of state_type has been set
+      template <class state_type>
+      inline boost::shared_ptr<state_type> get_cipher_state()
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+
+        return boost::dynamic_pointer_cast<state_type>(_cipher_state);
+      }
+
+      inline void set_cipher_state(const cipher_state::ptr &state)
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+
+        _cipher_state = state;
+      }
+
     private:
       inline symmetric_key()
       {
       }
 
       buffer::ptr _key, _iv;
+
+      boost::mutex _mutex;
+      cipher_state::ptr _cipher_state;
     };
   }
 }
@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include <gtest/gtest.h>
 
 #include "crypto/aes_ctr_256.h"
@@ -27,3 +29,24 @@ TEST(aes_ctr_256, bad_byte_offset)
 
   EXPECT_THROW(aes_ctr_256::encrypt_with_byte_offset(sk, 1, in, aes_ctr_256::BLOCK_LEN, out), runtime_error);
 }
+
+TEST(aes_ctr_256, reused_key_matches_fresh_key)
+{
+  const size_t SIZE = 5 * aes_ctr_256::BLOCK_LEN + 3;
+
+  uint8_t in[SIZE], first[SIZE], reused[SIZE], fresh[SIZE];
+  symmetric_key::ptr sk = symmetric_key::generate<aes_ctr_256>();
+
+  for (size_t i = 0; i < SIZE; i++)
+    in[i] = i;
+
+  // leaves the counter partway through a block, which must not carry over
+  // into the next call
+  aes_ctr_256::encrypt_with_starting_block(sk, 7, in, SIZE, first);
+  aes_ctr_256::encrypt_with_starting_block(sk, 2, in, SIZE, reused);
+
+  aes_ctr_256::encrypt_with_starting_block(symmetric_key::from_string(sk->to_string()), 2, in, SIZE, fresh);
+
+  EXPECT_EQ(0, memcmp(reused, fresh, SIZE));
+  EXPECT_NE(0, memcmp(first, fresh, SIZE));
+}
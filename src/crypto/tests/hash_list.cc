@@ -0,0 +1,92 @@
+#include <stdlib.h>
+
+#include <boost/thread.hpp>
+#include <gtest/gtest.h>
+
+#include "crypto/hash_list.h"
+#include "crypto/hex.h"
+#include "crypto/sha256.h"
+
+using std::string;
+using std::vector;
+
+using s3::crypto::hash_list;
+using s3::crypto::hex;
+using s3::crypto::sha256;
+
+namespace
+{
+  typedef hash_list<sha256> sha256_list;
+
+  const size_t TEST_SIZES[] = {
+    0,
+    1,
+    sha256_list::CHUNK_SIZE - 1,
+    sha256_list::CHUNK_SIZE,
+    sha256_list::CHUNK_SIZE + 1,
+    7 * sha256_list::CHUNK_SIZE + 12345,
+    33 * sha256_list::CHUNK_SIZE
+  };
+
+  const int TEST_COUNT = sizeof(TEST_SIZES) / sizeof(TEST_SIZES[0]);
+
+  void hash_in_parallel(const vector<uint8_t> *data, string *root_hash)
+  {
+    sha256_list list(data->size());
+
+    list.compute_hash_parallel(0, &(*data)[0], data->size());
+    *root_hash = list.get_root_hash<hex>();
+  }
+}
+
+TEST(hash_list, parallel_matches_serial)
+{
+  for (int test = 0; test < TEST_COUNT; test++) {
+    size_t size = TEST_SIZES[test];
+    vector<uint8_t> data(size + 1);
+    sha256_list serial(size), parallel(size), parallel_3(size);
+
+    for (size_t i = 0; i < size; i++)
+      data[i] = rand();
+
+    serial.compute_hash(0, &data[0], size);
+    parallel.compute_hash_parallel(0, &data[0], size);
+    parallel_3.compute_hash_parallel(0, &data[0], size, 3);
+
+    EXPECT_EQ(serial.get_root_hash<hex>(), parallel.get_root_hash<hex>()) << "with size = " << size;
+    EXPECT_EQ(serial.get_root_hash<hex>(), parallel_3.get_root_hash<hex>()) << "with size = " << size;
+  }
+}
+
+TEST(hash_list, parallel_from_several_threads)
+{
+  const int THREADS = 8;
+  const size_t SIZE = 33 * sha256_list::CHUNK_SIZE;
+
+  vector<uint8_t> data(SIZE);
+  sha256_list serial(SIZE);
+  vector<string> root_hashes(THREADS);
+  boost::thread_group threads;
+
+  for (size_t i = 0; i < SIZE; i++)
+    data[i] = rand();
+
+  serial.compute_hash(0, &data[0], SIZE);
+
+  // the hashing threads are shared, so callers' work gets interleaved
+  for (int i = 0; i < THREADS; i++)
+    threads.create_thread(boost::bind(hash_in_parallel, &data, &root_hashes[i]));
+
+  threads.join_all();
+
+  for (int i = 0; i < THREADS; i++)
+    EXPECT_EQ(serial.get_root_hash<hex>(), root_hashes[i]) << "in thread " << i;
+}
+
+TEST(hash_list, parallel_rejects_unaligned_offset)
+{
+  vector<uint8_t> data(sha256_list::CHUNK_SIZE);
+  sha256_list list(2 * sha256_list::CHUNK_SIZE);
+
+  EXPECT_THROW(list.compute_hash_parallel(1, &data[0], data.size()), std::runtime_error);
+}
@@ -2,12 +2,14 @@
 
 #include <gtest/gtest.h>
 
+#include "crypto/encoder.h"
 #include "crypto/hash.h"
 #include "crypto/hex.h"
 #include "crypto/md5.h"
 
 using std::string;
 
+using s3::crypto::encoder;
 using s3::crypto::hash;
 using s3::crypto::hex;
 using s3::crypto::md5;
@@ -1550,3 +1552,21 @@ TEST(md5, random_from_file)
     close(fd);
   }
 }
+
+TEST(md5, random_in_pieces)
+{
+  const int PIECE_SIZE = 1000;
+
+  for (int test = 0; test < TEST_COUNT; test++) {
+    int size = TEST_SIZES[test];
+    md5::context ctx;
+    uint8_t computed_hash[md5::HASH_LEN];
+
+    for (int offset = 0; offset < size; offset += PIECE_SIZE)
+      ctx.update(BYTES + offset, (size - offset < PIECE_SIZE) ? size - offset : PIECE_SIZE);
+
+    ctx.finalize(computed_hash);
+
+    EXPECT_EQ(string(MD5[test]), encoder::encode<hex>(computed_hash, md5::HASH_LEN)) << "with size = " << size;
+  }
+}
@@ -101,3 +101,19 @@ TEST(symmetric_key, aes_ctr_256_varying)
   for (int i = 0; i < TEST_COUNT; i++)
     test_varying<aes_ctr_256>(TEST_SIZES[i]);
 }
+
+TEST(symmetric_key, cipher_state_is_typed)
+{
+  struct some_state : public symmetric_key::cipher_state { };
+  struct other_state : public symmetric_key::cipher_state { };
+
+  symmetric_key::ptr sk = symmetric_key::generate<aes_ctr_256>();
+  symmetric_key::cipher_state::ptr state(new some_state());
+
+  EXPECT_FALSE(sk->get_cipher_state<some_state>());
+
+  sk->set_cipher_state(state);
+
+  EXPECT_EQ(state, sk->get_cipher_state<some_state>());
+  EXPECT_FALSE(sk->get_cipher_state<other_state>());
+}
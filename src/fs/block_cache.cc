@@ -0,0 +1,376 @@
+/*
+ * fs/block_cache.cc
+ * -------------------------------------------------------------------------
+ * Persistent, content-addressed on-disk cache of downloaded file blocks.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2013, Tarick Bedeir.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <boost/detail/atomic_count.hpp>
+#include <boost/thread.hpp>
+
+#include "base/config.h"
+#include "base/logger.h"
+#include "base/paths.h"
+#include "base/statistics.h"
+#include "fs/block_cache.h"
+
+using boost::mutex;
+using boost::detail::atomic_count;
+using std::list;
+using std::map;
+using std::ostream;
+using std::ostringstream;
+using std::pair;
+using std::runtime_error;
+using std::sort;
+using std::string;
+using std::vector;
+
+using s3::base::config;
+using s3::base::paths;
+using s3::base::statistics;
+using s3::fs::block_cache;
+
+namespace
+{
+  const char *TEMP_SUFFIX = ".tmp";
+
+  typedef list<string> lru_list;
+
+  struct block_entry
+  {
+    size_t size;
+    lru_list::iterator lru_pos;
+  };
+
+  typedef map<string, block_entry> block_map;
+
+  // protected by s_mutex
+  mutex s_mutex;
+  block_map s_blocks;
+  lru_list s_lru; // least-recently used at the front
+  uint64_t s_bytes = 0;
+
+  bool s_enabled = false;
+  string s_dir;
+  uint64_t s_max_bytes = 0;
+
+  atomic_count s_hits(0), s_misses(0), s_stores(0), s_evictions(0), s_failures(0);
+  atomic_count s_temp_id(0);
+
+  void statistics_writer(ostream *o)
+  {
+    mutex::scoped_lock lock(s_mutex);
+
+    if (!s_enabled)
+      return;
+
+    *o <<
+      "block cache:\n"
+      "  hits: " << s_hits << ", misses: " << s_misses << "\n"
+      "  stores: " << s_stores << ", evictions: " << s_evictions << ", failures: " << s_failures << "\n"
+      "  blocks: " << s_blocks.size() << ", bytes: " << s_bytes << "\n";
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
+
+  inline string build_name(const string &key, size_t block_size, size_t index)
+  {
+    ostringstream s;
+
+    s << key << "." << block_size << "." << index;
+
+    return s.str();
+  }
+
+  inline string build_path(const string &name)
+  {
+    return s_dir + "/" + name;
+  }
+
+  void erase(const mutex::scoped_lock &, block_map::iterator itor)
+  {
+    s_bytes -= itor->second.size;
+    s_lru.erase(itor->second.lru_pos);
+    s_blocks.erase(itor);
+  }
+
+  void insert(const mutex::scoped_lock &lock, const string &name, size_t size)
+  {
+    block_map::iterator itor = s_blocks.find(name);
+    block_entry entry;
+
+    if (itor != s_blocks.end())
+      erase(lock, itor);
+
+    entry.size = size;
+    entry.lru_pos = s_lru.insert(s_lru.end(), name);
+
+    s_blocks[name] = entry;
+    s_bytes += size;
+  }
+
+  // removes entries from the index until we're within budget, and returns 
+  // the names of the evicted blocks so that they can be unlinked without
+  // holding s_mutex
+  void trim(const mutex::scoped_lock &lock, vector<string> *evicted)
+  {
+    while (s_bytes > s_max_bytes && !s_lru.empty()) {
+      evicted->push_back(s_lru.front());
+      erase(lock, s_blocks.find(s_lru.front()));
+
+      ++s_evictions;
+    }
+  }
+
+  void unlink_all(const vector<string> &names)
+  {
+    for (size_t i = 0; i < names.size(); i++)
+      unlink(build_path(names[i]).c_str());
+  }
+
+  bool write_all(int fd, const char *buffer, size_t size)
+  {
+    while (size) {
+      ssize_t r = write(fd, buffer, size);
+
+      if (r == -1) {
+        if (errno == EINTR)
+          continue;
+
+        return false;
+      }
+
+      buffer += r;
+      size -= r;
+    }
+
+    return true;
+  }
+}
+
+void block_cache::init()
+{
+  typedef pair<time_t, pair<string, size_t> > found_block;
+
+  mutex::scoped_lock lock(s_mutex);
+  vector<found_block> found;
+  vector<string> evicted;
+  DIR *dir;
+  struct dirent *de;
+
+  if (config::get_block_cache_dir().empty())
+    return;
+
+  s_dir = paths::transform(config::get_block_cache_dir());
+  s_max_bytes = static_cast<uint64_t>(config::get_block_cache_size_in_mb()) * 1024 * 1024;
+
+  if (mkdir(s_dir.c_str(), S_IRWXU) && errno != EEXIST) {
+    S3_LOG(LOG_ERR, "block_cache::init", "failed to create block cache directory [%s]: %s\n", s_dir.c_str(), strerror(errno));
+    throw runtime_error("failed to create block cache directory");
+  }
+
+  dir = opendir(s_dir.c_str());
+
+  if (!dir) {
+    S3_LOG(LOG_ERR, "block_cache::init", "failed to open block cache directory [%s]: %s\n", s_dir.c_str(), strerror(errno));
+    throw runtime_error("failed to open block cache directory");
+  }
+
+  while ((de = readdir(dir))) {
+    string name = de->d_name;
+    struct stat s;
+
+    if (name[0] == '.')
+      continue;
+
+    // temporary files are left behind if we crashed mid-write
+    if (name.find(TEMP_SUFFIX) != string::npos) {
+      unlink(build_path(name).c_str());
+      continue;
+    }
+
+    if (stat(build_path(name).c_str(), &s) || !S_ISREG(s.st_mode))
+      continue;
+
+    found.push_back(found_block(s.st_mtime, pair<string, size_t>(name, s.st_size)));
+  }
+
+  closedir(dir);
+
+  // we touch blocks whenever they're used, so ordering by mtime recovers the
+  // LRU order we had when we were last mounted
+  sort(found.begin(), found.end());
+
+  for (size_t i = 0; i < found.size(); i++)
+    insert(lock, found[i].second.first, found[i].second.second);
+
+  trim(lock, &evicted);
+
+  s_enabled = true;
+
+  S3_LOG(
+    LOG_DEBUG, 
+    "block_cache::init", 
+    "using [%s], found %zu blocks (%" PRIu64 " bytes).\n", 
+    s_dir.c_str(), 
+    s_blocks.size(), 
+    s_bytes);
+
+  lock.unlock();
+  unlink_all(evicted);
+}
+
+bool block_cache::is_enabled()
+{
+  return s_enabled;
+}
+
+bool block_cache::get(const string &key, size_t block_size, size_t index, size_t expected_size, vector<char> *buffer)
+{
+  mutex::scoped_lock lock(s_mutex);
+  string name = build_name(key, block_size, index);
+  string path = build_path(name);
+  block_map::iterator itor;
+  int fd;
+  ssize_t r;
+
+  itor = s_blocks.find(name);
+
+  if (itor == s_blocks.end() || itor->second.size != expected_size) {
+    ++s_misses;
+    return false;
+  }
+
+  s_lru.splice(s_lru.end(), s_lru, itor->second.lru_pos);
+
+  lock.unlock();
+
+  buffer->resize(expected_size);
+
+  fd = open(path.c_str(), O_RDONLY);
+  r = (fd == -1) ? -1 : pread(fd, &(*buffer)[0], expected_size, 0);
+
+  if (fd != -1)
+    close(fd);
+
+  if (r != static_cast<ssize_t>(expected_size)) {
+    S3_LOG(LOG_WARNING, "block_cache::get", "failed to read block [%s]. discarding.\n", name.c_str());
+
+    ++s_failures;
+    ++s_misses;
+
+    lock.lock();
+    itor = s_blocks.find(name);
+
+    if (itor != s_blocks.end())
+      erase(lock, itor);
+
+    lock.unlock();
+    unlink(path.c_str());
+
+    return false;
+  }
+
+  // keep the on-disk LRU order current for the next mount
+  utimes(path.c_str(), NULL);
+
+  ++s_hits;
+
+  return true;
+}
+
+void block_cache::put(const string &key, size_t block_size, size_t index, const char *buffer, size_t size)
+{
+  mutex::scoped_lock lock(s_mutex, boost::defer_lock);
+  string name = build_name(key, block_size, index);
+  string path = build_path(name);
+  ostringstream temp_path;
+  vector<string> evicted;
+  int fd;
+  bool ok;
+
+  if (size > s_max_bytes)
+    return;
+
+  temp_path << path << TEMP_SUFFIX << "." << getpid() << "." << ++s_temp_id;
+
+  fd = open(temp_path.str().c_str(), O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+
+  if (fd == -1) {
+    ++s_failures;
+    return;
+  }
+
+  ok = write_all(fd, buffer, size);
+
+  close(fd);
+
+  // write to a temporary file then rename so that a crash never leaves a
+  // truncated block under a valid name
+  if (!ok || rename(temp_path.str().c_str(), path.c_str())) {
+    S3_LOG(LOG_WARNING, "block_cache::put", "failed to store block [%s]: %s\n", name.c_str(), strerror(errno));
+
+    ++s_failures;
+    unlink(temp_path.str().c_str());
+
+    return;
+  }
+
+  ++s_stores;
+
+  lock.lock();
+  insert(lock, name, size);
+  trim(lock, &evicted);
+  lock.unlock();
+
+  unlink_all(evicted);
+}
+
+void block_cache::remove(const string &key)
+{
+  mutex::scoped_lock lock(s_mutex);
+  string prefix = key + ".";
+  vector<string> removed;
+  block_map::iterator itor = s_blocks.lower_bound(prefix);
+
+  while (itor != s_blocks.end() && itor->first.compare(0, prefix.size(), prefix) == 0) {
+    removed.push_back(itor->first);
+    erase(lock, itor++);
+  }
+
+  lock.unlock();
+  unlink_all(removed);
+}
@@ -0,0 +1,62 @@
+/*
+ * fs/block_cache.h
+ * -------------------------------------------------------------------------
+ * Persistent, content-addressed on-disk cache of downloaded file blocks.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2013, Tarick Bedeir.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_FS_BLOCK_CACHE_H
+#define S3_FS_BLOCK_CACHE_H
+
+#include <string>
+#include <vector>
+
+namespace s3
+{
+  namespace fs
+  {
+    // blocks are stored one per file, named after a key that identifies the
+    // object's content (its SHA256 hash or ETag), the block size, and the
+    // block index. since the key changes whenever the content does, stale
+    // blocks are never served -- they just age out of the LRU.
+    class block_cache
+    {
+    public:
+      static void init();
+
+      static bool is_enabled();
+
+      static bool get(
+        const std::string &key, 
+        size_t block_size, 
+        size_t index, 
+        size_t expected_size, 
+        std::vector<char> *buffer);
+
+      static void put(
+        const std::string &key, 
+        size_t block_size, 
+        size_t index, 
+        const char *buffer, 
+        size_t size);
+
+      static void remove(const std::string &key);
+    };
+  }
+}
+
+#endif
@@ -19,6 +19,7 @@
  * limitations under the License.
  */
 
+#include <limits>
 #include <boost/detail/atomic_count.hpp>
 
 #include "base/config.h"
@@ -28,7 +29,7 @@
 #include "fs/directory.h"
 
 using boost::mutex;
-using boost::scoped_ptr;
+using boost::scoped_array;
 using boost::detail::atomic_count;
 using std::ostream;
 using std::string;
@@ -38,29 +39,114 @@ using s3::base::request;
 using s3::base::statistics;
 using s3::fs::cache;
 
-boost::mutex cache::s_mutex;
-scoped_ptr<cache::cache_map> cache::s_cache_map;
-uint64_t cache::s_hits(0), cache::s_misses(0), cache::s_expiries(0);
+scoped_array<cache::shard> cache::s_shards;
+size_t cache::s_shard_count(0);
 statistics::writers::entry cache::s_writer(cache::statistics_writer, 0);
 
 namespace
 {
+  // for each entry: the hash table node, the key, the pointer to the 
+  // object and its control block, and the LRU links
+  const size_t ENTRY_OVERHEAD = sizeof(string) + 10 * sizeof(void *) + 2 * sizeof(size_t);
+
+  enum usage_type
+  {
+    UT_FILE,
+    UT_DIRECTORY,
+    UT_SYMLINK,
+    UT_OTHER,
+    UT_EMPTY,
+
+    UT_COUNT
+  };
+
+  const char *USAGE_TYPE_NAMES[] = { "files", "directories", "symlinks", "other", "empty entries" };
+
+  struct usage
+  {
+    uint64_t count, bytes;
+  };
+
   atomic_count s_get_failures(0);
 
   inline double percent(uint64_t a, uint64_t b)
   {
     return static_cast<double>(a) / static_cast<double>(b) * 100.0;
   }
+
+  size_t compute_entry_size(const string &path, const s3::fs::object::ptr &obj)
+  {
+    return ENTRY_OVERHEAD + path.size() + (obj ? obj->get_approximate_size() : 0);
+  }
+
+  void add_usage(const string &path, const s3::fs::object::ptr &obj, usage *u)
+  {
+    usage_type type = UT_EMPTY;
+
+    if (obj) {
+      switch (obj->get_type()) {
+        case S_IFREG: type = UT_FILE; break;
+        case S_IFDIR: type = UT_DIRECTORY; break;
+        case S_IFLNK: type = UT_SYMLINK; break;
+        default: type = UT_OTHER;
+      }
+    }
+
+    u[type].count++;
+    u[type].bytes += compute_entry_size(path, obj);
+  }
 }
 
 void cache::init()
 {
-  s_cache_map.reset(new cache_map(config::get_max_objects_in_cache()));
+  size_t max_objects = config::get_max_objects_in_cache();
+  size_t max_bytes = static_cast<size_t>(config::get_object_cache_size_in_mb()) * 1024 * 1024;
+
+  s_shard_count = config::get_object_cache_shards();
+  s_shards.reset(new shard[s_shard_count]);
+
+  // both limits are split evenly between shards
+  for (size_t i = 0; i < s_shard_count; i++)
+    s_shards[i].map.reset(new cache_map(
+      max_objects ? (max_objects + s_shard_count - 1) / s_shard_count : std::numeric_limits<size_t>::max(),
+      max_bytes / s_shard_count));
+}
+
+void cache::update_size(const string &path)
+{
+  shard *s = get_shard(path);
+  mutex::scoped_lock lock(s->mutex);
+  object::ptr obj;
+
+  if (s->map->find(path, &obj) && obj)
+    s->map->set_entry_size(path, get_entry_size(path, obj));
+}
+
+size_t cache::get_entry_size(const string &path, const object::ptr &obj)
+{
+  return compute_entry_size(path, obj);
 }
 
 void cache::statistics_writer(ostream *o)
 {
-  uint64_t total = s_hits + s_misses + s_expiries;
+  size_t size = 0, bytes = 0;
+  uint64_t hits = 0, misses = 0, expiries = 0, total = 0;
+  usage usage_by_type[UT_COUNT] = {};
+
+  for (size_t i = 0; i < s_shard_count; i++) {
+    shard *s = &s_shards[i];
+    mutex::scoped_lock lock(s->mutex);
+
+    size += s->map->get_size();
+    bytes += s->map->get_total_size();
+    hits += s->hits;
+    misses += s->misses;
+    expiries += s->expiries;
+
+    s->map->for_each_oldest(bind(&add_usage, _1, _2, usage_by_type));
+  }
+
+  total = hits + misses + expiries;
 
   if (total == 0)
     total = 1; // avoid NaNs below
@@ -70,13 +156,55 @@ void cache::statistics_writer(ostream *o)
 
   *o << 
     "object cache:\n"
-    "  size: " << s_cache_map->get_size() << "\n"
-    "  hits: " << s_hits << " (" << percent(s_hits, total) << " %)\n"
-    "  misses: " << s_misses << " (" << percent(s_misses, total) << " %)\n"
-    "  expiries: " << s_expiries << " (" << percent(s_expiries, total) << " %)\n"
+    "  shards: " << s_shard_count << "\n"
+    "  size: " << size << "\n"
+    "  bytes: " << bytes << " (limit: " << config::get_object_cache_size_in_mb() << " MB)\n";
+
+  for (int i = 0; i < UT_COUNT; i++)
+    *o << "  " << USAGE_TYPE_NAMES[i] << ": " << usage_by_type[i].count << ", bytes: " << usage_by_type[i].bytes << "\n";
+
+  *o <<
+    "  hits: " << hits << " (" << percent(hits, total) << " %)\n"
+    "  misses: " << misses << " (" << percent(misses, total) << " %)\n"
+    "  expiries: " << expiries << " (" << percent(expiries, total) << " %)\n"
     "  get failures: " << s_get_failures << "\n";
 }
 
+int cache::prepare_fetch(const request::ptr &req, const string &path, int hints)
+{
+  req->init(base::HTTP_HEAD);
+  req->set_url((hints & HINT_IS_DIR) ? directory::build_url(path) : object::build_url(path));
+
+  return 0;
+}
+
+int cache::complete_fetch(const request::ptr &req, const string &path, int hints)
+{
+  object::ptr obj;
+
+  if (req->get_response_code() != base::HTTP_SC_OK) {
+    // directories may also be files, as with fetch(). we're on a completion
+    // thread, so rather than run the second request here, send it the same
+    // way as the first.
+    if (hints & HINT_IS_DIR) {
+      threads::pool::post_request(
+        threads::PR_REQ_1,
+        bind(&cache::prepare_fetch, _1, path, HINT_IS_FILE),
+        bind(&cache::complete_fetch, _1, path, HINT_IS_FILE),
+        request::DEFAULT_REQUEST_TIMEOUT);
+
+      return 0;
+    }
+
+    ++s_get_failures;
+    return 0;
+  }
+
+  store(req, path, &obj);
+
+  return 0;
+}
+
 int cache::fetch(const request::ptr &req, const string &path, int hints, object::ptr *obj)
 {
   if (!path.empty()) {
@@ -100,11 +228,19 @@ int cache::fetch(const request::ptr &req, const string &path, int hints, object:
     }
   }
 
+  store(req, path, obj);
+
+  return 0;
+}
+
+void cache::store(const request::ptr &req, const string &path, object::ptr *obj)
+{
   *obj = object::create(path, req);
 
   {
-    mutex::scoped_lock lock(s_mutex);
-    object::ptr &map_obj = (*s_cache_map)[path];
+    shard *s = get_shard(path);
+    mutex::scoped_lock lock(s->mutex);
+    object::ptr &map_obj = (*s->map)[path];
 
     if (map_obj) {
       // if the object is already in the map, don't overwrite it
@@ -112,8 +248,9 @@ int cache::fetch(const request::ptr &req, const string &path, int hints, object:
     } else {
       // otherwise, save it
       map_obj = *obj;
+
+      s->map->set_entry_size(path, get_entry_size(path, *obj));
     }
   }
 
-  return 0;
 }
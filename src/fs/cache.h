@@ -23,6 +23,7 @@
 #define S3_FS_CACHE_H
 
 #include <string>
+#include <boost/functional/hash.hpp>
 #include <boost/smart_ptr.hpp>
 #include <boost/thread.hpp>
 
@@ -55,6 +56,22 @@ namespace s3
 
       static void init();
 
+      // for precaching with pool::post_request() when hints says whether 
+      // path is a file or a directory
+      static int prepare_fetch(const boost::shared_ptr<base::request> &req, const std::string &path, int hints);
+      static int complete_fetch(const boost::shared_ptr<base::request> &req, const std::string &path, int hints);
+
+      // true if there's an unexpired object at path, without fetching it if
+      // there isn't
+      inline static bool is_cached(const std::string &path)
+      {
+        return find(path).get() != NULL;
+      }
+
+      // recounts the memory taken up by the object at path, if it's cached,
+      // for when it's grown since it was cached
+      static void update_size(const std::string &path);
+
       inline static object::ptr get(const std::string &path, int hints = HINT_NONE)
       {
         object::ptr obj = find(path);
@@ -79,16 +96,17 @@ namespace s3
 
       inline static int remove(const std::string &path)
       {
-        boost::mutex::scoped_lock lock(s_mutex);
+        shard *s = get_shard(path);
+        boost::mutex::scoped_lock lock(s->mutex);
         object::ptr o;
 
-        if (!s_cache_map->find(path, &o))
+        if (!s->map->find(path, &o))
           return 0;
 
         if (!o->is_removable())
           return -EBUSY;
 
-        s_cache_map->erase(path);
+        s->map->erase(path);
 
         return 0;
       }
@@ -97,7 +115,8 @@ namespace s3
       // only cached object at "path"
       inline static void lock_object(const std::string &path, const locked_object_function &fn)
       {
-        boost::mutex::scoped_lock lock(s_mutex, boost::defer_lock);
+        shard *s = get_shard(path);
+        boost::mutex::scoped_lock lock(s->mutex, boost::defer_lock);
         object::ptr obj;
 
         // this puts the object at "path" in the cache if it isn't already there
@@ -118,7 +137,7 @@ namespace s3
         // pointer, which fn() has to check for anyway.
 
         lock.lock();
-        obj = (*s_cache_map)[path];
+        obj = (*s->map)[path];
 
         fn(obj);
       }
@@ -129,33 +148,60 @@ namespace s3
         return !obj || obj->is_removable();
       }
 
+      typedef base::lru_cache_map<std::string, object::ptr, is_object_removable> cache_map;
+
+      // paths are spread by hash over independent shards, each with its own
+      // lock, so that lookups of different paths don't contend
+      struct shard
+      {
+        boost::mutex mutex;
+        boost::scoped_ptr<cache_map> map;
+        uint64_t hits, misses, expiries;
+
+        inline shard()
+          : hits(0),
+            misses(0),
+            expiries(0)
+        {
+        }
+      };
+
+      inline static shard * get_shard(const std::string &path)
+      {
+        return &s_shards[boost::hash<std::string>()(path) % s_shard_count];
+      }
+
       inline static object::ptr find(const std::string &path)
       {
-        boost::mutex::scoped_lock lock(s_mutex);
-        object::ptr &obj = (*s_cache_map)[path];
+        shard *s = get_shard(path);
+        boost::mutex::scoped_lock lock(s->mutex);
+        object::ptr &obj = (*s->map)[path];
 
         if (!obj) {
-          s_misses++;
+          s->misses++;
+
+          // the (empty) entry stays in the map until it's evicted or filled
+          s->map->set_entry_size(path, get_entry_size(path, obj));
 
         } else if (obj->is_expired() && obj->is_removable()) {
-          s_expiries++;
+          s->expiries++;
           obj.reset();
 
         } else {
-          s_hits++;
+          s->hits++;
         }
 
         return obj;
       }
 
+      static size_t get_entry_size(const std::string &path, const object::ptr &obj);
+
       static void statistics_writer(std::ostream *o);
       static int fetch(const boost::shared_ptr<base::request> &req, const std::string &path, int hints, object::ptr *obj);
+      static void store(const boost::shared_ptr<base::request> &req, const std::string &path, object::ptr *obj);
 
-      typedef base::lru_cache_map<std::string, object::ptr, is_object_removable> cache_map;
-
-      static boost::mutex s_mutex;
-      static boost::scoped_ptr<cache_map> s_cache_map;
-      static uint64_t s_hits, s_misses, s_expiries;
+      static boost::scoped_array<shard> s_shards;
+      static size_t s_shard_count;
 
       static base::statistics::writers::entry s_writer;
     };
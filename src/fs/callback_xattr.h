@@ -54,6 +54,11 @@ namespace s3
 
       virtual void to_header(std::string *header, std::string *value);
 
+      virtual size_t get_approximate_size() const { return sizeof(callback_xattr) + get_key().size(); }
+
+      // we don't know what the callbacks do
+      virtual bool is_blocking() const { return true; }
+
     private:
       inline callback_xattr(
         const std::string &key, 
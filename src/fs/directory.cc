@@ -66,6 +66,12 @@ namespace
       "  rename retries (delete step): " << s_delete_retries << "\n";
   }
 
+  // beyond this many, precaching waits for a pool thread rather than adding 
+  // to the requests on the transfer reactor
+  const long MAX_PRECACHES_IN_FLIGHT = 256;
+
+  atomic_count s_precaches_in_flight(0);
+
   int precache_object(const request::ptr &req, const string &path, int hints)
   {
     // we need to wrap cache::get because it returns an object::ptr, and the
@@ -76,6 +82,33 @@ namespace
     return 0;
   }
 
+  void on_precache_done(int r)
+  {
+    --s_precaches_in_flight;
+  }
+
+  void precache(const string &path, int hints)
+  {
+    // a warm listing shouldn't cost a request per entry
+    if (cache::is_cached(path))
+      return;
+
+    if (s_precaches_in_flight < MAX_PRECACHES_IN_FLIGHT) {
+      ++s_precaches_in_flight;
+
+      pool::post_request(
+        s3::threads::PR_REQ_1,
+        bind(&cache::prepare_fetch, _1, path, hints),
+        bind(&cache::complete_fetch, _1, path, hints),
+        bind(&on_precache_done, _1),
+        request::DEFAULT_REQUEST_TIMEOUT);
+
+      return;
+    }
+
+    pool::call_async(s3::threads::PR_REQ_1, bind(precache_object, _1, path, hints));
+  }
+
   int copy_object(const request::ptr &req, string *name, const string &old_base, const string &new_base, bool is_retry)
   {
     string old_name = old_base + *name;
@@ -142,7 +175,6 @@ void directory::get_internal_objects(const request::ptr &req, vector<string> *ob
 directory::directory(const string &path)
   : object(path)
 {
-  set_url(build_url(path));
   set_type(S_IFDIR);
 }
 
@@ -150,6 +182,25 @@ directory::~directory()
 {
 }
 
+string directory::get_url() const
+{
+  return build_url(get_path());
+}
+
+size_t directory::get_approximate_size()
+{
+  mutex::scoped_lock lock(_mutex);
+  size_t size = object::get_approximate_size() + sizeof(directory) - sizeof(object);
+
+  if (_cache) {
+    // each list node holds a string and two links
+    for (cache_list::const_iterator itor = _cache->begin(); itor != _cache->end(); ++itor)
+      size += sizeof(string) + 2 * sizeof(void *) + itor->size();
+  }
+
+  return size;
+}
+
 int directory::read(const request::ptr &req, const filler_function &filler)
 {
   string path = get_path();
@@ -181,7 +232,7 @@ int directory::read(const request::ptr &req, const filler_function &filler)
       filler(relative_path);
 
       if (config::get_precache_on_readdir())
-        pool::call_async(threads::PR_REQ_1, bind(precache_object, _1, path + relative_path, HINT_IS_DIR));
+        precache(path + relative_path, HINT_IS_DIR);
 
       if (cache)
         cache->push_back(relative_path);
@@ -199,7 +250,7 @@ int directory::read(const request::ptr &req, const filler_function &filler)
         filler(relative_path);
 
         if (config::get_precache_on_readdir())
-          pool::call_async(threads::PR_REQ_1, bind(precache_object, _1, path + relative_path, HINT_IS_FILE));
+          precache(path + relative_path, HINT_IS_FILE);
 
         if (cache)
           cache->push_back(relative_path);
@@ -211,9 +262,14 @@ int directory::read(const request::ptr &req, const filler_function &filler)
     return r;
 
   if (cache) {
-    mutex::scoped_lock lock(_mutex);
+    {
+      mutex::scoped_lock lock(_mutex);
+
+      _cache = cache;
+    }
 
-    _cache = cache;
+    // the listing can be far larger than the rest of the object
+    cache::update_size(get_path());
   }
 
   return 0;
@@ -82,6 +82,9 @@ namespace s3
       virtual int remove(const boost::shared_ptr<base::request> &req);
       virtual int rename(const boost::shared_ptr<base::request> &req, const std::string &to);
 
+      virtual std::string get_url() const;
+      virtual size_t get_approximate_size();
+
     private:
       typedef std::list<std::string> cache_list;
       typedef boost::shared_ptr<cache_list> cache_list_ptr;
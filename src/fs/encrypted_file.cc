@@ -40,8 +40,6 @@ using std::runtime_error;
 using std::string;
 using std::vector;
 
-using s3::base::char_vector;
-using s3::base::char_vector_ptr;
 using s3::base::request;
 using s3::base::statistics;
 using s3::crypto::aes_cbc_256_with_pkcs;
@@ -117,7 +115,7 @@ void encrypted_file::init(const request::ptr &req)
   // always has size == 0.
 
   if (!is_intact()) {
-    if (get_stat()->st_size > 0) {
+    if (get_size() > 0) {
       S3_LOG(
         LOG_DEBUG,
         "encrypted_file::init",
@@ -219,6 +217,27 @@ int encrypted_file::is_downloadable()
   return 0;
 }
 
+string encrypted_file::get_block_cache_key()
+{
+  // the block cache holds whatever we write locally, which for us is
+  // plaintext, so never let it near an encrypted file
+  return "";
+}
+
+bool encrypted_file::can_copy_unmodified_ranges()
+{
+  // every upload is encrypted with a new data key, so nothing already stored
+  // can be reused
+  return false;
+}
+
+bool encrypted_file::can_journal_upload()
+{
+  // the local copy is plaintext, which shouldn't outlive us, and a later
+  // mount wouldn't have the data key to encrypt the rest of it anyway
+  return false;
+}
+
 int encrypted_file::prepare_upload()
 {
   _meta_key = symmetric_key::generate<aes_cbc_256_with_pkcs>(encryption::get_volume_key());
@@ -247,26 +266,15 @@ int encrypted_file::finalize_upload(const string &returned_etag)
   return 0;
 }
 
-int encrypted_file::read_chunk(size_t size, off_t offset, const char_vector_ptr &buffer)
+void encrypted_file::encode_read_chunk(char *data, size_t size, off_t offset)
 {
-  char_vector_ptr temp(new char_vector());
-  int r;
-
-  r = file::read_chunk(size, offset, temp);
-
-  if (r)
-    return r;
-
-  buffer->resize(temp->size());
-
+  // CTR mode is happy to encrypt in place
   aes_ctr_256::encrypt_with_byte_offset(
     _data_key, 
     offset,
-    reinterpret_cast<const uint8_t *>(&(*temp)[0]), 
-    temp->size(), 
-    reinterpret_cast<uint8_t *>(&(*buffer)[0]));
-
-  return 0;
+    reinterpret_cast<const uint8_t *>(data), 
+    size, 
+    reinterpret_cast<uint8_t *>(data));
 }
 
 int encrypted_file::write_chunk(const char *buffer, size_t size, off_t offset)
@@ -61,10 +61,15 @@ namespace s3
 
       virtual int is_downloadable();
 
+      virtual std::string get_block_cache_key();
+
+      virtual bool can_copy_unmodified_ranges();
+      virtual bool can_journal_upload();
+
       virtual int prepare_upload();
       virtual int finalize_upload(const std::string &returned_etag);
 
-      virtual int read_chunk(size_t size, off_t offset, const base::char_vector_ptr &buffer);
+      virtual void encode_read_chunk(char *data, size_t size, off_t offset);
       virtual int write_chunk(const char *buffer, size_t size, off_t offset);
 
     private:
@@ -19,16 +19,21 @@
  * limitations under the License.
  */
 
+#include <set>
 #include <boost/detail/atomic_count.hpp>
 
 #include "base/config.h"
 #include "base/logger.h"
 #include "base/request.h"
 #include "base/statistics.h"
+#include "base/timer.h"
+#include "base/transfer_scheduler.h"
+#include "crypto/encoder.h"
 #include "crypto/hash.h"
 #include "crypto/hex.h"
 #include "crypto/hex_with_quotes.h"
 #include "crypto/md5.h"
+#include "fs/block_cache.h"
 #include "fs/cache.h"
 #include "fs/metadata.h"
 #include "fs/mime_types.h"
@@ -36,38 +41,87 @@
 #include "fs/static_xattr.h"
 #include "services/file_transfer.h"
 #include "services/service.h"
+#include "services/upload_journal.h"
 #include "threads/pool.h"
 
+using boost::condition;
 using boost::mutex;
 using boost::detail::atomic_count;
 using std::ostream;
 using std::runtime_error;
+using std::set;
 using std::string;
+using std::vector;
 
+using s3::base::char_vector;
 using s3::base::char_vector_ptr;
 using s3::base::config;
 using s3::base::request;
 using s3::base::statistics;
+using s3::base::timer;
+using s3::base::transfer_scheduler;
+using s3::crypto::encoder;
 using s3::crypto::hash;
 using s3::crypto::hash_list;
 using s3::crypto::hex;
 using s3::crypto::hex_with_quotes;
 using s3::crypto::md5;
 using s3::crypto::sha256;
+using s3::fs::block_cache;
 using s3::fs::file;
 using s3::fs::metadata;
 using s3::fs::mime_types;
 using s3::fs::object;
 using s3::fs::static_xattr;
+using s3::services::file_transfer;
 using s3::services::service;
+using s3::services::upload_journal;
 using s3::threads::pool;
 
 #define TEMP_NAME_TEMPLATE "/tmp/s3fuse.local-XXXXXX"
 
 namespace
 {
+  // granularity with which we track download progress -- the download chunk
+  // size is always a multiple of this (see test_transfer_chunk_sizes())
+  const size_t DOWNLOAD_TRACKING_CHUNK_SIZE = hash_list<sha256>::CHUNK_SIZE;
+
+  // writes at least this large are hashed on more than one core
+  const size_t PARALLEL_HASH_MIN_SIZE = 16 * DOWNLOAD_TRACKING_CHUNK_SIZE;
+
+  // background write-backs that fail are retried after this many seconds,
+  // doubling with each further failure
+  const int WRITE_BACK_RETRY_BASE_DELAY_IN_S = 2;
+
+  // out-of-order downloaded data held in memory until the md5 hash catches up
+  // to it -- anything beyond this is read back from the local file instead
+  const size_t MD5_REORDER_BUFFER_SIZE = 32 * DOWNLOAD_TRACKING_CHUNK_SIZE;
+
   atomic_count s_sha256_mismatches(0), s_md5_mismatches(0), s_no_hash_checks(0);
   atomic_count s_non_dirty_flushes(0), s_reopens(0);
+  atomic_count s_reads_during_download(0), s_reads_blocked_on_download(0);
+  atomic_count s_read_ahead_resets(0);
+  atomic_count s_write_backs(0), s_write_backs_throttled(0), s_write_back_failures(0);
+  atomic_count s_write_back_checkpoints(0), s_write_back_reopens(0), s_write_back_retries(0);
+  atomic_count s_streamed_uploads(0), s_streamed_uploads_abandoned(0), s_streamed_upload_failures(0);
+  atomic_count s_md5_pieces_buffered(0), s_md5_read_backs(0);
+  atomic_count s_block_cache_full_hits(0), s_block_cache_partial_hits(0);
+
+  // protected by s_write_back_mutex
+  mutex s_write_back_mutex;
+  condition s_write_back_condition;
+  uint64_t s_write_back_bytes = 0;
+  int s_write_backs_in_progress = 0;
+
+  // closed files whose write-back retries ran out, and which still have 
+  // modifications that were never uploaded. also protected by 
+  // s_write_back_mutex.
+  set<file::ptr> s_stranded_files;
+
+  int next_block(const vector<size_t> *blocks, size_t *next)
+  {
+    return (*next < blocks->size()) ? static_cast<int>((*blocks)[(*next)++]) : -1;
+  }
 
   object * checker(const string &path, const request::ptr &req)
   {
@@ -80,7 +134,14 @@ namespace
       "files:\n"
       "  sha256 mismatches: " << s_sha256_mismatches << ", md5 mismatches: " << s_md5_mismatches << ", no hash checks: " << s_no_hash_checks << "\n"
       "  non-dirty flushes: " << s_non_dirty_flushes << "\n"
-      "  reopens: " << s_reopens << "\n";
+      "  reopens: " << s_reopens << "\n"
+      "  reads during download: " << s_reads_during_download << ", of which blocked: " << s_reads_blocked_on_download << "\n"
+      "  read-ahead window resets: " << s_read_ahead_resets << "\n"
+      "  write-backs: " << s_write_backs << ", throttled: " << s_write_backs_throttled << ", failed: " << s_write_back_failures << "\n"
+      "  write-back checkpoints: " << s_write_back_checkpoints << ", reopens during write-back: " << s_write_back_reopens << ", retries: " << s_write_back_retries << "\n"
+      "  streamed uploads: " << s_streamed_uploads << ", abandoned: " << s_streamed_uploads_abandoned << ", failed: " << s_streamed_upload_failures << "\n"
+      "  out-of-order pieces buffered for md5: " << s_md5_pieces_buffered << ", read back from local file: " << s_md5_read_backs << "\n"
+      "  downloads served from block cache: " << s_block_cache_full_hits << ", partly: " << s_block_cache_partial_hits << "\n";
   }
 
   object::type_checker_list::entry s_checker_reg(checker, 1000);
@@ -117,21 +178,87 @@ void file::open_locked_object(const object::ptr &obj, file_open_mode mode, uint6
   *status = static_cast<file *>(obj.get())->open(mode, handle);
 }
 
+void file::wait_for_write_backs()
+{
+  vector<file::ptr> stranded;
+
+  {
+    mutex::scoped_lock lock(s_write_back_mutex);
+
+    while (s_write_backs_in_progress)
+      s_write_back_condition.wait(lock);
+
+    stranded.assign(s_stranded_files.begin(), s_stranded_files.end());
+    s_stranded_files.clear();
+  }
+
+  // nothing will be around to retry these once we've unmounted, so give 
+  // each one last try
+  for (vector<file::ptr>::const_iterator itor = stranded.begin(); itor != stranded.end(); ++itor)
+    (*itor)->upload_stranded();
+}
+
 int file::open(const string &path, file_open_mode mode, uint64_t *handle)
 {
   int r = -EINVAL;
 
-  cache::lock_object(path, bind(&file::open_locked_object, _1, mode, handle, &r));
+  while (true) {
+    if (mode & fs::OPEN_TRUNCATE_TO_ZERO) {
+      // if a write-back is still using the local copy, we'll have to wait 
+      // for it, and we'd rather not do that while holding the cache lock
+      object::ptr obj = cache::get(path);
+
+      if (obj && obj->get_type() == S_IFREG) {
+        file *f = static_cast<file *>(obj.get());
+        mutex::scoped_lock lock(f->_fs_mutex);
 
-  return r;
+        f->wait_for_release(lock);
+      }
+    }
+
+    cache::lock_object(path, bind(&file::open_locked_object, _1, mode, handle, &r));
+
+    // a write-back started after we waited (or the object was replaced), so
+    // look it up and wait again
+    if (r != -EAGAIN || !(mode & fs::OPEN_TRUNCATE_TO_ZERO))
+      return r;
+  }
+}
+
+file::open_state::open_state()
+  : fd(-1),
+    status(0),
+    async_error(0),
+    ref_count(0),
+    priority_offset(-1),
+    stream_begin(0),
+    stream_end(0),
+    stream_next_unrequested(0),
+    read_ahead_window(0),
+    last_read_chunk(-1),
+    stream_running(false),
+    stream_stopping(false),
+    stream_fetch_all(false),
+    release_pending(false),
+    write_back_error(0),
+    write_back_retries(0),
+    dirty_since(0),
+    appending(false),
+    append_offset(0),
+    parts_sent(0),
+    md5_offset(0),
+    md5_pending_size(0)
+{
+}
+
+file::open_state::~open_state()
+{
+  if (fd != -1)
+    close(fd);
 }
 
 file::file(const string &path)
-  : object(path),
-    _fd(-1),
-    _status(0),
-    _async_error(0),
-    _ref_count(0)
+  : object(path)
 {
   set_type(S_IFREG);
 
@@ -156,7 +283,52 @@ bool file::is_removable()
 {
   mutex::scoped_lock lock(_fs_mutex);
 
-  return _ref_count == 0 && object::is_removable();
+  // files with local copies stay put until the local copy is closed
+  return !_open && object::is_removable();
+}
+
+size_t file::get_approximate_size()
+{
+  mutex::scoped_lock lock(_fs_mutex);
+  size_t size = object::get_approximate_size() + sizeof(file) - sizeof(object) + _sha256_hash.size();
+
+  // open files aren't evicted, so this only matters for the total
+  if (_open)
+    size += 
+      sizeof(open_state) + 
+      _open->local_path.size() + 
+      (_open->downloaded_chunks.size() + _open->modified_chunks.size() + _open->requested_chunks.size()) / 8;
+
+  return size;
+}
+
+int file::remove(const request::ptr &req)
+{
+  {
+    mutex::scoped_lock lock(_fs_mutex);
+
+    wait_for_release(lock);
+    discard_local_file(lock);
+  }
+
+  return object::remove(req);
+}
+
+int file::rename(const request::ptr &req, const string &to)
+{
+  {
+    mutex::scoped_lock lock(_fs_mutex);
+
+    wait_for_release(lock);
+
+    // renaming copies what's stored, which doesn't have the modifications
+    if (_open && _open->release_pending) {
+      S3_LOG(LOG_WARNING, "file::rename", "can't rename [%s] until its modifications have been uploaded.\n", get_path().c_str());
+      return _open->write_back_error ? _open->write_back_error : -EIO;
+    }
+  }
+
+  return object::rename(req, to);
 }
 
 void file::init(const request::ptr &req)
@@ -178,6 +350,8 @@ void file::set_sha256_hash(const string &hash)
   if (hash.empty())
     return;
 
+  mutex::scoped_lock lock(get_mutex());
+
   _sha256_hash = hash;
   get_metadata()->replace(static_xattr::from_string(PACKAGE_NAME "_sha256", hash, xattr::XM_VISIBLE));
 }
@@ -195,14 +369,82 @@ void file::on_download_complete(int ret)
 {
   mutex::scoped_lock lock(_fs_mutex);
 
-  if (_status != FS_DOWNLOADING) {
+  if (_open->status != FS_DOWNLOADING) {
     S3_LOG(LOG_ERR, "file::download_complete", "inconsistent state for [%s]. don't know what to do.\n", get_path().c_str());
     return;
   }
 
-  _async_error = ret;
-  _status = 0;
-  _condition.notify_all();
+  _open->async_error = ret;
+  _open->status = 0;
+  _open->downloaded_chunks.clear();
+  _open->priority_offset = -1;
+  _open->condition.notify_all();
+}
+
+void file::mark_range_downloaded(off_t offset, size_t size)
+{
+  mutex::scoped_lock lock(_fs_mutex);
+  size_t first = offset / DOWNLOAD_TRACKING_CHUNK_SIZE;
+  size_t last = (offset + size + DOWNLOAD_TRACKING_CHUNK_SIZE - 1) / DOWNLOAD_TRACKING_CHUNK_SIZE;
+
+  if (last > _open->downloaded_chunks.size())
+    last = _open->downloaded_chunks.size();
+
+  for (size_t i = first; i < last; i++)
+    _open->downloaded_chunks[i] = true;
+
+  _open->condition.notify_all();
+}
+
+void file::mark_range_modified(const mutex::scoped_lock &, off_t offset, size_t size)
+{
+  size_t first = offset / DOWNLOAD_TRACKING_CHUNK_SIZE;
+  size_t last = (offset + size + DOWNLOAD_TRACKING_CHUNK_SIZE - 1) / DOWNLOAD_TRACKING_CHUNK_SIZE;
+
+  if (last > _open->modified_chunks.size())
+    last = _open->modified_chunks.size();
+
+  for (size_t i = first; i < last; i++)
+    _open->modified_chunks[i] = true;
+}
+
+bool file::is_range_modified(off_t offset, size_t size)
+{
+  mutex::scoped_lock lock(_fs_mutex);
+  size_t first = offset / DOWNLOAD_TRACKING_CHUNK_SIZE;
+  size_t last = (offset + size + DOWNLOAD_TRACKING_CHUNK_SIZE - 1) / DOWNLOAD_TRACKING_CHUNK_SIZE;
+
+  if (last > _open->modified_chunks.size())
+    return true;
+
+  for (size_t i = first; i < last; i++)
+    if (_open->modified_chunks[i])
+      return true;
+
+  return false;
+}
+
+bool file::is_range_downloaded(const mutex::scoped_lock &, off_t offset, size_t size)
+{
+  size_t first = offset / DOWNLOAD_TRACKING_CHUNK_SIZE;
+  size_t last = (offset + size + DOWNLOAD_TRACKING_CHUNK_SIZE - 1) / DOWNLOAD_TRACKING_CHUNK_SIZE;
+
+  // anything past the end of the file is, trivially, available
+  if (last > _open->downloaded_chunks.size())
+    last = _open->downloaded_chunks.size();
+
+  for (size_t i = first; i < last; i++)
+    if (!_open->downloaded_chunks[i])
+      return false;
+
+  return true;
+}
+
+off_t file::get_priority_offset()
+{
+  mutex::scoped_lock lock(_fs_mutex);
+
+  return _open->priority_offset;
 }
 
 int file::is_downloadable()
@@ -214,38 +456,115 @@ int file::open(file_open_mode mode, uint64_t *handle)
 {
   mutex::scoped_lock lock(_fs_mutex);
 
-  if (_ref_count == 0) {
-    char temp_name[] = TEMP_NAME_TEMPLATE;
-    off_t size = get_stat()->st_size;
+  if (_open && _open->release_pending) {
+    if (mode & fs::OPEN_TRUNCATE_TO_ZERO) {
+      // we can't truncate while the local copy is being uploaded, and we 
+      // can't wait for the upload here because the caller holds the cache
+      // lock, so file::open(path) waits and tries again. if the upload 
+      // failed, whatever's in the local copy is about to be thrown out 
+      // anyway.
+      if (_open->status & FS_UPLOADING)
+        return -EAGAIN;
+
+      discard_local_file(lock);
+    } else {
+      // the local copy is still around, and is newer than what's stored
+      ++s_write_back_reopens;
+      _open->release_pending = false;
+      _open->write_back_retries = 0;
+
+      unstrand(lock);
+    }
+  }
+
+  if (!_open) {
+    int r;
+
+    _open.reset(new open_state());
+
+    r = open_local_file(lock, mode);
+
+    if (r) {
+      if (!_open->local_path.empty())
+        unlink(_open->local_path.c_str());
+
+      _open.reset();
+
+      return r;
+    }
+  } else {
+    ++s_reopens;
+  }
+
+  *handle = reinterpret_cast<uint64_t>(this);
+  _open->ref_count++;
+
+  return 0;
+}
+
+int file::open_local_file(const mutex::scoped_lock &, file_open_mode mode)
+{
+  char temp_name[] = TEMP_NAME_TEMPLATE;
+  off_t size = get_size();
+
+  if (upload_journal::is_enabled() && can_journal_upload()) {
+    // upload_journal removes this on the next mount if nothing was being
+    // uploaded from it
+    _open->fd = upload_journal::create_local_file(&_open->local_path);
+
+    S3_LOG(LOG_DEBUG, "file::open", "opening [%s] in [%s].\n", get_path().c_str(), _open->local_path.c_str());
 
-    _fd = mkstemp(temp_name);
+  } else {
+    _open->fd = mkstemp(temp_name);
     unlink(temp_name);
 
     S3_LOG(LOG_DEBUG, "file::open", "opening [%s] in [%s].\n", get_path().c_str(), temp_name);
+  }
+
+  if (_open->fd == -1)
+    return -errno;
 
-    if (_fd == -1)
+  _open->appending = config::get_stream_uploads() && (size == 0 || (mode & fs::OPEN_TRUNCATE_TO_ZERO));
+
+  if (mode & fs::OPEN_TRUNCATE_TO_ZERO) {
+    // if the file had a non-zero size but was opened with O_TRUNC, we need
+    // to write back a zero-length file.
+
+    if (size)
+      _open->status = FS_DIRTY;
+
+    _open->modified_chunks.clear();
+
+  } else {
+    if (ftruncate(_open->fd, size) != 0)
       return -errno;
 
-    if (mode & fs::OPEN_TRUNCATE_TO_ZERO) {
-      // if the file had a non-zero size but was opened with O_TRUNC, we need
-      // to write back a zero-length file.
+    _open->modified_chunks.assign((size + DOWNLOAD_TRACKING_CHUNK_SIZE - 1) / DOWNLOAD_TRACKING_CHUNK_SIZE, false);
 
-      if (size)
-        _status = FS_DIRTY;
+    if (size > 0) {
+      int r;
 
-    } else {
-      if (ftruncate(_fd, size) != 0)
-        return -errno;
+      r = is_downloadable();
+
+      if (r)
+        return r;
 
-      if (size > 0) {
-        int r;
+      _open->downloaded_chunks.assign((size + DOWNLOAD_TRACKING_CHUNK_SIZE - 1) / DOWNLOAD_TRACKING_CHUNK_SIZE, false);
 
-        r = is_downloadable();
+      if (config::get_stream_downloads()) {
+        size_t chunk_size = service::get_file_transfer()->get_download_chunk_size();
+
+        r = prepare_download();
 
         if (r)
           return r;
 
-        _status = FS_DOWNLOADING;
+        // nothing is fetched until someone reads
+        _open->status = FS_STREAMING;
+        _open->requested_chunks.assign((size + chunk_size - 1) / chunk_size, false);
+
+      } else {
+        _open->status = FS_DOWNLOADING;
 
         pool::post(
           threads::PR_0,
@@ -253,13 +572,8 @@ int file::open(file_open_mode mode, uint64_t *handle)
           bind(&file::on_download_complete, shared_from_this(), _1));
       }
     }
-  } else {
-    ++s_reopens;
   }
 
-  *handle = reinterpret_cast<uint64_t>(this);
-  _ref_count++;
-
   return 0;
 }
 
@@ -267,224 +581,1038 @@ int file::release()
 {
   mutex::scoped_lock lock(_fs_mutex);
 
-  if (_ref_count == 0) {
+  if (!_open || _open->ref_count == 0) {
     S3_LOG(LOG_WARNING, "file::release", "attempt to release file [%s] with zero ref-count\n", get_path().c_str());
     return -EINVAL;
   }
 
-  _ref_count--;
+  if (_open->ref_count == 1 && (_open->status & FS_STREAMING)) {
+    // let chunks already in flight land, but don't fetch any more
+    _open->stream_stopping = true;
 
-  if (_ref_count == 0) {
-    if (_status != 0) {
-      S3_LOG(LOG_ERR, "file::release", "released file [%s] with non-quiescent status [%i].\n", get_path().c_str(), _status);
-      return -EBUSY;
+    while (_open->stream_running)
+      _open->condition.wait(lock);
+
+    _open->stream_stopping = false;
+
+    // someone may have opened the file while we were waiting
+    if (_open->ref_count == 1) {
+      _open->status &= ~FS_STREAMING;
+      _open->downloaded_chunks.clear();
+      _open->requested_chunks.clear();
     }
+  }
 
-    // update stat here so that subsequent calls to copy_stat() will get the
-    // correct file size
-    update_stat(lock);
+  _open->ref_count--;
+
+  if (_open->ref_count == 0) {
+    if (_open->status & FS_UPLOADING) {
+      // a write-back is in progress -- on_write_back_complete() will close 
+      // the file
+      _open->release_pending = true;
+      return 0;
+    }
+
+    if (_open->status == FS_DIRTY && _open->write_back_error) {
+      _open->release_pending = true;
+
+      if (config::get_write_back()) {
+        // close() already reported that the last upload failed, but the 
+        // modifications are still here, so keep trying
+        on_upload_failed(lock, _open->write_back_error);
+        return 0;
+      }
 
-    close(_fd);
-    _fd = -1;
+      // without write-back, close() reporting the error is all we do
+      S3_LOG(LOG_ERR, "file::release", "upload of [%s] failed with error %i and write-back is disabled. discarding modifications.\n", get_path().c_str(), _open->write_back_error);
 
-    expire();
+      discard_local_file(lock);
+      return 0;
+    }
+
+    if (_open->status != 0) {
+      S3_LOG(LOG_ERR, "file::release", "released file [%s] with non-quiescent status [%i].\n", get_path().c_str(), _open->status);
+      return -EBUSY;
+    }
+
+    close_local_file(lock);
   }
 
   return 0;
 }
 
-int file::flush()
+void file::close_local_file(const mutex::scoped_lock &lock)
 {
-  mutex::scoped_lock lock(_fs_mutex);
+  // only left over if the final upload never happened
+  stop_appending(lock);
 
-  while (_status & (FS_DOWNLOADING | FS_UPLOADING | FS_WRITING))
-    _condition.wait(lock);
+  // abandoned uploads hold on to the open_state (and so keep the local copy
+  // open) until their parts are done, so there's no need to wait for them
+  _open->cancelled_upload_streams.clear();
 
-  if (_async_error)
-    return _async_error;
+  // update stat here so that subsequent calls to copy_stat() will get the
+  // correct file size
+  update_stat(lock);
 
-  if (!(_status & FS_DIRTY)) {
-    ++s_non_dirty_flushes;
+  if (!_open->local_path.empty())
+    unlink(_open->local_path.c_str());
 
-    S3_LOG(LOG_DEBUG, "file::flush", "skipping flush for non-dirty file [%s].\n", get_path().c_str());
-    return 0;
-  }
+  unstrand(lock);
 
-  _status |= FS_UPLOADING;
+  // anyone still waiting has a reference of their own
+  _open->condition.notify_all();
+  _open.reset();
 
-  lock.unlock();
-  _async_error = pool::call(threads::PR_0, bind(&file::upload, shared_from_this(), _1));
-  lock.lock();
+  expire();
+}
 
-  _status = 0;
-  _condition.notify_all();
+void file::wait_for_release(mutex::scoped_lock &lock)
+{
+  open_state::ptr st = _open;
 
-  return _async_error;
+  // a failed write-back leaves release_pending set, but no longer uses the
+  // local copy
+  while (st && st->release_pending && (st->status & FS_UPLOADING))
+    st->condition.wait(lock);
 }
 
-int file::write(const char *buffer, size_t size, off_t offset)
+void file::discard_local_file(const mutex::scoped_lock &lock)
+{
+  if (!_open || !_open->release_pending)
+    return;
+
+  S3_LOG(LOG_WARNING, "file::discard_local_file", "discarding modifications to [%s] that couldn't be uploaded.\n", get_path().c_str());
+
+  _open->status = 0;
+  _open->write_back_error = 0;
+  _open->release_pending = false;
+
+  close_local_file(lock);
+}
+
+int file::flush()
 {
   mutex::scoped_lock lock(_fs_mutex);
-  int r;
+  bool write_back = config::get_write_back();
 
-  while (_status & (FS_DOWNLOADING | FS_UPLOADING))
-    _condition.wait(lock);
+  // with write-back enabled, an upload that's already under way is as good
+  // as done as far as close() is concerned
+  while ((_open->status & (FS_DOWNLOADING | FS_WRITING)) || (!write_back && (_open->status & FS_UPLOADING)))
+    _open->condition.wait(lock);
 
-  if (_async_error)
-    return _async_error;
+  if (_open->async_error)
+    return _open->async_error;
 
-  _status |= FS_DIRTY | FS_WRITING;
+  if (!(_open->status & FS_DIRTY)) {
+    ++s_non_dirty_flushes;
 
-  lock.unlock();
-  r = pwrite(_fd, buffer, size, offset);
-  lock.lock();
+    S3_LOG(LOG_DEBUG, "file::flush", "skipping flush for non-dirty file [%s].\n", get_path().c_str());
+    return 0;
+  }
 
-  _status &= ~FS_WRITING;
-  _condition.notify_all();
+  // if the last write-back failed, try again here so that close() reports
+  // what happens this time
+  if (write_back && !_open->write_back_error && start_write_back(lock))
+    return 0;
 
-  return r;
+  return upload_now(lock);
 }
 
-int file::read(char *buffer, size_t size, off_t offset)
+int file::fsync()
 {
   mutex::scoped_lock lock(_fs_mutex);
 
-  while (_status & FS_DOWNLOADING)
-    _condition.wait(lock);
+  // this is the durability barrier for write-back, so wait for any upload
+  // that's in progress and then upload anything that's still dirty
 
-  if (_async_error)
-    return _async_error;
+  while (_open->status & (FS_DOWNLOADING | FS_UPLOADING | FS_WRITING))
+    _open->condition.wait(lock);
 
-  lock.unlock();
+  if (_open->async_error)
+    return _open->async_error;
+
+  if (!(_open->status & FS_DIRTY))
+    return 0;
 
-  return pread(_fd, buffer, size, offset);
+  return upload_now(lock);
 }
 
-int file::truncate(off_t length)
+void file::unstrand(const mutex::scoped_lock &)
+{
+  mutex::scoped_lock wb_lock(s_write_back_mutex);
+
+  s_stranded_files.erase(shared_from_this());
+}
+
+void file::upload_stranded()
 {
   mutex::scoped_lock lock(_fs_mutex);
   int r;
 
-  while (_status & (FS_DOWNLOADING | FS_UPLOADING))
-    _condition.wait(lock);
-
-  if (_async_error)
-    return _async_error;
+  if (!_open || !_open->release_pending || _open->status != FS_DIRTY)
+    return;
 
-  _status |= FS_DIRTY | FS_WRITING;
+  S3_LOG(LOG_INFO, "file::upload_stranded", "making a final attempt to upload [%s].\n", get_path().c_str());
 
-  lock.unlock();
-  r = ftruncate(_fd, length);
-  lock.lock();
+  r = upload_now(lock);
 
-  _status &= ~FS_WRITING;
-  _condition.notify_all();
+  if (r) {
+    S3_LOG(LOG_ERR, "file::upload_stranded", "final upload of [%s] failed with error %i. modifications are lost.\n", get_path().c_str(), r);
 
-  return r;
+    unstrand(lock);
+  }
 }
 
-int file::write_chunk(const char *buffer, size_t size, off_t offset)
+bool file::start_write_back(const mutex::scoped_lock &, bool force, int delay_in_s)
 {
-  ssize_t r;
-  
-  r = pwrite(_fd, buffer, size, offset);
+  size_t size = get_local_size();
 
-  if (r != static_cast<ssize_t>(size))
-    return -errno;
+  {
+    mutex::scoped_lock wb_lock(s_write_back_mutex);
 
-  if (_hash_list)
-    _hash_list->compute_hash(offset, reinterpret_cast<const uint8_t *>(buffer), size);
+    // always allow at least one write-back, however large
+    if (!force && s_write_back_bytes && s_write_back_bytes + size > static_cast<uint64_t>(config::get_max_write_back_size_in_mb()) * 1024 * 1024) {
+      ++s_write_backs_throttled;
+      return false;
+    }
 
-  return 0;
+    s_write_back_bytes += size;
+    s_write_backs_in_progress++;
+  }
+
+  ++s_write_backs;
+
+  _open->status |= FS_UPLOADING;
+
+  pool::post(
+    threads::PR_0,
+    bind(&file::upload_in_background, shared_from_this(), delay_in_s, _1),
+    bind(&file::on_write_back_complete, shared_from_this(), size, _1));
+
+  return true;
 }
 
-int file::read_chunk(size_t size, off_t offset, const char_vector_ptr &buffer)
+void file::on_write_back_complete(size_t size, int ret)
 {
-  ssize_t r;
+  mutex::scoped_lock lock(_fs_mutex);
 
-  buffer->resize(size);
-  r = pread(_fd, &(*buffer)[0], size, offset);
+  _open->status &= ~FS_UPLOADING;
 
-  if (r != static_cast<ssize_t>(size))
-    return -errno;
+  if (ret) {
+    ++s_write_back_failures;
 
-  if (_hash_list)
-    _hash_list->compute_hash(offset, reinterpret_cast<const uint8_t *>(&(*buffer)[0]), size);
+    S3_LOG(LOG_WARNING, "file::on_write_back_complete", "write-back of [%s] failed with error %i.\n", get_path().c_str(), ret);
 
-  return 0;
-}
+    on_upload_failed(lock, ret);
 
-size_t file::get_local_size()
-{
-  struct stat s;
+  } else {
+    _open->modified_chunks.assign((get_local_size() + DOWNLOAD_TRACKING_CHUNK_SIZE - 1) / DOWNLOAD_TRACKING_CHUNK_SIZE, false);
 
-  if (fstat(_fd, &s) == -1) {
-    S3_LOG(LOG_WARNING, "file::get_local_size", "failed to stat [%s].\n", get_path().c_str());
+    // writes wait for uploads to finish, so nothing can have dirtied the 
+    // file in the meantime
+    _open->status &= ~FS_DIRTY;
+    _open->write_back_error = 0;
+    _open->write_back_retries = 0;
 
-    throw runtime_error("failed to stat local file");
+    if (_open->release_pending) {
+      _open->release_pending = false;
+      close_local_file(lock);
+    }
   }
 
-  return s.st_size;
-}
-
-void file::update_stat()
-{
-  object::update_stat();
+  if (_open)
+    _open->condition.notify_all();
+  lock.unlock();
 
+  // any retry was counted before we got here, so unmounting will wait for it
   {
-    mutex::scoped_lock lock(_fs_mutex);
+    mutex::scoped_lock wb_lock(s_write_back_mutex);
 
-    update_stat(lock);
+    s_write_back_bytes -= size;
+    s_write_backs_in_progress--;
+    s_write_back_condition.notify_all();
   }
 }
 
-void file::update_stat(const mutex::scoped_lock &)
+void file::on_upload_failed(const mutex::scoped_lock &lock, int ret)
 {
-  if (_fd != -1)
-    get_stat()->st_size = get_local_size();
-}
+  // the local copy is still dirty (and still has the only copy of the 
+  // modifications), so keep it around. if the file's open, the next flush or
+  // fsync reports the error and tries again. if it isn't, nobody will call
+  // either, so with write-back enabled we start another one ourselves.
+  _open->write_back_error = ret;
 
-int file::download(const request::ptr & /* ignored */)
-{
-  int r = 0;
+  if (!_open->release_pending || !config::get_write_back())
+    return;
 
-  r = prepare_download();
+  if (_open->write_back_retries >= config::get_max_write_back_retries()) {
+    S3_LOG(LOG_ERR, "file::on_upload_failed", "giving up on uploading [%s]. modifications will be kept locally until it's next opened, and uploaded one last time at unmount.\n", get_path().c_str());
 
-  if (r)
-    return r;
+    {
+      mutex::scoped_lock wb_lock(s_write_back_mutex);
 
-  r = service::get_file_transfer()->download(
-    get_url(),
-    get_local_size(),
-    bind(&file::write_chunk, shared_from_this(), _1, _2, _3));
+      s_stranded_files.insert(shared_from_this());
+    }
 
-  if (r)
-    return r;
+    return;
+  }
 
-  return finalize_download();
+  // back off so that whatever made the last attempt fail has a chance to 
+  // clear up
+  ++_open->write_back_retries;
+  ++s_write_back_retries;
+
+  // with force set, this can't fail
+  start_write_back(lock, true, WRITE_BACK_RETRY_BASE_DELAY_IN_S << (_open->write_back_retries - 1));
 }
 
-int file::prepare_download()
+int file::upload_now(mutex::scoped_lock &lock)
 {
-  if (!_sha256_hash.empty())
-    _hash_list.reset(new hash_list<sha256>(get_local_size()));
+  int r;
 
-  return 0;
-}
+  _open->status |= FS_UPLOADING;
+  _open->write_back_error = 0;
 
-int file::finalize_download()
-{
-  if (!_sha256_hash.empty()) {
-    string computed_hash = _hash_list->get_root_hash<hex>();
+  lock.unlock();
+  r = pool::call(threads::PR_0, bind(&file::upload, shared_from_this(), _1));
+  lock.lock();
 
-    if (computed_hash != _sha256_hash) {
-      ++s_sha256_mismatches;
+  if (r) {
+    _open->status &= ~FS_UPLOADING;
+    on_upload_failed(lock, r);
 
-      S3_LOG(
-        LOG_WARNING, 
-        "file::finalize_download", 
-        "sha256 mismatch for %s. expected %s, got %s.\n",
-        get_path().c_str(),
+  } else {
+    // what's stored now matches what we have locally
+    _open->modified_chunks.assign((get_local_size() + DOWNLOAD_TRACKING_CHUNK_SIZE - 1) / DOWNLOAD_TRACKING_CHUNK_SIZE, false);
+
+    _open->status = 0;
+    _open->write_back_retries = 0;
+
+    if (_open->release_pending) {
+      _open->release_pending = false;
+      close_local_file(lock);
+    }
+  }
+
+  if (_open)
+    _open->condition.notify_all();
+
+  return r;
+}
+
+int file::write(const char *buffer, size_t size, off_t offset)
+{
+  mutex::scoped_lock lock(_fs_mutex);
+  int r;
+
+  finish_stream(lock);
+
+  while (_open->status & (FS_DOWNLOADING | FS_UPLOADING))
+    _open->condition.wait(lock);
+
+  if (_open->async_error)
+    return _open->async_error;
+
+  if (!(_open->status & FS_DIRTY))
+    _open->dirty_since = time(NULL);
+
+  _open->status |= FS_DIRTY | FS_WRITING;
+  mark_range_modified(lock, offset, size);
+
+  if (_open->appending) {
+    if (offset == _open->append_offset)
+      _open->append_offset += size;
+    else
+      stop_appending(lock);
+  }
+
+  lock.unlock();
+  r = pwrite(_open->fd, buffer, size, offset);
+  lock.lock();
+
+  _open->status &= ~FS_WRITING;
+  _open->condition.notify_all();
+
+  if (_open->appending) {
+    if (r == static_cast<int>(size))
+      send_appended_parts(lock);
+    else
+      stop_appending(lock);
+  }
+
+  // don't let long-lived writers keep modifications local indefinitely
+  if (
+    config::get_write_back() && 
+    config::get_write_back_checkpoint_interval_in_s() > 0 &&
+    _open->status == FS_DIRTY &&
+    time(NULL) - _open->dirty_since >= config::get_write_back_checkpoint_interval_in_s() &&
+    start_write_back(lock))
+    ++s_write_back_checkpoints;
+
+  return r;
+}
+
+int file::read(char *buffer, size_t size, off_t offset)
+{
+  mutex::scoped_lock lock(_fs_mutex);
+
+  // rather than wait for the whole download to finish, only wait until the
+  // chunks covering [offset, offset + size) have been written, and ask the
+  // download to fetch those chunks next
+
+  if (_open->status & (FS_DOWNLOADING | FS_STREAMING)) {
+    ++s_reads_during_download;
+
+    if (_open->status & FS_STREAMING)
+      update_read_ahead(lock, offset, size);
+
+    if (!is_range_downloaded(lock, offset, size))
+      ++s_reads_blocked_on_download;
+
+    while ((_open->status & (FS_DOWNLOADING | FS_STREAMING)) && !is_range_downloaded(lock, offset, size)) {
+      _open->priority_offset = offset;
+      _open->condition.wait(lock);
+    }
+  }
+
+  if (_open->async_error)
+    return _open->async_error;
+
+  lock.unlock();
+
+  return pread(_open->fd, buffer, size, offset);
+}
+
+int file::truncate(off_t length)
+{
+  mutex::scoped_lock lock(_fs_mutex);
+  int r;
+
+  finish_stream(lock);
+
+  while (_open->status & (FS_DOWNLOADING | FS_UPLOADING))
+    _open->condition.wait(lock);
+
+  if (_open->async_error)
+    return _open->async_error;
+
+  if (!(_open->status & FS_DIRTY))
+    _open->dirty_since = time(NULL);
+
+  _open->status |= FS_DIRTY | FS_WRITING;
+
+  stop_appending(lock);
+
+  // everything past the new end (or the old end, if we're growing) is zeros
+  // or gone
+  mark_range_modified(
+    lock, 
+    (length < static_cast<off_t>(get_local_size())) ? length : get_local_size(),
+    _open->modified_chunks.size() * DOWNLOAD_TRACKING_CHUNK_SIZE);
+
+  lock.unlock();
+  r = ftruncate(_open->fd, length);
+  lock.lock();
+
+  _open->status &= ~FS_WRITING;
+  _open->condition.notify_all();
+
+  return r;
+}
+
+void file::send_appended_parts(const mutex::scoped_lock &)
+{
+  size_t chunk_size = service::get_file_transfer()->get_upload_chunk_size();
+
+  if (chunk_size == 0 || static_cast<uint64_t>(_open->append_offset) < (_open->parts_sent + 1) * chunk_size)
+    return;
+
+  if (!_open->upload_stream) {
+    // the hash list is rebuilt once we know how large the file is, so parts
+    // sent now aren't hashed
+    if (prepare_upload()) {
+      _open->appending = false;
+      return;
+    }
+
+    _open->hash_list.reset();
+    _open->upload_stream = service::get_file_transfer()->begin_upload_stream(
+      get_url(),
+      bind(&file::read_local_chunk, shared_from_this(), _open, _1, _2, _3));
+
+    if (!_open->upload_stream) {
+      _open->appending = false;
+      return;
+    }
+
+    ++s_streamed_uploads;
+  }
+
+  // concurrent appends may not all have landed yet, but any part that's sent
+  // with stale data is sent again when the upload is completed
+  while ((_open->parts_sent + 1) * chunk_size <= static_cast<uint64_t>(_open->append_offset))
+    _open->upload_stream->send_part(_open->parts_sent++);
+}
+
+void file::stop_appending(const mutex::scoped_lock &)
+{
+  _open->appending = false;
+
+  if (!_open->upload_stream)
+    return;
+
+  ++s_streamed_uploads_abandoned;
+
+  // cancel() waits for the parts in flight, but not here, since we're 
+  // holding _fs_mutex
+  pool::post(
+    threads::PR_REQ_0,
+    bind(&file_transfer::upload_stream::cancel, _open->upload_stream, _1));
+
+  _open->cancelled_upload_streams.push_back(_open->upload_stream);
+  _open->upload_stream.reset();
+}
+
+int file::write_chunk(const char *buffer, size_t size, off_t offset)
+{
+  ssize_t r;
+  
+  r = pwrite(_open->fd, buffer, size, offset);
+
+  if (r != static_cast<ssize_t>(size))
+    return -errno;
+
+  if (_open->hash_list) {
+    if (size >= PARALLEL_HASH_MIN_SIZE)
+      _open->hash_list->compute_hash_parallel(offset, reinterpret_cast<const uint8_t *>(buffer), size);
+    else
+      _open->hash_list->compute_hash(offset, reinterpret_cast<const uint8_t *>(buffer), size);
+  }
+
+  update_md5(buffer, size, offset);
+  mark_range_downloaded(offset, size);
+
+  return 0;
+}
+
+int file::read_chunk(size_t size, off_t offset, const char_vector_ptr &buffer)
+{
+  return read_local_chunk(_open, size, offset, buffer);
+}
+
+int file::read_local_chunk(const open_state::ptr &st, size_t size, off_t offset, const char_vector_ptr &buffer)
+{
+  buffer->resize(size);
+
+  // read, hash, and encode a hash list chunk at a time so that each chunk is
+  // only brought into cache once
+  for (size_t pos = 0; pos < size; pos += hash_list<sha256>::CHUNK_SIZE) {
+    char *data = &(*buffer)[pos];
+    size_t chunk_size = (size - pos < hash_list<sha256>::CHUNK_SIZE) ? size - pos : hash_list<sha256>::CHUNK_SIZE;
+    ssize_t r;
+
+    r = pread(st->fd, data, chunk_size, offset + pos);
+
+    if (r != static_cast<ssize_t>(chunk_size))
+      return -errno;
+
+    if (st->hash_list)
+      st->hash_list->compute_hash(offset + pos, reinterpret_cast<const uint8_t *>(data), chunk_size);
+
+    encode_read_chunk(data, chunk_size, offset + pos);
+  }
+
+  return 0;
+}
+
+void file::encode_read_chunk(char * /* data */, size_t /* size */, off_t /* offset */)
+{
+}
+
+size_t file::get_local_size()
+{
+  struct stat s;
+
+  if (fstat(_open->fd, &s) == -1) {
+    S3_LOG(LOG_WARNING, "file::get_local_size", "failed to stat [%s].\n", get_path().c_str());
+
+    throw runtime_error("failed to stat local file");
+  }
+
+  return s.st_size;
+}
+
+void file::update_stat()
+{
+  object::update_stat();
+
+  {
+    mutex::scoped_lock lock(_fs_mutex);
+
+    update_stat(lock);
+  }
+}
+
+void file::update_stat(const mutex::scoped_lock &)
+{
+  if (_open)
+    set_size(get_local_size());
+}
+
+int file::download(const request::ptr & /* ignored */)
+{
+  int r = 0;
+  string cache_key = get_block_cache_key();
+  file_transfer::write_chunk_fn on_write = bind(&file::write_chunk, shared_from_this(), _1, _2, _3);
+
+  r = prepare_download();
+
+  if (r)
+    return r;
+
+  if (!cache_key.empty()) {
+    vector<size_t> missing_blocks;
+
+    // if the cache has any of the object, only what it doesn't have is
+    // downloaded
+    if (download_from_block_cache(cache_key, &missing_blocks)) {
+      r = download_blocks(cache_key, missing_blocks);
+
+      if (r)
+        return r;
+
+      // cached blocks go through the same verification as downloaded ones, 
+      // so a corrupt cache costs us a download but never bad data
+      if (finalize_download() == 0)
+        return 0;
+
+      S3_LOG(LOG_WARNING, "file::download", "discarding cached blocks for [%s].\n", get_path().c_str());
+
+      block_cache::remove(cache_key);
+
+      r = prepare_download();
+
+      if (r)
+        return r;
+    }
+
+    on_write = bind(&file::write_cacheable_chunk, shared_from_this(), cache_key, _1, _2, _3);
+  }
+
+  r = service::get_file_transfer()->download(
+    get_url(),
+    get_local_size(),
+    on_write,
+    bind(&file::get_priority_offset, shared_from_this()));
+
+  if (r)
+    return r;
+
+  r = finalize_download();
+
+  if (r && !cache_key.empty())
+    block_cache::remove(cache_key);
+
+  return r;
+}
+
+int file::stream(const request::ptr & /* ignored */)
+{
+  int r = 0;
+  string cache_key = get_block_cache_key();
+  file_transfer::write_chunk_fn on_write = bind(&file::write_chunk, shared_from_this(), _1, _2, _3);
+  bool complete = false;
+
+  if (!cache_key.empty())
+    on_write = bind(&file::write_cacheable_chunk, shared_from_this(), cache_key, _1, _2, _3);
+
+  r = service::get_file_transfer()->download_stream(
+    get_url(),
+    get_local_size(),
+    on_write,
+    bind(&file::get_next_stream_chunk, shared_from_this(), cache_key));
+
+  if (r)
+    return r;
+
+  {
+    mutex::scoped_lock lock(_fs_mutex);
+
+    complete = is_range_downloaded(lock, 0, _open->downloaded_chunks.size() * DOWNLOAD_TRACKING_CHUNK_SIZE);
+  }
+
+  // we can only verify the file once we have all of it
+  if (!complete)
+    return 0;
+
+  r = finalize_download();
+
+  if (r && !cache_key.empty())
+    block_cache::remove(cache_key);
+
+  return r;
+}
+
+void file::on_stream_complete(int ret)
+{
+  mutex::scoped_lock lock(_fs_mutex);
+
+  _open->stream_running = false;
+
+  if (ret) {
+    _open->async_error = ret;
+    _open->status &= ~FS_STREAMING;
+
+  } else if (is_range_downloaded(lock, 0, _open->downloaded_chunks.size() * DOWNLOAD_TRACKING_CHUNK_SIZE)) {
+    _open->status &= ~FS_STREAMING;
+
+  } else {
+    // readers may have asked for more while we were winding down
+    start_stream(lock);
+  }
+
+  if (!(_open->status & FS_STREAMING)) {
+    _open->downloaded_chunks.clear();
+    _open->requested_chunks.clear();
+  }
+
+  _open->condition.notify_all();
+}
+
+int file::get_next_stream_chunk(const string &cache_key)
+{
+  mutex::scoped_lock lock(_fs_mutex);
+  int chunk;
+
+  // chunks found in the block cache are filled in here rather than handed 
+  // back to be downloaded
+  while ((chunk = find_stream_chunk(lock)) >= 0) {
+    bool hit;
+
+    _open->requested_chunks[chunk] = true;
+
+    if (cache_key.empty())
+      break;
+
+    lock.unlock();
+    hit = fill_from_block_cache(cache_key, chunk);
+    lock.lock();
+
+    if (!hit)
+      break;
+  }
+
+  return chunk;
+}
+
+int file::find_stream_chunk(const mutex::scoped_lock &)
+{
+  if (_open->stream_stopping)
+    return -1;
+
+  for (size_t i = _open->stream_begin; i < _open->stream_end; i++)
+    if (!_open->requested_chunks[i])
+      return i;
+
+  if (_open->stream_fetch_all) {
+    while (_open->stream_next_unrequested < _open->requested_chunks.size() && _open->requested_chunks[_open->stream_next_unrequested])
+      _open->stream_next_unrequested++;
+
+    if (_open->stream_next_unrequested < _open->requested_chunks.size())
+      return _open->stream_next_unrequested;
+  }
+
+  return -1;
+}
+
+void file::start_stream(const mutex::scoped_lock &lock)
+{
+  if (_open->stream_running || find_stream_chunk(lock) == -1)
+    return;
+
+  _open->stream_running = true;
+
+  pool::post(
+    threads::PR_0,
+    bind(&file::stream, shared_from_this(), _1),
+    bind(&file::on_stream_complete, shared_from_this(), _1));
+}
+
+void file::finish_stream(mutex::scoped_lock &lock)
+{
+  if (!(_open->status & FS_STREAMING))
+    return;
+
+  // we can't modify a partial file, so fetch whatever hasn't been read yet
+  _open->stream_fetch_all = true;
+  start_stream(lock);
+
+  while (_open->status & FS_STREAMING)
+    _open->condition.wait(lock);
+}
+
+void file::update_read_ahead(const mutex::scoped_lock &lock, off_t offset, size_t size)
+{
+  size_t chunk_size = service::get_file_transfer()->get_download_chunk_size();
+  int first = offset / chunk_size;
+  int last = (offset + (size ? size : 1) - 1) / chunk_size;
+
+  if (static_cast<size_t>(first) >= _open->requested_chunks.size())
+    return;
+
+  // reads that stay in the current chunk or move to the next one are
+  // sequential, and double the window each time a new chunk is entered. 
+  // anything else is a seek, and collapses the window.
+
+  if (_open->last_read_chunk != -1 && (first == _open->last_read_chunk || first == _open->last_read_chunk + 1)) {
+    if (_open->read_ahead_window == 0)
+      _open->read_ahead_window = 1;
+    else if (first == _open->last_read_chunk + 1)
+      _open->read_ahead_window *= 2;
+
+    if (_open->read_ahead_window > config::get_max_read_ahead_chunks())
+      _open->read_ahead_window = config::get_max_read_ahead_chunks();
+
+  } else {
+    if (_open->last_read_chunk != -1 && _open->read_ahead_window)
+      ++s_read_ahead_resets;
+
+    _open->read_ahead_window = 0;
+  }
+
+  _open->last_read_chunk = first;
+  _open->stream_begin = first;
+  _open->stream_end = last + 1 + _open->read_ahead_window;
+
+  if (_open->stream_end > _open->requested_chunks.size())
+    _open->stream_end = _open->requested_chunks.size();
+
+  start_stream(lock);
+}
+
+bool file::can_copy_unmodified_ranges()
+{
+  return true;
+}
+
+bool file::can_journal_upload()
+{
+  return true;
+}
+
+string file::get_block_cache_key()
+{
+  if (!block_cache::is_enabled())
+    return "";
+
+  // the key has to change whenever the object's content does
+  if (!_sha256_hash.empty())
+    return "s" + _sha256_hash;
+
+  if (!get_etag().empty())
+    return "e" + hash::compute<sha256, hex>(get_etag());
+
+  return "";
+}
+
+bool file::download_from_block_cache(const string &key, vector<size_t> *missing_blocks)
+{
+  size_t block_size = service::get_file_transfer()->get_download_chunk_size();
+  size_t block_count = (get_local_size() + block_size - 1) / block_size;
+
+  for (size_t i = 0; i < block_count; i++)
+    if (!fill_from_block_cache(key, i))
+      missing_blocks->push_back(i);
+
+  if (missing_blocks->empty())
+    ++s_block_cache_full_hits;
+  else if (missing_blocks->size() < block_count)
+    ++s_block_cache_partial_hits;
+
+  return missing_blocks->size() < block_count || block_count == 0;
+}
+
+int file::download_blocks(const string &key, const vector<size_t> &blocks)
+{
+  size_t next = 0;
+
+  if (blocks.empty())
+    return 0;
+
+  return service::get_file_transfer()->download_stream(
+    get_url(),
+    get_local_size(),
+    bind(&file::write_cacheable_chunk, shared_from_this(), key, _1, _2, _3),
+    bind(&next_block, &blocks, &next));
+}
+
+bool file::fill_from_block_cache(const string &key, size_t index)
+{
+  size_t block_size = service::get_file_transfer()->get_download_chunk_size();
+  size_t size = get_local_size();
+  off_t offset = index * block_size;
+  size_t expected_size = (size - offset < block_size) ? (size - offset) : block_size;
+  char_vector buffer;
+
+  if (!block_cache::get(key, block_size, index, expected_size, &buffer))
+    return false;
+
+  return write_chunk(&buffer[0], expected_size, offset) == 0;
+}
+
+int file::write_cacheable_chunk(const string &key, const char *buffer, size_t size, off_t offset)
+{
+  size_t block_size = service::get_file_transfer()->get_download_chunk_size();
+  size_t file_size = get_local_size();
+  size_t index = offset / block_size;
+  off_t block_offset = index * block_size;
+  size_t block_length = (file_size - block_offset < block_size) ? file_size - block_offset : block_size;
+  vector<char> block;
+  int r;
+
+  r = write_chunk(buffer, size, offset);
+
+  if (r)
+    return r;
+
+  // only whole, aligned blocks are worth keeping. transfers write each block
+  // in order, a piece at a time, so once we have the last piece of a block 
+  // the rest of it is already in the local copy.
+  if (offset + size != block_offset + block_length)
+    return 0;
+
+  if (offset == block_offset) {
+    block_cache::put(key, block_size, index, buffer, size);
+    return 0;
+  }
+
+  block.resize(block_length);
+
+  if (pread(_open->fd, &block[0], block_length, block_offset) == static_cast<ssize_t>(block_length))
+    block_cache::put(key, block_size, index, &block[0], block_length);
+
+  return 0;
+}
+
+void file::update_md5(const char *buffer, size_t size, off_t offset)
+{
+  mutex::scoped_lock lock(_open->md5_mutex);
+
+  if (!_open->md5)
+    return;
+
+  if (offset > _open->md5_offset) {
+    md5_piece &piece = _open->md5_pending[offset];
+
+    if (piece.size >= size)
+      return;
+
+    _open->md5_pending_size -= piece.data.size();
+    piece.size = size;
+    piece.data.clear();
+
+    if (_open->md5_pending_size + size <= MD5_REORDER_BUFFER_SIZE) {
+      piece.data.assign(buffer, buffer + size);
+      _open->md5_pending_size += size;
+      ++s_md5_pieces_buffered;
+    }
+
+    return;
+  }
+
+  hash_md5_piece(lock, buffer, size, offset);
+
+  // catch up on anything that arrived early
+  while (_open->md5 && !_open->md5_pending.empty() && _open->md5_pending.begin()->first <= _open->md5_offset) {
+    std::map<off_t, md5_piece>::iterator itor = _open->md5_pending.begin();
+    off_t piece_offset = itor->first;
+    md5_piece piece;
+
+    piece.size = itor->second.size;
+    piece.data.swap(itor->second.data);
+    _open->md5_pending_size -= piece.data.size();
+    _open->md5_pending.erase(itor);
+
+    if (!piece.data.empty())
+      hash_md5_piece(lock, &piece.data[0], piece.size, piece_offset);
+    else if (static_cast<off_t>(piece_offset + piece.size) > _open->md5_offset)
+      hash_md5_from_file(lock, _open->md5_offset, piece_offset + piece.size - _open->md5_offset);
+  }
+}
+
+void file::hash_md5_piece(const mutex::scoped_lock &, const char *buffer, size_t size, off_t offset)
+{
+  size_t skip = _open->md5_offset - offset;
+
+  // pieces may overlap what's already been hashed if a request was retried
+  if (skip >= size)
+    return;
+
+  _open->md5->update(reinterpret_cast<const uint8_t *>(buffer) + skip, size - skip);
+  _open->md5_offset = offset + size;
+}
+
+bool file::hash_md5_from_file(const mutex::scoped_lock &lock, off_t offset, size_t size)
+{
+  char_vector buffer(DOWNLOAD_TRACKING_CHUNK_SIZE);
+
+  ++s_md5_read_backs;
+
+  while (size) {
+    size_t piece_size = (size < DOWNLOAD_TRACKING_CHUNK_SIZE) ? size : DOWNLOAD_TRACKING_CHUNK_SIZE;
+
+    if (pread(_open->fd, &buffer[0], piece_size, offset) != static_cast<ssize_t>(piece_size)) {
+      S3_LOG(
+        LOG_WARNING,
+        "file::hash_md5_from_file",
+        "failed to read back %s for md5 hash. falling back to full-file hash.\n",
+        get_path().c_str());
+
+      _open->md5.reset();
+      _open->md5_pending.clear();
+      _open->md5_pending_size = 0;
+
+      return false;
+    }
+
+    hash_md5_piece(lock, &buffer[0], piece_size, offset);
+
+    offset += piece_size;
+    size -= piece_size;
+  }
+
+  return true;
+}
+
+int file::prepare_download()
+{
+  mutex::scoped_lock lock(_open->md5_mutex);
+
+  if (!_sha256_hash.empty())
+    _open->hash_list.reset(new hash_list<sha256>(get_local_size()));
+  else if (md5::is_valid_quoted_hex_hash(get_etag()))
+    _open->md5.reset(new md5::context());
+
+  _open->md5_offset = 0;
+  _open->md5_pending.clear();
+  _open->md5_pending_size = 0;
+
+  return 0;
+}
+
+int file::finalize_download()
+{
+  if (!_sha256_hash.empty()) {
+    string computed_hash = _open->hash_list->get_root_hash<hex>();
+
+    if (computed_hash != _sha256_hash) {
+      ++s_sha256_mismatches;
+
+      S3_LOG(
+        LOG_WARNING, 
+        "file::finalize_download", 
+        "sha256 mismatch for %s. expected %s, got %s.\n",
+        get_path().c_str(),
         _sha256_hash.c_str(),
         computed_hash.c_str());
 
@@ -492,7 +1620,34 @@ int file::finalize_download()
     }
   } else if (md5::is_valid_quoted_hex_hash(get_etag())) {
     // as a fallback, use the etag as an md5 hash of the file
-    string computed_hash = hash::compute<md5, hex_with_quotes>(_fd);
+    string computed_hash;
+
+    {
+      mutex::scoped_lock lock(_open->md5_mutex);
+      struct stat s;
+
+      // everything's on disk by now, so read back whatever the incremental
+      // hash hasn't seen yet
+      _open->md5_pending.clear();
+      _open->md5_pending_size = 0;
+
+      if (_open->md5 && fstat(_open->fd, &s) == 0 && s.st_size >= _open->md5_offset)
+        hash_md5_from_file(lock, _open->md5_offset, s.st_size - _open->md5_offset);
+      else
+        _open->md5.reset();
+
+      if (_open->md5) {
+        uint8_t md5_hash[md5::HASH_LEN];
+
+        _open->md5->finalize(md5_hash);
+        _open->md5.reset();
+
+        computed_hash = encoder::encode<hex_with_quotes>(md5_hash, md5::HASH_LEN);
+      }
+    }
+
+    if (computed_hash.empty())
+      computed_hash = hash::compute<md5, hex_with_quotes>(_open->fd);
 
     if (computed_hash != get_etag()) {
       ++s_md5_mismatches;
@@ -520,21 +1675,82 @@ int file::finalize_download()
   return 0;
 }
 
+int file::upload_in_background(int delay_in_s, const request::ptr &req)
+{
+  // nothing's waiting on this, so let reads (and foreground uploads) go 
+  // ahead of it
+  transfer_scheduler::background_scope background;
+
+  if (delay_in_s > 0)
+    timer::sleep(delay_in_s);
+
+  return upload(req);
+}
+
 int file::upload(const request::ptr & /* ignored */)
 {
   int r;
   string returned_etag;
+  file_transfer::upload_stream::ptr stream;
+  vector<file_transfer::upload_stream::ptr> cancelled_streams;
+  upload_journal::source journal_source;
+
+  {
+    mutex::scoped_lock lock(_fs_mutex);
+
+    // writes wait for uploads, so nothing else will be appended
+    stream.swap(_open->upload_stream);
+    cancelled_streams.swap(_open->cancelled_upload_streams);
+    _open->appending = false;
+
+    journal_source.local_path = _open->local_path;
+  }
+
+  // the parts of an abandoned upload may still be reading (and hashing) the 
+  // local copy
+  for (size_t i = 0; i < cancelled_streams.size(); i++)
+    cancelled_streams[i]->wait_for_parts();
+
+  if (stream) {
+    r = upload_streamed(stream, &returned_etag);
+
+    if (r == 0) {
+      r = finalize_upload(returned_etag);
+
+      return r ? r : commit();
+    }
+
+    ++s_streamed_upload_failures;
+
+    S3_LOG(LOG_WARNING, "file::upload", "streamed upload of [%s] failed with error %i. uploading whole file.\n", get_path().c_str(), r);
+  }
 
   r = prepare_upload();
 
   if (r)
     return r;
 
-  r = service::get_file_transfer()->upload(
-    get_url(),
-    get_local_size(),
-    bind(&file::read_chunk, shared_from_this(), _1, _2, _3),
-    &returned_etag);
+  if (!journal_source.local_path.empty())
+    pool::call(threads::PR_REQ_0, bind(&file::get_journal_headers, shared_from_this(), _1, &journal_source.headers));
+
+  if (can_copy_unmodified_ranges())
+    r = service::get_file_transfer()->upload(
+      get_url(),
+      get_local_size(),
+      bind(&file::read_chunk, shared_from_this(), _1, _2, _3),
+      &returned_etag,
+      bind(&file::is_range_modified, shared_from_this(), _1, _2),
+      get_etag(),
+      journal_source.local_path.empty() ? NULL : &journal_source);
+  else
+    r = service::get_file_transfer()->upload(
+      get_url(),
+      get_local_size(),
+      bind(&file::read_chunk, shared_from_this(), _1, _2, _3),
+      &returned_etag,
+      file_transfer::is_range_modified_fn(),
+      "",
+      journal_source.local_path.empty() ? NULL : &journal_source);
 
   if (r)
     return r;
@@ -544,9 +1760,33 @@ int file::upload(const request::ptr & /* ignored */)
   return r ? r : commit();
 }
 
+int file::get_journal_headers(const request::ptr &req, base::header_map *headers)
+{
+  // the same headers that commit() will send, less the hash (which isn't 
+  // known until the upload is done)
+  req->init(base::HTTP_PUT);
+  set_request_headers(req);
+
+  *headers = req->get_headers();
+  headers->erase(service::get_header_meta_prefix() + metadata::SHA256);
+
+  return 0;
+}
+
+int file::upload_streamed(const file_transfer::upload_stream::ptr &stream, string *returned_etag)
+{
+  // prepare_upload() was called when the stream was started, and shouldn't
+  // be called again (encrypted files would get a new key), but the hash list
+  // has to cover the whole file
+  stream->wait_for_parts();
+  _open->hash_list.reset(new hash_list<sha256>(get_local_size()));
+
+  return stream->complete(get_local_size(), returned_etag);
+}
+
 int file::prepare_upload()
 {
-  _hash_list.reset(new hash_list<sha256>(get_local_size()));
+  _open->hash_list.reset(new hash_list<sha256>(get_local_size()));
 
   return 0;
 }
@@ -554,7 +1794,7 @@ int file::prepare_upload()
 int file::finalize_upload(const string &returned_etag)
 {
   set_etag(returned_etag);
-  set_sha256_hash(_hash_list->get_root_hash<hex>());
+  set_sha256_hash(_open->hash_list->get_root_hash<hex>());
 
   return 0;
 }
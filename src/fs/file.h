@@ -22,10 +22,15 @@
 #ifndef S3_FS_FILE_H
 #define S3_FS_FILE_H
 
+#include <map>
+#include <boost/scoped_ptr.hpp>
+
 #include "base/request.h"
 #include "crypto/hash_list.h"
+#include "crypto/md5.h"
 #include "crypto/sha256.h"
 #include "fs/object.h"
+#include "services/file_transfer.h"
 #include "threads/async_handle.h"
 
 namespace s3
@@ -49,6 +54,7 @@ namespace s3
       }
 
       static void test_transfer_chunk_sizes();
+      static void wait_for_write_backs();
       static int open(const std::string &path, file_open_mode mode, uint64_t *handle);
 
       file(const std::string &path);
@@ -60,9 +66,14 @@ namespace s3
       }
 
       virtual bool is_removable();
+      virtual size_t get_approximate_size();
+
+      virtual int remove(const boost::shared_ptr<base::request> &req);
+      virtual int rename(const boost::shared_ptr<base::request> &req, const std::string &to);
 
       int release();
       int flush();
+      int fsync();
       int write(const char *buffer, size_t size, off_t offset);
       int read(char *buffer, size_t size, off_t offset);
       int truncate(off_t length);
@@ -75,6 +86,18 @@ namespace s3
       virtual int write_chunk(const char *buffer, size_t size, off_t offset);
       virtual int read_chunk(size_t size, off_t offset, const base::char_vector_ptr &buffer);
 
+      // called by read_chunk() on each hash list chunk, in place, once it's 
+      // been read and hashed
+      virtual void encode_read_chunk(char *data, size_t size, off_t offset);
+
+      virtual std::string get_block_cache_key();
+
+      virtual bool can_copy_unmodified_ranges();
+
+      // if true, and the upload journal is enabled, the local copy is kept
+      // where a later mount can finish uploading it
+      virtual bool can_journal_upload();
+
       virtual int prepare_download();
       virtual int finalize_download();
 
@@ -103,17 +126,30 @@ namespace s3
         inline transfer_part() : id(0), offset(0), size(0), retry_count(0), success(false) { }
       };
 
+      // a piece of the file that was downloaded ahead of where the md5 hash
+      // has got to. if data is empty, the piece has to be read back from the
+      // local copy.
+      struct md5_piece
+      {
+        size_t size;
+        std::vector<char> data;
+
+        inline md5_piece() : size(0) { }
+      };
+
       enum status
       {
         FS_DOWNLOADING = 0x1,
         FS_UPLOADING   = 0x2,
         FS_WRITING     = 0x4,
-        FS_DIRTY       = 0x8
+        FS_DIRTY       = 0x8,
+        FS_STREAMING   = 0x10
       };
 
       static void open_locked_object(const object::ptr &obj, file_open_mode mode, uint64_t *handle, int *status);
 
       int open(file_open_mode mode, uint64_t *handle);
+      int open_local_file(const boost::mutex::scoped_lock &, file_open_mode mode);
 
       int download(const boost::shared_ptr<base::request> &);
 
@@ -121,7 +157,28 @@ namespace s3
       int download_multi();
       int download_part(const boost::shared_ptr<base::request> &req, const transfer_part *part);
 
+      int stream(const boost::shared_ptr<base::request> &);
+      void on_stream_complete(int ret);
+      int get_next_stream_chunk(const std::string &cache_key);
+      int find_stream_chunk(const boost::mutex::scoped_lock &);
+      void start_stream(const boost::mutex::scoped_lock &);
+      void finish_stream(boost::mutex::scoped_lock &lock);
+      void update_read_ahead(const boost::mutex::scoped_lock &, off_t offset, size_t size);
+
+      // fills in whatever blocks the cache has, and returns false if it has
+      // none of them
+      bool download_from_block_cache(const std::string &key, std::vector<size_t> *missing_blocks);
+      int download_blocks(const std::string &key, const std::vector<size_t> &blocks);
+      bool fill_from_block_cache(const std::string &key, size_t index);
+      int write_cacheable_chunk(const std::string &key, const char *buffer, size_t size, off_t offset);
+
       int upload(const boost::shared_ptr<base::request> &);
+      int upload_in_background(int delay_in_s, const boost::shared_ptr<base::request> &req);
+      int upload_streamed(const services::file_transfer::upload_stream::ptr &stream, std::string *returned_etag);
+      int get_journal_headers(const boost::shared_ptr<base::request> &req, base::header_map *headers);
+
+      void send_appended_parts(const boost::mutex::scoped_lock &);
+      void stop_appending(const boost::mutex::scoped_lock &lock);
 
       int upload_single(const boost::shared_ptr<base::request> &req, std::string *returned_etag);
       int upload_multi(std::string *returned_etag);
@@ -138,16 +195,101 @@ namespace s3
 
       void on_download_complete(int ret);
 
+      int upload_now(boost::mutex::scoped_lock &lock);
+      bool start_write_back(const boost::mutex::scoped_lock &, bool force = false, int delay_in_s = 0);
+      void on_write_back_complete(size_t size, int ret);
+      void on_upload_failed(const boost::mutex::scoped_lock &lock, int ret);
+      void unstrand(const boost::mutex::scoped_lock &);
+      void upload_stranded();
+      void wait_for_release(boost::mutex::scoped_lock &lock);
+      void discard_local_file(const boost::mutex::scoped_lock &lock);
+      void close_local_file(const boost::mutex::scoped_lock &lock);
+
+      void mark_range_downloaded(off_t offset, size_t size);
+      bool is_range_downloaded(const boost::mutex::scoped_lock &, off_t offset, size_t size);
+      off_t get_priority_offset();
+
+      void mark_range_modified(const boost::mutex::scoped_lock &, off_t offset, size_t size);
+      bool is_range_modified(off_t offset, size_t size);
+
       void update_stat(const boost::mutex::scoped_lock &);
 
+      void update_md5(const char *buffer, size_t size, off_t offset);
+      void hash_md5_piece(const boost::mutex::scoped_lock &, const char *buffer, size_t size, off_t offset);
+      bool hash_md5_from_file(const boost::mutex::scoped_lock &lock, off_t offset, size_t size);
+
+      // everything that's only needed while the file is open, or while its
+      // local copy is still being uploaded after the last release(). most 
+      // cached files aren't open, so this is allocated by open() and freed 
+      // along with the local copy. all of it is protected by _fs_mutex, 
+      // except where noted.
+      struct open_state
+      {
+        typedef boost::shared_ptr<open_state> ptr;
+
+        open_state();
+        ~open_state();
+
+        // whoever waits on this holds a reference to the open_state, so that 
+        // it outlives the wait even if the local copy is closed meanwhile
+        boost::condition condition;
+
+        crypto::hash_list<crypto::sha256>::ptr hash_list;
+
+        int fd, status, async_error;
+        std::string local_path; // only set if upload_journal keeps the local copy
+        uint64_t ref_count;
+        std::vector<bool> downloaded_chunks;
+        off_t priority_offset;
+
+        // one entry per tracking chunk of the stored object, set if the local 
+        // copy has been modified. anything beyond the end is assumed modified.
+        std::vector<bool> modified_chunks;
+
+        // streaming state. chunks here are download chunks, not tracking 
+        // chunks.
+        std::vector<bool> requested_chunks;
+        size_t stream_begin, stream_end, stream_next_unrequested;
+        int read_ahead_window, last_read_chunk;
+        bool stream_running, stream_stopping, stream_fetch_all;
+
+        // set when the last handle was released during a write-back, so that
+        // the local copy is closed once the upload finishes (and left set if
+        // it fails, so that the modifications aren't lost)
+        bool release_pending;
+        int write_back_error, write_back_retries;
+        time_t dirty_since;
+
+        // set while every write has been an append to a file that started 
+        // out empty, in which case parts of the file are uploaded as they're 
+        // completed. streams read the local copy through the open_state they
+        // were started with, so abandoned ones can finish with it after it's
+        // closed -- they're only kept here so that upload() can wait for them.
+        bool appending;
+        off_t append_offset;
+        size_t parts_sent;
+        services::file_transfer::upload_stream::ptr upload_stream;
+        std::vector<services::file_transfer::upload_stream::ptr> cancelled_upload_streams;
+
+        // for objects without a sha256 hash, the md5 hash of what's been 
+        // downloaded so far (up to md5_offset), computed as pieces arrive in
+        // order. protected by md5_mutex.
+        boost::mutex md5_mutex;
+        boost::scoped_ptr<crypto::md5::context> md5;
+        off_t md5_offset;
+        std::map<off_t, md5_piece> md5_pending;
+        size_t md5_pending_size;
+      };
+
+      // what read_chunk() does, but for st rather than _open
+      int read_local_chunk(const open_state::ptr &st, size_t size, off_t offset, const base::char_vector_ptr &buffer);
+
       boost::mutex _fs_mutex;
-      boost::condition _condition;
-      crypto::hash_list<crypto::sha256>::ptr _hash_list;
       std::string _sha256_hash;
 
-      // protected by _fs_mutex
-      int _fd, _status, _async_error;
-      uint64_t _ref_count;
+      // protected by _fs_mutex. set from open() until the local copy is 
+      // closed, and empty otherwise.
+      open_state::ptr _open;
     };
   }
 }
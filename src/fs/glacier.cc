@@ -28,6 +28,7 @@
 #include "services/service.h"
 
 using boost::lexical_cast;
+using boost::mutex;
 using std::string;
 
 using s3::base::request;
@@ -114,6 +115,7 @@ glacier::glacier(const object *obj)
 int glacier::query_storage_class(const request::ptr &req)
 {
   xml::document_ptr doc;
+  string storage_class;
 
   req->init(base::HTTP_GET);
   req->set_url(service::get_bucket_url(), string("max-keys=1&prefix=") + request::url_encode(_object->get_path()));
@@ -129,19 +131,26 @@ int glacier::query_storage_class(const request::ptr &req)
     return -EIO;
   }
 
-  xml::find(doc, STORAGE_CLASS_XPATH, &_storage_class);
+  xml::find(doc, STORAGE_CLASS_XPATH, &storage_class);
 
-  if (_storage_class.empty()) {
+  if (storage_class.empty()) {
     S3_LOG(LOG_WARNING, "glacier::query_storage_class", "cannot find storage class.\n");
     return -EIO;
   }
 
+  {
+    mutex::scoped_lock lock(_mutex);
+
+    _storage_class = storage_class;
+  }
+
   return 0;
 }
 
 void glacier::read_restore_status(const request::ptr &req)
 {
   const string &restore = req->get_response_header("x-amz-restore");
+  mutex::scoped_lock lock(_mutex);
 
   _restore_ongoing.clear();
   _restore_expiry.clear();
@@ -177,7 +186,15 @@ void glacier::read_restore_status(const request::ptr &req)
 
 int glacier::start_restore(const request::ptr &req, int days)
 {
-  if (_restore_ongoing == "true") {
+  bool ongoing;
+
+  {
+    mutex::scoped_lock lock(_mutex);
+
+    ongoing = (_restore_ongoing == "true");
+  }
+
+  if (ongoing) {
     S3_LOG(
       LOG_DEBUG, 
       "glacier::start_restore", 
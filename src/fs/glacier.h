@@ -26,6 +26,7 @@
 #include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "threads/pool.h"
 
@@ -60,13 +61,21 @@ namespace s3
 
       inline int get_storage_class_value(std::string *out)
       {
+        boost::mutex::scoped_lock lock(_mutex);
+
         if (_storage_class.empty()) {
-          int r = threads::pool::call(
+          int r;
+
+          lock.unlock();
+
+          r = threads::pool::call(
             threads::PR_REQ_1,
             boost::bind(&glacier::query_storage_class, this, _1));
 
           if (r)
             return r;
+
+          lock.lock();
         }
 
         *out = _storage_class;
@@ -76,6 +85,8 @@ namespace s3
 
       inline int get_restore_ongoing_value(std::string *out)
       {
+        boost::mutex::scoped_lock lock(_mutex);
+
         *out = _restore_ongoing;
 
         return 0;
@@ -83,6 +94,8 @@ namespace s3
 
       inline int get_restore_expiry_value(std::string *out)
       {
+        boost::mutex::scoped_lock lock(_mutex);
+
         *out = _restore_expiry;
 
         return 0;
@@ -108,6 +121,11 @@ namespace s3
       int start_restore(const boost::shared_ptr<base::request> &req, int days);
 
       const object *_object;
+
+      // our xattrs are called without the object's mutex held (see 
+      // xattr::is_blocking()), so the values they return are protected by 
+      // this instead. it's never held over a request.
+      boost::mutex _mutex;
       std::string _storage_class, _restore_ongoing, _restore_expiry;
       boost::shared_ptr<xattr> _storage_class_xattr, _restore_ongoing_xattr, _restore_expiry_xattr, _request_restore_xattr;
     };
@@ -22,7 +22,10 @@
 #include <string.h>
 #include <sys/xattr.h>
 
+#include <map>
+
 #include <boost/detail/atomic_count.hpp>
+#include <boost/functional/hash.hpp>
 
 #include "base/config.h"
 #include "base/logger.h"
@@ -30,6 +33,8 @@
 #include "base/statistics.h"
 #include "base/timer.h"
 #include "base/xml.h"
+#include "crypto/encoder.h"
+#include "crypto/hex_with_quotes.h"
 #include "fs/cache.h"
 #include "fs/metadata.h"
 #include "fs/object.h"
@@ -55,6 +60,7 @@
 using boost::mutex;
 using boost::static_pointer_cast;
 using boost::detail::atomic_count;
+using std::map;
 using std::ostream;
 using std::runtime_error;
 using std::string;
@@ -66,8 +72,13 @@ using s3::base::request;
 using s3::base::statistics;
 using s3::base::timer;
 using s3::base::xml;
+using s3::crypto::encoder;
+using s3::crypto::hex_with_quotes;
+using s3::crypto::md5;
 using s3::fs::object;
 using s3::fs::static_xattr;
+using s3::fs::xattr;
+using s3::fs::xattr_map;
 using s3::services::service;
 
 namespace
@@ -103,6 +114,27 @@ namespace
     s3::fs::xattr::XM_REMOVABLE | 
     s3::fs::xattr::XM_COMMIT_REQUIRED;
 
+  // for each metadata entry: the map node's links and color, and the
+  // shared_ptr's control block
+  const size_t MAP_NODE_OVERHEAD = sizeof(s3::fs::xattr_map::value_type) + 6 * sizeof(void *);
+
+  // for the map itself, when there is one
+  const size_t MAP_OVERHEAD = sizeof(s3::fs::xattr_map);
+
+  // there are usually few distinct content types, so objects share one copy
+  // of each rather than keeping their own. each is counted, and freed once 
+  // the last object using it goes away, so that a bucket with many 
+  // distinct types doesn't grow this without bound.
+  typedef map<string, size_t> content_type_map;
+
+  mutex s_content_types_mutex;
+  content_type_map s_content_types;
+
+  // see object::get_mutex()
+  const size_t MUTEX_COUNT = 1024;
+
+  mutex s_mutexes[MUTEX_COUNT];
+
   atomic_count s_precon_failed_commits(0), s_new_etag_on_commit(0);
   atomic_count s_commit_failures(0), s_precon_rescues(0), s_abandoned_commits(0);
 
@@ -203,34 +235,53 @@ int object::remove_by_url(const request::ptr &req, const string &url)
 
 object::object(const string &path)
   : _path(path),
-    _expiry(0)
+    _content_type(NULL),
+    _etag_is_md5(false),
+    _expiry(0),
+    _size(0),
+    _mtime(time(NULL)),
+    _ctime(time(NULL)),
+    _mode(config::get_default_mode() & ~S_IFMT),
+    _uid(config::get_default_uid()),
+    _gid(config::get_default_gid())
 {
-  memset(&_stat, 0, sizeof(_stat));
-
-  _stat.st_nlink = 1; // laziness (see FUSE FAQ re. find)
-  _stat.st_blksize = BLOCK_SIZE;
-  _stat.st_mode = config::get_default_mode() & ~S_IFMT;
-  _stat.st_uid = config::get_default_uid();
-  _stat.st_gid = config::get_default_gid();
-  _stat.st_ctime = time(NULL);
-  _stat.st_mtime = time(NULL);
-
-  if (_stat.st_uid == UID_MAX)
-    _stat.st_uid = getuid();
+  if (_uid == UID_MAX)
+    _uid = getuid();
 
-  if (_stat.st_gid == GID_MAX)
-    _stat.st_gid = getgid();
+  if (_gid == GID_MAX)
+    _gid = getgid();
 
-  _content_type = config::get_default_content_type();
+  set_content_type(config::get_default_content_type());
 
   if (!config::get_default_cache_control().empty())
-    _metadata.replace(static_xattr::from_string(CACHE_CONTROL_XATTR, config::get_default_cache_control(), META_XATTR_FLAGS));
-
-  _url = build_url(_path);
+    get_metadata()->replace(static_xattr::from_string(CACHE_CONTROL_XATTR, config::get_default_cache_control(), META_XATTR_FLAGS));
 }
 
 object::~object()
 {
+  release_content_type();
+}
+
+mutex & object::get_mutex() const
+{
+  return s_mutexes[boost::hash<const object *>()(this) % MUTEX_COUNT];
+}
+
+void object::copy_stat(struct stat *s)
+{
+  update_stat();
+
+  memset(s, 0, sizeof(*s));
+
+  s->st_nlink = 1; // laziness (see FUSE FAQ re. find)
+  s->st_blksize = BLOCK_SIZE;
+  s->st_mode = _mode;
+  s->st_uid = _uid;
+  s->st_gid = _gid;
+  s->st_size = _size;
+  s->st_blocks = (_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  s->st_ctime = _ctime;
+  s->st_mtime = _mtime;
 }
 
 bool object::is_removable()
@@ -238,15 +289,108 @@ bool object::is_removable()
   return true;
 }
 
+size_t object::get_approximate_size()
+{
+  mutex::scoped_lock lock(get_mutex());
+  size_t size = sizeof(object) + _path.size() + _etag.size();
+
+  if (!_metadata)
+    return size;
+
+  size += MAP_OVERHEAD;
+
+  for (xattr_map::const_iterator itor = _metadata->begin(); itor != _metadata->end(); ++itor)
+    size += MAP_NODE_OVERHEAD + itor->first.size() + itor->second->get_approximate_size();
+
+  return size;
+}
+
 void object::update_stat()
 {
 }
 
+string object::get_url() const
+{
+  return build_url(_path);
+}
+
+string object::get_etag() const
+{
+  if (_etag_is_md5)
+    return encoder::encode<hex_with_quotes>(_etag_md5, md5::HASH_LEN);
+
+  return _etag;
+}
+
+void object::set_etag(const string &etag)
+{
+  vector<uint8_t> hash;
+
+  _etag_is_md5 = false;
+
+  if (md5::is_valid_quoted_hex_hash(etag)) {
+    encoder::decode<hex_with_quotes>(etag, &hash);
+
+    // keep the string if it won't come back out the same (if it's in upper
+    // case, for instance)
+    if (encoder::encode<hex_with_quotes>(hash) == etag) {
+      memcpy(_etag_md5, &hash[0], md5::HASH_LEN);
+      _etag_is_md5 = true;
+      string().swap(_etag);
+
+      return;
+    }
+  }
+
+  _etag = etag;
+}
+
+void object::set_content_type(const string &content_type)
+{
+  release_content_type();
+
+  mutex::scoped_lock lock(s_content_types_mutex);
+  content_type_map::iterator itor = s_content_types.insert(std::make_pair(content_type, 0)).first;
+
+  itor->second++;
+  _content_type = &itor->first;
+}
+
+void object::release_content_type()
+{
+  mutex::scoped_lock lock(s_content_types_mutex);
+  content_type_map::iterator itor;
+
+  if (!_content_type)
+    return;
+
+  itor = s_content_types.find(*_content_type);
+  _content_type = NULL;
+
+  if (--itor->second == 0)
+    s_content_types.erase(itor);
+}
+
+xattr::ptr object::get_builtin_metadata(const string &key)
+{
+  // these are built when they're asked for, rather than kept with every
+  // object
+  if (key == CONTENT_TYPE_XATTR)
+    return static_xattr::from_string(CONTENT_TYPE_XATTR, get_content_type(), xattr::XM_VISIBLE);
+
+  if (key == ETAG_XATTR)
+    return static_xattr::from_string(ETAG_XATTR, get_etag(), xattr::XM_VISIBLE);
+
+  return xattr::ptr();
+}
+
 int object::set_metadata(const string &key, const char *value, size_t size, int flags, bool *needs_commit)
 {
-  mutex::scoped_lock lock(_mutex);
+  mutex::scoped_lock lock(get_mutex());
   string user_key = key.substr(XATTR_PREFIX_LEN);
-  xattr_map::iterator itor = _metadata.find(user_key);
+  xattr_map *metadata = get_metadata();
+  xattr_map::iterator itor = metadata->find(user_key);
+  xattr::ptr attr;
 
   *needs_commit = false;
 
@@ -255,14 +399,17 @@ int object::set_metadata(const string &key, const char *value, size_t size, int
       return -EINVAL;
   #endif
 
-  if (flags & XATTR_CREATE && itor != _metadata.end())
+  if (get_builtin_metadata(user_key))
+    return (flags & XATTR_CREATE) ? -EEXIST : 0; // read-only, so as below
+
+  if (flags & XATTR_CREATE && itor != metadata->end())
     return -EEXIST;
 
-  if (itor == _metadata.end()) {
+  if (itor == metadata->end()) {
     if (flags & XATTR_REPLACE)
       return -ENOATTR;
 
-    itor = _metadata.insert(static_xattr::create(
+    itor = metadata->insert(static_xattr::create(
       user_key, 
       USER_XATTR_FLAGS)).first;
   }
@@ -276,27 +423,45 @@ int object::set_metadata(const string &key, const char *value, size_t size, int
 
   *needs_commit = itor->second->is_commit_required();
 
+  // the mutex is shared with other objects, so don't hold it over a request
+  if (itor->second->is_blocking()) {
+    attr = itor->second;
+    lock.unlock();
+
+    return attr->set_value(value, size);
+  }
+
   return itor->second->set_value(value, size);
 }
 
 void object::get_metadata_keys(vector<string> *keys)
 {
-  mutex::scoped_lock lock(_mutex);
-
-  for (xattr_map::const_iterator itor = _metadata.begin(); itor != _metadata.end(); ++itor) {
-    if (itor->second->is_visible()) {
-      #ifdef NEED_XATTR_PREFIX
-        keys->push_back(XATTR_PREFIX + itor->first);
-      #else
-        keys->push_back(itor->first);
-      #endif
+  mutex::scoped_lock lock(get_mutex());
+
+  if (_metadata) {
+    for (xattr_map::const_iterator itor = _metadata->begin(); itor != _metadata->end(); ++itor) {
+      if (itor->second->is_visible()) {
+        #ifdef NEED_XATTR_PREFIX
+          keys->push_back(XATTR_PREFIX + itor->first);
+        #else
+          keys->push_back(itor->first);
+        #endif
+      }
     }
   }
+
+  #ifdef NEED_XATTR_PREFIX
+    keys->push_back(XATTR_PREFIX + CONTENT_TYPE_XATTR);
+    keys->push_back(XATTR_PREFIX + ETAG_XATTR);
+  #else
+    keys->push_back(CONTENT_TYPE_XATTR);
+    keys->push_back(ETAG_XATTR);
+  #endif
 }
 
 int object::get_metadata(const string &key, char *buffer, size_t max_size)
 {
-  mutex::scoped_lock lock(_mutex);
+  mutex::scoped_lock lock(get_mutex());
   xattr::ptr value;
   string user_key = key.substr(XATTR_PREFIX_LEN);
   xattr_map::const_iterator itor;
@@ -306,23 +471,44 @@ int object::get_metadata(const string &key, char *buffer, size_t max_size)
       return -ENOATTR;
   #endif
 
-  itor = _metadata.find(user_key);
+  value = get_builtin_metadata(user_key);
+
+  if (value)
+    return value->get_value(buffer, max_size);
+
+  if (!_metadata)
+    return -ENOATTR;
+
+  itor = _metadata->find(user_key);
 
-  if (itor == _metadata.end())
+  if (itor == _metadata->end())
     return -ENOATTR;
 
+  // as in set_metadata()
+  if (itor->second->is_blocking()) {
+    value = itor->second;
+    lock.unlock();
+
+    return value->get_value(buffer, max_size);
+  }
+
   return itor->second->get_value(buffer, max_size);
 }
 
 int object::remove_metadata(const string &key)
 {
-  mutex::scoped_lock lock(_mutex);
-  xattr_map::iterator itor = _metadata.find(key.substr(XATTR_PREFIX_LEN));
+  mutex::scoped_lock lock(get_mutex());
+  xattr_map::iterator itor;
+
+  if (!_metadata)
+    return -ENOATTR;
+
+  itor = _metadata->find(key.substr(XATTR_PREFIX_LEN));
 
-  if (itor == _metadata.end() || !itor->second->is_removable())
+  if (itor == _metadata->end() || !itor->second->is_removable())
     return -ENOATTR;
 
-  _metadata.erase(itor);
+  _metadata->erase(itor);
   return 0;
 }
 
@@ -333,10 +519,10 @@ void object::set_mode(mode_t mode)
   if (mode == 0)
     mode = config::get_default_mode() & ~S_IFMT;
 
-  _stat.st_mode = (_stat.st_mode & S_IFMT) | mode;
+  _mode = (_mode & S_IFMT) | mode;
 
   // successful chmod updates ctime
-  _stat.st_ctime = time(NULL);
+  _ctime = time(NULL);
 }
 
 void object::init(const request::ptr &req)
@@ -350,14 +536,14 @@ void object::init(const request::ptr &req)
   uid_t uid;
   gid_t gid;
 
-  _content_type = req->get_response_header("Content-Type");
-  _etag = req->get_response_header("ETag");
+  set_content_type(req->get_response_header("Content-Type"));
+  set_etag(req->get_response_header("ETag"));
 
-  _intact = (_etag == req->get_response_header(meta_prefix + metadata::LAST_UPDATE_ETAG));
+  _intact = (get_etag() == req->get_response_header(meta_prefix + metadata::LAST_UPDATE_ETAG));
 
-  _stat.st_size = strtol(req->get_response_header("Content-Length").c_str(), NULL, 0);
-  _stat.st_ctime = strtol(req->get_response_header(meta_prefix + metadata::CREATED_TIME).c_str(), NULL, 0);
-  _stat.st_mtime = strtol(req->get_response_header(meta_prefix + metadata::LAST_MODIFIED_TIME).c_str(), NULL, 0);
+  _size = strtol(req->get_response_header("Content-Length").c_str(), NULL, 0);
+  _ctime = strtol(req->get_response_header(meta_prefix + metadata::CREATED_TIME).c_str(), NULL, 0);
+  _mtime = strtol(req->get_response_header(meta_prefix + metadata::LAST_MODIFIED_TIME).c_str(), NULL, 0);
 
   mode = strtol(req->get_response_header(meta_prefix + metadata::MODE).c_str(), NULL, 0) & ~S_IFMT;
   uid = strtol(req->get_response_header(meta_prefix + metadata::UID).c_str(), NULL, 0);
@@ -371,95 +557,107 @@ void object::init(const request::ptr &req)
       strncmp(key.c_str(), meta_prefix.c_str(), meta_prefix.size()) == 0 &&
       strncmp(key.c_str() + meta_prefix.size(), metadata::RESERVED_PREFIX, strlen(metadata::RESERVED_PREFIX)) != 0
     ) {
-      _metadata.replace(static_xattr::from_header(
+      get_metadata()->replace(static_xattr::from_header(
         key.substr(meta_prefix.size()), 
         value, 
         USER_XATTR_FLAGS));
     }
   }
 
-  _metadata.replace(static_xattr::from_string(CONTENT_TYPE_XATTR, _content_type, xattr::XM_VISIBLE));
-  _metadata.replace(static_xattr::from_string(ETAG_XATTR, _etag, xattr::XM_VISIBLE));
+  if (_metadata) {
+    // see get_builtin_metadata()
+    _metadata->erase(CONTENT_TYPE_XATTR);
+    _metadata->erase(ETAG_XATTR);
+
+    if (cache_control.empty())
+      _metadata->erase(CACHE_CONTROL_XATTR);
+  }
+
+  if (!cache_control.empty())
+    get_metadata()->replace(static_xattr::from_string(CACHE_CONTROL_XATTR, cache_control, META_XATTR_FLAGS));
 
-  if (cache_control.empty())
-    _metadata.erase(CACHE_CONTROL_XATTR);
-  else
-    _metadata.replace(static_xattr::from_string(CACHE_CONTROL_XATTR, cache_control, META_XATTR_FLAGS));
+  if (_metadata && _metadata->empty())
+    _metadata.reset();
 
   // this workaround is for cases when the file was updated by someone else and the mtime header wasn't set
-  if (!is_intact() && req->get_last_modified() > _stat.st_mtime)
-    _stat.st_mtime = req->get_last_modified();
+  if (!is_intact() && req->get_last_modified() > _mtime)
+    _mtime = req->get_last_modified();
 
   // only accept uid, gid, mode from response if object is intact or if values 
   // are non-zero (we do this so that objects created by some other mechanism 
   // don't appear here with uid = 0, gid = 0, mode = 0)
 
   if (is_intact() || mode)
-    _stat.st_mode = (_stat.st_mode & S_IFMT) | mode;
+    _mode = (_mode & S_IFMT) | mode;
 
   if (is_intact() || uid)
-    _stat.st_uid = uid;
+    _uid = uid;
 
   if (is_intact() || gid)
-    _stat.st_gid = gid;
-
-  _stat.st_blocks = (_stat.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    _gid = gid;
 
   // setting _expiry > 0 makes this object valid
   _expiry = time(NULL) + config::get_cache_expiry_in_s();
 
   #ifdef WITH_AWS
     if (config::get_allow_glacier_restores()) {
+      xattr_map *metadata = get_metadata();
+
       _glacier = glacier::create(this, req);
 
-      _metadata.replace(_glacier->get_storage_class_xattr());
-      _metadata.replace(_glacier->get_restore_ongoing_xattr());
-      _metadata.replace(_glacier->get_restore_expiry_xattr());
-      _metadata.replace(_glacier->get_request_restore_xattr());
+      metadata->replace(_glacier->get_storage_class_xattr());
+      metadata->replace(_glacier->get_restore_ongoing_xattr());
+      metadata->replace(_glacier->get_restore_expiry_xattr());
+      metadata->replace(_glacier->get_request_restore_xattr());
     }
   #endif
 }
 
 void object::set_request_headers(const request::ptr &req)
 {
-  mutex::scoped_lock lock(_mutex);
+  mutex::scoped_lock lock(get_mutex());
   xattr_map::const_iterator itor;
   const string &meta_prefix = service::get_header_meta_prefix();
   char buf[16];
 
   // do this first so that we overwrite any keys we care about (i.e., those that start with "META_PREFIX-META_PREFIX_RESERVED-")
-  for (itor = _metadata.begin(); itor != _metadata.end(); ++itor) {
-    string key, value;
+  if (_metadata) {
+    for (itor = _metadata->begin(); itor != _metadata->end(); ++itor) {
+      string key, value;
 
-    if (!itor->second->is_serializable())
-      continue;
+      if (!itor->second->is_serializable())
+        continue;
 
-    itor->second->to_header(&key, &value);
-    req->set_header(meta_prefix + key, value);
+      itor->second->to_header(&key, &value);
+      req->set_header(meta_prefix + key, value);
+    }
   }
 
-  snprintf(buf, 16, "%#o", _stat.st_mode & ~S_IFMT);
+  snprintf(buf, 16, "%#o", _mode & ~S_IFMT);
   req->set_header(meta_prefix + metadata::MODE, buf);
 
-  snprintf(buf, 16, "%i", _stat.st_uid);
+  snprintf(buf, 16, "%i", _uid);
   req->set_header(meta_prefix + metadata::UID, buf);
 
-  snprintf(buf, 16, "%i", _stat.st_gid);
+  snprintf(buf, 16, "%i", _gid);
   req->set_header(meta_prefix + metadata::GID, buf);
 
-  snprintf(buf, 16, "%li", _stat.st_ctime);
+  snprintf(buf, 16, "%li", _ctime);
   req->set_header(meta_prefix + metadata::CREATED_TIME, buf);
 
-  snprintf(buf, 16, "%li", _stat.st_mtime);
+  snprintf(buf, 16, "%li", _mtime);
   req->set_header(meta_prefix + metadata::LAST_MODIFIED_TIME, buf);
 
-  req->set_header(meta_prefix + metadata::LAST_UPDATE_ETAG, _etag);
+  req->set_header(meta_prefix + metadata::LAST_UPDATE_ETAG, get_etag());
+
+  req->set_header("Content-Type", get_content_type());
 
-  req->set_header("Content-Type", _content_type);
+  if (!_metadata)
+    return;
 
-  itor = _metadata.find(CACHE_CONTROL_XATTR);
+  itor = _metadata->find(CACHE_CONTROL_XATTR);
 
-  if (itor != _metadata.end())
+  if (itor != _metadata->end())
     req->set_header("Cache-Control", static_pointer_cast<static_xattr>(itor->second)->to_string());
 }
 
@@ -470,6 +668,7 @@ void object::set_request_body(const request::ptr &req)
 int object::commit(const request::ptr &req)
 {
   int current_error = 0, last_error = 0;
+  const string url = get_url();
 
   // we may need to try to commit several times because:
   //
@@ -478,25 +677,25 @@ int object::commit(const request::ptr &req)
 
   for (int i = 0; i < config::get_max_inconsistent_state_retries(); i++) {
     xml::document_ptr doc;
-    string response, new_etag;
+    string response, new_etag, etag = get_etag();
 
     // save error from last iteration (so that we can tell if the precondition
     // failed retry worked)
     last_error = current_error;
 
     req->init(base::HTTP_PUT);
-    req->set_url(_url);
+    req->set_url(url);
 
     set_request_headers(req);
 
     // if the object already exists (i.e., if we have an etag) then just update
     // the metadata.
 
-    if (_etag.empty()) {
+    if (etag.empty()) {
       set_request_body(req);
     } else {
-      req->set_header(service::get_header_prefix() + "copy-source", _url);
-      req->set_header(service::get_header_prefix() + "copy-source-if-match", _etag);
+      req->set_header(service::get_header_prefix() + "copy-source", url);
+      req->set_header(service::get_header_prefix() + "copy-source-if-match", etag);
       req->set_header(service::get_header_prefix() + "metadata-directive", "REPLACE");
     }
 
@@ -505,7 +704,7 @@ int object::commit(const request::ptr &req)
 
     if (req->get_response_code() == base::HTTP_SC_PRECONDITION_FAILED) {
       ++s_precon_failed_commits;
-      S3_LOG(LOG_WARNING, "object::commit", "got precondition failed error for [%s].\n", _url.c_str());
+      S3_LOG(LOG_WARNING, "object::commit", "got precondition failed error for [%s].\n", url.c_str());
 
       timer::sleep(i + 1);
 
@@ -514,7 +713,7 @@ int object::commit(const request::ptr &req)
     }
 
     if (req->get_response_code() != base::HTTP_SC_OK) {
-      S3_LOG(LOG_WARNING, "object::commit", "failed to commit object metadata for [%s].\n", _url.c_str());
+      S3_LOG(LOG_WARNING, "object::commit", "failed to commit object metadata for [%s].\n", url.c_str());
 
       current_error = -EIO;
       break;
@@ -529,7 +728,7 @@ int object::commit(const request::ptr &req)
     }
 
     // if we started out without an etag, then ignore anything we get here
-    if (_etag.empty()) {
+    if (etag.empty()) {
       current_error = 0;
       break;
     }
@@ -556,7 +755,7 @@ int object::commit(const request::ptr &req)
     }
 
     // if the etag hasn't changed, don't re-commit
-    if (new_etag == _etag) {
+    if (new_etag == etag) {
       current_error = 0;
       break;
     }
@@ -564,7 +763,7 @@ int object::commit(const request::ptr &req)
     ++s_new_etag_on_commit;
     S3_LOG(LOG_WARNING, "object::commit", "commit resulted in new etag. recommitting.\n");
 
-    _etag = new_etag;
+    set_etag(new_etag);
     current_error = -EAGAIN;
   }
 
@@ -573,7 +772,7 @@ int object::commit(const request::ptr &req)
       ++s_commit_failures;
     } else {
       ++s_abandoned_commits;
-      S3_LOG(LOG_WARNING, "object::commit", "giving up on [%s].\n", _url.c_str());
+      S3_LOG(LOG_WARNING, "object::commit", "giving up on [%s].\n", url.c_str());
     }
   } else if (last_error == -EBUSY) {
     ++s_precon_rescues;
@@ -589,7 +788,7 @@ int object::remove(const request::ptr &req)
 
   cache::remove(get_path());
 
-  return object::remove_by_url(req, _url);
+  return object::remove_by_url(req, get_url());
 }
 
 int object::rename(const request::ptr &req, const string &to)
@@ -32,6 +32,7 @@
 #include <boost/thread.hpp>
 
 #include "base/static_list.h"
+#include "crypto/md5.h"
 #include "fs/xattr.h"
 #include "threads/pool.h"
 
@@ -75,35 +76,38 @@ namespace s3
 
       virtual bool is_removable();
 
+      // roughly how much memory this object takes up, for the cache to 
+      // count against object_cache_size_in_mb
+      virtual size_t get_approximate_size();
+
       inline const std::string & get_path() const { return _path; }
-      inline const std::string & get_content_type() const { return _content_type; }
-      inline const std::string & get_url() const { return _url; }
-      inline const std::string & get_etag() const { return _etag; }
-      inline mode_t get_mode() const { return _stat.st_mode; }
-      inline mode_t get_type() const { return _stat.st_mode & S_IFMT; }
-      inline uid_t get_uid() const { return _stat.st_uid; }
+      inline const std::string & get_content_type() const { return *_content_type; }
+
+      // built from the path as needed, rather than kept around
+      virtual std::string get_url() const;
+
+      std::string get_etag() const;
+      inline mode_t get_mode() const { return _mode; }
+      inline mode_t get_type() const { return _mode & S_IFMT; }
+      inline uid_t get_uid() const { return _uid; }
 
       void get_metadata_keys(std::vector<std::string> *keys);
       int get_metadata(const std::string &key, char *buffer, size_t max_size);
       int set_metadata(const std::string &key, const char *value, size_t size, int flags, bool *needs_commit);
       int remove_metadata(const std::string &key);
 
-      inline void set_uid(uid_t uid) { _stat.st_uid = uid; }
-      inline void set_gid(gid_t gid) { _stat.st_gid = gid; }
+      inline void set_uid(uid_t uid) { _uid = uid; }
+      inline void set_gid(gid_t gid) { _gid = gid; }
 
-      inline void set_mtime(time_t mtime) { _stat.st_mtime = mtime; }
+      inline void set_mtime(time_t mtime) { _mtime = mtime; }
       inline void set_mtime() { set_mtime(time(NULL)); }
 
-      inline void set_ctime(time_t ctime) { _stat.st_ctime = ctime; }
+      inline void set_ctime(time_t ctime) { _ctime = ctime; }
       inline void set_ctime() { set_ctime(time(NULL)); }
 
       void set_mode(mode_t mode);
 
-      inline void copy_stat(struct stat *s)
-      {
-        update_stat();
-        memcpy(s, &_stat, sizeof(_stat));
-      }
+      virtual void copy_stat(struct stat *s);
 
       int commit(const boost::shared_ptr<base::request> &req);
 
@@ -141,42 +145,65 @@ namespace s3
 
       virtual void update_stat();
 
-      inline void set_url(const std::string &url) { _url = url; }
-      inline void set_content_type(const std::string &content_type) { _content_type = content_type; }
-      inline void set_etag(const std::string &etag) { _etag = etag; }
+      void set_content_type(const std::string &content_type);
+      void set_etag(const std::string &etag);
 
       inline void set_type(mode_t mode)
       { 
-        _stat.st_mode &= ~S_IFMT; // clear existing mode
-        _stat.st_mode |= mode & S_IFMT; 
+        _mode &= ~S_IFMT; // clear existing mode
+        _mode |= mode & S_IFMT; 
       }
 
-      inline xattr_map * get_metadata() { return &_metadata; }
-      inline struct stat * get_stat() { return &_stat; }
+      // objects share a set of mutexes, picked by address, rather than each 
+      // keeping one of their own
+      boost::mutex & get_mutex() const;
+
+      // most objects have no metadata of their own, so the map is only 
+      // created once something's put in it. call with get_mutex() held, once
+      // the object is in the cache.
+      inline xattr_map * get_metadata()
+      {
+        if (!_metadata)
+          _metadata.reset(new xattr_map());
+
+        return _metadata.get();
+      }
+
+      inline off_t get_size() const { return _size; }
+      inline void set_size(off_t size) { _size = size; }
 
       inline void expire() { _expiry = 0; }
-      inline void force_zero_size() { _stat.st_size = 0; }
+      inline void force_zero_size() { _size = 0; }
 
     private:
-      boost::mutex _mutex;
+      xattr::ptr get_builtin_metadata(const std::string &key);
+      void release_content_type();
 
       // should only be modified during init()
       std::string _path;
-      std::string _content_type;
-      std::string _url;
+      const std::string *_content_type; // interned and counted, see set_content_type()
       bool _intact;
 
       #ifdef WITH_AWS
         boost::shared_ptr<glacier> _glacier;
       #endif
 
-      // unprotected
+      // unprotected. etags that are md5 hashes (as most are) are kept in
+      // _etag_md5 rather than as strings.
+      bool _etag_is_md5;
+      uint8_t _etag_md5[crypto::md5::HASH_LEN];
       std::string _etag;
-      struct stat _stat;
       time_t _expiry;
 
-      // protected by _mutex
-      xattr_map _metadata;
+      // unprotected. only what copy_stat() can't fill in from elsewhere.
+      off_t _size;
+      time_t _mtime, _ctime;
+      mode_t _mode;
+      uid_t _uid;
+      gid_t _gid;
+
+      // protected by get_mutex(). null if there's no metadata.
+      boost::scoped_ptr<xattr_map> _metadata;
     };
   }
 }
@@ -51,7 +51,8 @@ namespace
 }
 
 special::special(const string &path)
-  : object(path)
+  : object(path),
+    _device(0)
 {
   set_content_type(CONTENT_TYPE);
 }
@@ -60,6 +61,13 @@ special::~special()
 {
 }
 
+void special::copy_stat(struct stat *s)
+{
+  object::copy_stat(s);
+
+  s->st_rdev = _device;
+}
+
 void special::init(const request::ptr &req)
 {
   const string &meta_prefix = service::get_header_meta_prefix();
@@ -84,10 +92,10 @@ void special::set_request_headers(const request::ptr &req)
 
   object::set_request_headers(req);
 
-  snprintf(buf, 16, "%#o", get_stat()->st_mode & S_IFMT);
+  snprintf(buf, 16, "%#o", get_type());
   req->set_header(meta_prefix + metadata::FILE_TYPE, buf);
 
   // dev_t is int32_t on OS X and uint64_t on Linux, so generalize
-  snprintf(buf, 16, "%" PRIu64, static_cast<uint64_t>(get_stat()->st_rdev));
+  snprintf(buf, 16, "%" PRIu64, static_cast<uint64_t>(_device));
   req->set_header(meta_prefix + metadata::DEVICE, buf);
 }
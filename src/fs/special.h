@@ -50,12 +50,17 @@ namespace s3
 
       inline void set_device(dev_t dev)
       {
-        get_stat()->st_rdev = dev;
+        _device = dev;
       }
 
+      virtual void copy_stat(struct stat *s);
+
     protected:
       virtual void init(const boost::shared_ptr<base::request> &req);
       virtual void set_request_headers(const boost::shared_ptr<base::request> &req);
+
+    private:
+      dev_t _device;
     };
   }
 }
@@ -59,6 +59,8 @@ namespace s3
       virtual void to_header(std::string *header, std::string *value);
       std::string to_string();
 
+      virtual size_t get_approximate_size() const { return sizeof(static_xattr) + get_key().size() + _value.size(); }
+
     private:
       inline static_xattr(const std::string &key, bool encode_key, bool encode_value, int mode)
         : xattr(key, mode),
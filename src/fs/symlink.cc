@@ -61,6 +61,13 @@ symlink::~symlink()
 {
 }
 
+size_t symlink::get_approximate_size()
+{
+  mutex::scoped_lock lock(_mutex);
+
+  return object::get_approximate_size() + sizeof(symlink) - sizeof(object) + _target.size();
+}
+
 void symlink::set_request_body(const request::ptr &req)
 {
   mutex::scoped_lock lock(_mutex);
@@ -72,6 +72,8 @@ namespace s3
         _target = target;
       }
 
+      virtual size_t get_approximate_size();
+
     protected:
       virtual void set_request_body(const boost::shared_ptr<base::request> &req);
 
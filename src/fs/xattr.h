@@ -63,6 +63,14 @@ namespace s3
 
       virtual void to_header(std::string *header, std::string *value) = 0;
 
+      // set if get_value() or set_value() may block (on a request, say). 
+      // objects don't hold their mutex while calling them, so such attributes
+      // do their own locking.
+      virtual bool is_blocking() const { return false; }
+
+      // roughly how much memory this attribute takes up
+      virtual size_t get_approximate_size() const { return sizeof(xattr) + _key.size(); }
+
     protected:
       inline xattr(const std::string &key, int mode)
         : _key(key),
@@ -25,11 +25,13 @@
 #include "base/config.h"
 #include "base/statistics.h"
 #include "base/xml.h"
+#include "fs/block_cache.h"
 #include "fs/cache.h"
 #include "fs/encryption.h"
 #include "fs/file.h"
 #include "fs/mime_types.h"
 #include "services/service.h"
+#include "services/upload_journal.h"
 #include "threads/pool.h"
 
 #ifdef WITH_AWS
@@ -52,12 +54,14 @@ using s3::base::config;
 using s3::base::logger;
 using s3::base::statistics;
 using s3::base::xml;
+using s3::fs::block_cache;
 using s3::fs::cache;
 using s3::fs::encryption;
 using s3::fs::file;
 using s3::fs::mime_types;
 using s3::services::impl;
 using s3::services::service;
+using s3::services::upload_journal;
 using s3::threads::pool;
 
 void init::base(int flags, int verbosity, const string &config_file)
@@ -75,6 +79,8 @@ void init::fs()
   file::test_transfer_chunk_sizes();
 
   cache::init();
+  block_cache::init();
+  upload_journal::init();
   encryption::init();
   mime_types::init();
 }
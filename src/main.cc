@@ -27,6 +27,9 @@
 #include "base/config.h"
 #include "base/logger.h"
 #include "base/statistics.h"
+#include "fs/file.h"
+#include "services/file_transfer.h"
+#include "services/service.h"
 #include "threads/pool.h"
 
 using std::cerr;
@@ -38,6 +41,8 @@ using s3::init;
 using s3::operations;
 using s3::base::config;
 using s3::base::statistics;
+using s3::fs::file;
+using s3::services::service;
 using s3::threads::pool;
 
 namespace
@@ -181,6 +186,9 @@ void * init(fuse_conn_info *info)
   // won't survive the fork in fuse_main().
   init::threads();
 
+  // uploads left in the journal by the last mount run on the pools too
+  service::get_file_transfer()->resume_uploads();
+
   return NULL;
 }
 
@@ -254,6 +262,9 @@ int main(int argc, char **argv)
   fuse_opt_free_args(&args);
 
   try {
+    // don't lose anything that's still being written back
+    file::wait_for_write_backs();
+
     pool::terminate();
 
     // these won't do anything if statistics::init() wasn't called
@@ -226,6 +226,7 @@ void operations::build_fuse_operations(fuse_operations *ops)
   ops->getattr = operations::getattr;
   ops->getxattr = operations::getxattr;
   ops->flush = operations::flush;
+  ops->fsync = operations::fsync;
   ops->ftruncate = operations::ftruncate;
   ops->listxattr = operations::listxattr;
   ops->mkdir = operations::mkdir;
@@ -355,6 +356,17 @@ int operations::flush(const char *path, fuse_file_info *file_info)
   END_TRY;
 }
 
+int operations::fsync(const char *path, int datasync, fuse_file_info *file_info)
+{
+  file *f = file::from_handle(file_info->fh);
+
+  S3_LOG(LOG_DEBUG, "fsync", "path: %s\n", f->get_path().c_str());
+
+  BEGIN_TRY;
+    return f->fsync();
+  END_TRY;
+}
+
 int operations::ftruncate(const char *path, off_t offset, fuse_file_info *file_info)
 {
   file *f = file::from_handle(file_info->fh);
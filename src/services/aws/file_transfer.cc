@@ -19,6 +19,16 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <deque>
+#include <set>
 #include <vector>
 #include <boost/lexical_cast.hpp>
 #include <boost/detail/atomic_count.hpp>
@@ -26,33 +36,43 @@
 #include "base/config.h"
 #include "base/logger.h"
 #include "base/statistics.h"
+#include "base/transfer_scheduler.h"
 #include "base/xml.h"
-#include "crypto/hash.h"
+#include "crypto/encoder.h"
 #include "crypto/hex_with_quotes.h"
 #include "crypto/md5.h"
+#include "services/service.h"
 #include "services/aws/file_transfer.h"
 #include "threads/parallel_work_queue.h"
 #include "threads/pool.h"
 
 using boost::lexical_cast;
+using boost::mutex;
 using boost::scoped_ptr;
 using boost::detail::atomic_count;
+using std::deque;
 using std::ostream;
+using std::set;
 using std::string;
 using std::vector;
 
 using s3::base::char_vector;
 using s3::base::char_vector_ptr;
 using s3::base::config;
+using s3::base::header_map;
 using s3::base::request;
 using s3::base::statistics;
+using s3::base::transfer_scheduler;
 using s3::base::xml;
-using s3::crypto::hash;
+using s3::crypto::encoder;
 using s3::crypto::hex_with_quotes;
 using s3::crypto::md5;
+using s3::services::service;
+using s3::services::upload_journal;
 using s3::services::aws::file_transfer;
 using s3::threads::parallel_work_queue;
 using s3::threads::pool;
+using s3::threads::wait_async_handle;
 
 namespace
 {
@@ -60,17 +80,225 @@ namespace
 
   const char *MULTIPART_ETAG_XPATH = "/CompleteMultipartUploadResult/ETag";
   const char *MULTIPART_UPLOAD_ID_XPATH = "/InitiateMultipartUploadResult/UploadId";
+  const char *COPY_PART_ETAG_XPATH = "/CopyPartResult/ETag";
+
+  const char *UPLOADS_IS_TRUNCATED_XPATH = "/ListMultipartUploadsResult/IsTruncated";
+  const char *UPLOADS_NEXT_KEY_MARKER_XPATH = "/ListMultipartUploadsResult/NextKeyMarker";
+  const char *UPLOADS_NEXT_UPLOAD_ID_MARKER_XPATH = "/ListMultipartUploadsResult/NextUploadIdMarker";
+  const char *UPLOADS_KEY_XPATH = "/ListMultipartUploadsResult/Upload/Key";
+  const char *UPLOADS_UPLOAD_ID_XPATH = "/ListMultipartUploadsResult/Upload/UploadId";
+  const char *UPLOADS_INITIATED_XPATH = "/ListMultipartUploadsResult/Upload/Initiated";
 
   atomic_count s_uploads_multi_chunks_failed(0);
+  atomic_count s_uploads_multi_chunks_copied(0), s_uploads_multi_copies_failed(0);
+  atomic_count s_uploads_streamed(0), s_uploads_streamed_chunks(0), s_uploads_streamed_chunks_resent(0);
+  atomic_count s_uploads_resumed(0), s_uploads_restarted(0), s_uploads_abandoned(0), s_resume_failures(0);
+  atomic_count s_orphaned_uploads_aborted(0);
 
   void statistics_writer(ostream *o)
   {
     *o <<
       "aws multi-part uploads:\n"
-      "  chunks failed: " << s_uploads_multi_chunks_failed << "\n";
+      "  chunks failed: " << s_uploads_multi_chunks_failed << "\n"
+      "  chunks copied: " << s_uploads_multi_chunks_copied << ", copies failed: " << s_uploads_multi_copies_failed << "\n"
+      "aws streamed multi-part uploads:\n"
+      "  uploads: " << s_uploads_streamed << "\n"
+      "  chunks sent early: " << s_uploads_streamed_chunks << ", resent: " << s_uploads_streamed_chunks_resent << "\n"
+      "aws interrupted multi-part uploads:\n"
+      "  resumed: " << s_uploads_resumed << ", started over: " << s_uploads_restarted << ", abandoned: " << s_uploads_abandoned << ", failed: " << s_resume_failures << "\n"
+      "  orphaned uploads aborted: " << s_orphaned_uploads_aborted << "\n";
   }
 
   statistics::writers::entry s_writer(statistics_writer, 0);
+
+  template <class part_list>
+  string build_complete_upload(const part_list &parts)
+  {
+    string complete_upload = "<CompleteMultipartUpload>";
+
+    for (size_t i = 0; i < parts.size(); i++) {
+      // part numbers are 1-based
+      complete_upload += "<Part><PartNumber>" + lexical_cast<string>(i + 1) + "</PartNumber><ETag>" + parts[i].etag + "</ETag></Part>";
+    }
+
+    complete_upload += "</CompleteMultipartUpload>";
+
+    return complete_upload;
+  }
+
+  int read_local_file(int fd, size_t size, off_t offset, const char_vector_ptr &buffer)
+  {
+    buffer->resize(size);
+
+    if (pread(fd, &(*buffer)[0], size, offset) != static_cast<ssize_t>(size))
+      return errno ? -errno : -EIO;
+
+    return 0;
+  }
+
+  // returns 0 if the time can't be parsed
+  time_t parse_initiated_time(const string &initiated)
+  {
+    struct tm t;
+
+    memset(&t, 0, sizeof(t));
+
+    if (!strptime(initiated.c_str(), "%Y-%m-%dT%H:%M:%S", &t))
+      return 0;
+
+    return timegm(&t);
+  }
+}
+
+namespace s3
+{
+  namespace services
+  {
+    namespace aws
+    {
+      class file_transfer::stream : public services::file_transfer::upload_stream
+      {
+      public:
+        stream(file_transfer *ft, const string &url, const read_chunk_fn &on_read)
+          : _ft(ft),
+            _url(url),
+            _on_read(on_read)
+        {
+          ++s_uploads_streamed;
+
+          _init_handle = pool::post(
+            threads::PR_REQ_0, 
+            bind(&file_transfer::upload_multi_init, _ft, _1, _url, header_map(), &_upload_id));
+        }
+
+        virtual ~stream()
+        {
+          // don't let parts outlive us
+          wait_for_parts();
+        }
+
+        virtual void send_part(size_t index)
+        {
+          mutex::scoped_lock lock(_mutex);
+          upload_range *part;
+
+          // deque::resize() doesn't invalidate references to existing 
+          // elements, so parts already posted are unaffected
+          if (_parts.size() <= index)
+            _parts.resize(index + 1);
+
+          part = &_parts[index];
+
+          part->id = index;
+          part->offset = index * _ft->_upload_chunk_size;
+          part->size = _ft->_upload_chunk_size;
+
+          ++s_uploads_streamed_chunks;
+
+          _handles.push_back(pool::post(
+            threads::PR_REQ_1,
+            bind(&stream::send_streamed_part, this, _1, part)));
+        }
+
+        virtual void wait_for_parts()
+        {
+          mutex::scoped_lock lock(_mutex);
+          vector<wait_async_handle::ptr> handles;
+
+          handles = _handles;
+          lock.unlock();
+
+          // failed parts are resent by complete()
+          for (size_t i = 0; i < handles.size(); i++)
+            handles[i]->wait();
+        }
+
+        virtual int complete(size_t size, string *returned_etag)
+        {
+          typedef parallel_work_queue<upload_range> multipart_upload;
+
+          const size_t chunk_size = _ft->_upload_chunk_size;
+          const size_t num_parts = (size + chunk_size - 1) / chunk_size;
+          scoped_ptr<multipart_upload> upload;
+          int r;
+
+          wait_for_parts();
+
+          r = _init_handle->wait();
+
+          if (r)
+            return r;
+
+          _parts.resize(num_parts);
+
+          for (size_t i = 0; i < num_parts; i++) {
+            upload_range *part = &_parts[i];
+
+            part->id = i;
+            part->offset = i * chunk_size;
+            part->size = (i != num_parts - 1) ? chunk_size : (size - chunk_size * i);
+          }
+
+          // parts sent early are read again here, both so that on_read sees
+          // the whole file and so that upload_part() can check that they 
+          // haven't changed since
+          upload.reset(new multipart_upload(
+            _parts.begin(),
+            _parts.end(),
+            bind(&file_transfer::upload_part, _ft, _1, _url, _upload_id, _on_read, string(), upload_journal::entry::ptr(), _2, false),
+            bind(&file_transfer::upload_part, _ft, _1, _url, _upload_id, _on_read, string(), upload_journal::entry::ptr(), _2, true)));
+
+          upload->set_direction(transfer_scheduler::TD_UPLOAD);
+
+          r = upload->process();
+
+          if (r) {
+            pool::call(
+              threads::PR_REQ_0, 
+              bind(&file_transfer::upload_multi_cancel, _ft, _1, _url, _upload_id));
+
+            return r;
+          }
+
+          return pool::call(
+            threads::PR_REQ_0, 
+            bind(&file_transfer::upload_multi_complete, _ft, _1, _url, _upload_id, build_complete_upload(_parts), returned_etag));
+        }
+
+        virtual int cancel(const request::ptr &req)
+        {
+          wait_for_parts();
+
+          if (_init_handle->wait() == 0)
+            _ft->upload_multi_cancel(req, _url, _upload_id);
+
+          return 0;
+        }
+
+      private:
+        int send_streamed_part(const request::ptr &req, upload_range *part)
+        {
+          int r;
+
+          r = _init_handle->wait();
+
+          if (r)
+            return r;
+
+          return _ft->upload_part(req, _url, _upload_id, _on_read, string(), upload_journal::entry::ptr(), part, false);
+        }
+
+        file_transfer *_ft;
+        string _url, _upload_id;
+        read_chunk_fn _on_read;
+        wait_async_handle::ptr _init_handle;
+
+        mutex _mutex;
+        deque<upload_range> _parts;
+        vector<wait_async_handle::ptr> _handles;
+      };
+    }
+  }
 }
 
 file_transfer::file_transfer()
@@ -86,57 +314,109 @@ size_t file_transfer::get_upload_chunk_size()
   return _upload_chunk_size;
 }
 
-int file_transfer::upload_multi(const string &url, size_t size, const read_chunk_fn &on_read, string *returned_etag)
+file_transfer::upload_stream::ptr file_transfer::begin_upload_stream(const string &url, const read_chunk_fn &on_read)
 {
-  typedef parallel_work_queue<upload_range> multipart_upload;
+  return upload_stream::ptr(new stream(this, url, on_read));
+}
+
+void file_transfer::resume_uploads()
+{
+  upload_journal::entry_list entries;
+
+  if (!upload_journal::is_enabled())
+    return;
+
+  upload_journal::take_interrupted(&entries);
+
+  pool::call_async(
+    threads::PR_0, 
+    bind(&file_transfer::resume_interrupted_uploads, this, _1, entries));
+}
 
-  string upload_id, complete_upload;
+int file_transfer::upload_multi(
+  const string &url, 
+  size_t size, 
+  const read_chunk_fn &on_read, 
+  string *returned_etag, 
+  const is_range_modified_fn &on_is_modified, 
+  const string &stored_etag,
+  const upload_journal::source *journal_source)
+{
+  string upload_id;
   const size_t num_parts = (size + _upload_chunk_size - 1) / _upload_chunk_size;
-  vector<upload_range> parts(num_parts);
-  scoped_ptr<multipart_upload> upload;
+  upload_range_list parts(num_parts);
+  upload_journal::entry::ptr journal;
   int r;
 
-  r = pool::call(threads::PR_REQ_0, bind(&file_transfer::upload_multi_init, this, _1, url, &upload_id));
+  r = pool::call(
+    threads::PR_REQ_0, 
+    bind(
+      &file_transfer::upload_multi_init, 
+      this, 
+      _1, 
+      url, 
+      journal_source ? journal_source->headers : header_map(), 
+      &upload_id));
 
   if (r)
     return r;
 
+  if (journal_source)
+    journal = upload_journal::begin(url, upload_id, size, _upload_chunk_size, *journal_source);
+
   for (size_t i = 0; i < num_parts; i++) {
     upload_range *part = &parts[i];
 
     part->id = i;
     part->offset = i * _upload_chunk_size;
     part->size = (i != num_parts - 1) ? _upload_chunk_size : (size - _upload_chunk_size * i);
-  }
 
-  upload.reset(new multipart_upload(
-    parts.begin(),
-    parts.end(),
-    bind(&file_transfer::upload_part, this, _1, url, upload_id, on_read, _2, false),
-    bind(&file_transfer::upload_part, this, _1, url, upload_id, on_read, _2, true)));
+    // parts that haven't changed since the last upload can be copied from
+    // the stored object rather than sent again
+    part->copy = on_is_modified && !stored_etag.empty() && !on_is_modified(part->offset, part->size);
+  }
 
-  r = upload->process();
+  r = upload_parts(url, upload_id, on_read, stored_etag, journal, &parts);
 
   if (r) {
     pool::call(
       threads::PR_REQ_0, 
       bind(&file_transfer::upload_multi_cancel, this, _1, url, upload_id));
-
-    return r;
+  } else {
+    r = pool::call(
+      threads::PR_REQ_0, 
+      bind(&file_transfer::upload_multi_complete, this, _1, url, upload_id, build_complete_upload(parts), returned_etag));
   }
 
-  complete_upload = "<CompleteMultipartUpload>";
+  // either way, there's nothing left to resume (and the local copy belongs
+  // to the file)
+  if (journal)
+    upload_journal::end(journal, false);
 
-  for (size_t i = 0; i < parts.size(); i++) {
-    // part numbers are 1-based
-    complete_upload += "<Part><PartNumber>" + lexical_cast<string>(i + 1) + "</PartNumber><ETag>" + parts[i].etag + "</ETag></Part>";
-  }
+  return r;
+}
+
+int file_transfer::upload_parts(
+  const string &url, 
+  const string &upload_id, 
+  const read_chunk_fn &on_read, 
+  const string &stored_etag, 
+  const upload_journal::entry::ptr &journal, 
+  upload_range_list *parts)
+{
+  typedef parallel_work_queue<upload_range> multipart_upload;
 
-  complete_upload += "</CompleteMultipartUpload>";
+  scoped_ptr<multipart_upload> upload;
 
-  return pool::call(
-    threads::PR_REQ_0, 
-    bind(&file_transfer::upload_multi_complete, this, _1, url, upload_id, complete_upload, returned_etag));
+  upload.reset(new multipart_upload(
+    parts->begin(),
+    parts->end(),
+    bind(&file_transfer::upload_part, this, _1, url, upload_id, on_read, stored_etag, journal, _2, false),
+    bind(&file_transfer::upload_part, this, _1, url, upload_id, on_read, stored_etag, journal, _2, true)));
+
+  upload->set_direction(transfer_scheduler::TD_UPLOAD);
+
+  return upload->process();
 }
 
 int file_transfer::upload_part(
@@ -144,21 +424,57 @@ int file_transfer::upload_part(
   const string &url, 
   const string &upload_id, 
   const read_chunk_fn &on_read, 
+  const string &stored_etag, 
+  const upload_journal::entry::ptr &journal, 
   upload_range *range, 
   bool is_retry)
 {
   int r = 0;
   char_vector_ptr buffer(new char_vector());
+  string md5_hash;
+  uint8_t read_hash[md5::HASH_LEN];
 
   if (is_retry)
     ++s_uploads_multi_chunks_failed;
 
-  r = on_read(range->size, range->offset, buffer);
+  // we read the part even if we're going to copy it, both so that on_read 
+  // sees the whole file (to compute hashes, etc.) and so that we can verify
+  // that what was copied matches what we have locally
+  r = read_with_md5(on_read, range->size, range->offset, buffer, read_hash);
 
   if (r)
     return r;
 
-  range->etag = hash::compute<md5, hex_with_quotes>(*buffer);
+  md5_hash = encoder::encode<hex_with_quotes>(read_hash, md5::HASH_LEN);
+
+  // this part may have been sent while the file was still being written, in
+  // which case we only need to send it again if it's since changed
+  if (range->sent) {
+    if (md5_hash == range->etag)
+      return 0;
+
+    ++s_uploads_streamed_chunks_resent;
+    range->sent = false;
+  }
+
+  range->etag = md5_hash;
+
+  if (range->copy) {
+    if (copy_part(req, url, upload_id, stored_etag, range) == 0) {
+      ++s_uploads_multi_chunks_copied;
+      range->sent = true;
+
+      if (journal)
+        upload_journal::record_part(journal, range->id, range->etag);
+
+      return 0;
+    }
+
+    ++s_uploads_multi_copies_failed;
+
+    // send this part ourselves
+    range->copy = false;
+  }
 
   req->init(base::HTTP_PUT);
 
@@ -176,10 +492,59 @@ int file_transfer::upload_part(
     return -EAGAIN; // assume it's a temporary failure
   }
 
+  range->sent = true;
+
+  if (journal)
+    upload_journal::record_part(journal, range->id, range->etag);
+
+  return 0;
+}
+
+int file_transfer::copy_part(
+  const request::ptr &req, 
+  const string &url, 
+  const string &upload_id, 
+  const string &stored_etag, 
+  upload_range *range)
+{
+  xml::document_ptr doc;
+  string etag;
+
+  req->init(base::HTTP_PUT);
+
+  // part numbers are 1-based
+  req->set_url(url + "?partNumber=" + lexical_cast<string>(range->id + 1) + "&uploadId=" + upload_id);
+  req->set_header(service::get_header_prefix() + "copy-source", url);
+  req->set_header(service::get_header_prefix() + "copy-source-if-match", stored_etag);
+  req->set_header(service::get_header_prefix() + "copy-source-range", 
+    string("bytes=") + 
+    lexical_cast<string>(range->offset) + 
+    string("-") + 
+    lexical_cast<string>(range->offset + range->size - 1));
+
+  req->run(config::get_transfer_timeout_in_s());
+
+  if (req->get_response_code() != base::HTTP_SC_OK) {
+    S3_LOG(LOG_DEBUG, "file_transfer::copy_part", "copy of part %i of [%s] failed with error %li.\n", range->id, url.c_str(), req->get_response_code());
+    return -EIO;
+  }
+
+  doc = xml::parse(req->get_output_string());
+
+  if (!doc || xml::find(doc, COPY_PART_ETAG_XPATH, &etag))
+    return -EIO;
+
+  // the part etag is the md5 of the part, so this also tells us if the 
+  // stored object doesn't hold what we think it does
+  if (etag != range->etag) {
+    S3_LOG(LOG_WARNING, "file_transfer::copy_part", "md5 mismatch on copied part. expected %s, got %s.\n", range->etag.c_str(), etag.c_str());
+    return -EIO;
+  }
+
   return 0;
 }
 
-int file_transfer::upload_multi_init(const request::ptr &req, const string &url, string *upload_id)
+int file_transfer::upload_multi_init(const request::ptr &req, const string &url, const header_map &headers, string *upload_id)
 {
   xml::document_ptr doc;
   int r;
@@ -188,6 +553,9 @@ int file_transfer::upload_multi_init(const request::ptr &req, const string &url,
   req->set_url(url + "?uploads");
   req->set_header("Content-Type", "");
 
+  for (header_map::const_iterator itor = headers.begin(); itor != headers.end(); ++itor)
+    req->set_header(itor->first, itor->second);
+
   req->run();
 
   if (req->get_response_code() != base::HTTP_SC_OK)
@@ -209,9 +577,22 @@ int file_transfer::upload_multi_init(const request::ptr &req, const string &url,
   return r;
 }
 
+int file_transfer::upload_multi_check(const request::ptr &req, const string &url, const string &upload_id)
+{
+  req->init(base::HTTP_GET);
+  req->set_url(url + "?uploadId=" + upload_id, "max-parts=1");
+
+  req->run();
+
+  if (req->get_response_code() == base::HTTP_SC_NOT_FOUND)
+    return -ENOENT;
+
+  return (req->get_response_code() == base::HTTP_SC_OK) ? 0 : -EIO;
+}
+
 int file_transfer::upload_multi_cancel(const request::ptr &req, const string &url, const string &upload_id)
 {
-  S3_LOG(LOG_WARNING, "file_transfer::upload_multi_cancel", "one or more parts failed to upload for [%s].\n", url.c_str());
+  S3_LOG(LOG_WARNING, "file_transfer::upload_multi_cancel", "aborting multipart upload for [%s].\n", url.c_str());
 
   req->init(base::HTTP_DELETE);
   req->set_url(url + "?uploadId=" + upload_id);
@@ -262,3 +643,191 @@ int file_transfer::upload_multi_complete(
 
   return 0;
 }
+
+int file_transfer::resume_interrupted_uploads(const request::ptr & /* ignored */, const upload_journal::entry_list &entries)
+{
+  // nothing's waiting on these, so let everything else go ahead
+  transfer_scheduler::background_scope background;
+
+  if (config::get_orphaned_upload_max_age_in_h())
+    pool::call(
+      threads::PR_REQ_0, 
+      bind(&file_transfer::abort_orphaned_uploads, this, _1, entries));
+
+  for (size_t i = 0; i < entries.size(); i++)
+    resume_upload(entries[i]);
+
+  return 0;
+}
+
+int file_transfer::resume_upload(const upload_journal::entry::ptr &e)
+{
+  const size_t num_parts = (e->size + e->part_size - 1) / e->part_size;
+  upload_range_list parts(num_parts);
+  read_chunk_fn on_read;
+  string upload_id, etag;
+  struct stat s;
+  int fd, r;
+
+  fd = open(e->src.local_path.c_str(), O_RDONLY);
+
+  if (fd == -1 || fstat(fd, &s) || static_cast<size_t>(s.st_size) != e->size) {
+    S3_LOG(LOG_WARNING, "file_transfer::resume_upload", "local copy of [%s] is missing or incomplete. abandoning upload.\n", e->url.c_str());
+
+    if (fd != -1)
+      close(fd);
+
+    ++s_uploads_abandoned;
+
+    pool::call(
+      threads::PR_REQ_0, 
+      bind(&file_transfer::upload_multi_cancel, this, _1, e->url, e->upload_id));
+
+    upload_journal::end(e, true);
+
+    return -EIO;
+  }
+
+  r = pool::call(
+    threads::PR_REQ_0, 
+    bind(&file_transfer::upload_multi_check, this, _1, e->url, e->upload_id));
+
+  if (r == -ENOENT) {
+    // someone else aborted the upload (maybe the sweep of another mount), 
+    // but we have everything we need to start over
+    S3_LOG(LOG_WARNING, "file_transfer::resume_upload", "upload of [%s] no longer exists. starting over.\n", e->url.c_str());
+
+    ++s_uploads_restarted;
+
+    r = pool::call(
+      threads::PR_REQ_0, 
+      bind(&file_transfer::upload_multi_init, this, _1, e->url, e->src.headers, &upload_id));
+
+    if (r == 0 && !upload_journal::restart(e, upload_id)) {
+      pool::call(
+        threads::PR_REQ_0, 
+        bind(&file_transfer::upload_multi_cancel, this, _1, e->url, upload_id));
+
+      r = -EIO;
+    }
+  }
+
+  if (r == 0) {
+    on_read = bind(&read_local_file, fd, _1, _2, _3);
+
+    for (size_t i = 0; i < num_parts; i++) {
+      upload_range *part = &parts[i];
+
+      part->id = i;
+      part->offset = i * e->part_size;
+      part->size = (i != num_parts - 1) ? e->part_size : (e->size - e->part_size * i);
+
+      // upload_part() checks these against the local copy before skipping
+      // them
+      part->etag = e->etags[i];
+      part->sent = !part->etag.empty();
+    }
+
+    r = upload_parts(e->url, e->upload_id, on_read, string(), e, &parts);
+  }
+
+  if (r == 0)
+    r = pool::call(
+      threads::PR_REQ_0, 
+      bind(&file_transfer::upload_multi_complete, this, _1, e->url, e->upload_id, build_complete_upload(parts), &etag));
+
+  close(fd);
+
+  if (r) {
+    S3_LOG(LOG_WARNING, "file_transfer::resume_upload", "failed to resume upload of [%s] with error %i. will try again on next mount.\n", e->url.c_str(), r);
+
+    ++s_resume_failures;
+    return r;
+  }
+
+  S3_LOG(LOG_INFO, "file_transfer::resume_upload", "completed interrupted upload of [%s].\n", e->url.c_str());
+
+  ++s_uploads_resumed;
+  upload_journal::end(e, true);
+
+  return 0;
+}
+
+int file_transfer::abort_orphaned_uploads(const request::ptr &req, const upload_journal::entry_list &entries)
+{
+  const time_t cutoff = time(NULL) - static_cast<time_t>(config::get_orphaned_upload_max_age_in_h()) * 3600;
+  set<string> journaled;
+  string key_marker, upload_id_marker;
+  bool truncated = true;
+
+  for (size_t i = 0; i < entries.size(); i++)
+    journaled.insert(entries[i]->upload_id);
+
+  while (truncated) {
+    xml::document_ptr doc;
+    xml::element_list keys, upload_ids, initiated;
+    xml::element_list::const_iterator key, upload_id, initiated_at;
+    string query, temp;
+    int r;
+
+    if (!key_marker.empty())
+      query = string("key-marker=") + request::url_encode(key_marker) + "&upload-id-marker=" + request::url_encode(upload_id_marker);
+
+    req->init(base::HTTP_GET);
+    req->set_url(service::get_bucket_url() + "?uploads", query);
+
+    req->run();
+
+    if (req->get_response_code() != base::HTTP_SC_OK) {
+      S3_LOG(LOG_WARNING, "file_transfer::abort_orphaned_uploads", "failed to list multipart uploads with error %li.\n", req->get_response_code());
+      return -EIO;
+    }
+
+    doc = xml::parse(req->get_output_string());
+
+    if (!doc) {
+      S3_LOG(LOG_WARNING, "file_transfer::abort_orphaned_uploads", "failed to parse response.\n");
+      return -EIO;
+    }
+
+    if ((r = xml::find(doc, UPLOADS_IS_TRUNCATED_XPATH, &temp)))
+      return r;
+
+    truncated = (temp == "true");
+
+    if ((r = xml::find(doc, UPLOADS_KEY_XPATH, &keys)))
+      return r;
+
+    if ((r = xml::find(doc, UPLOADS_UPLOAD_ID_XPATH, &upload_ids)))
+      return r;
+
+    if ((r = xml::find(doc, UPLOADS_INITIATED_XPATH, &initiated)))
+      return r;
+
+    if (keys.size() != upload_ids.size() || keys.size() != initiated.size()) {
+      S3_LOG(LOG_WARNING, "file_transfer::abort_orphaned_uploads", "malformed upload list.\n");
+      return -EIO;
+    }
+
+    if (truncated) {
+      if ((r = xml::find(doc, UPLOADS_NEXT_KEY_MARKER_XPATH, &key_marker)))
+        return r;
+
+      if ((r = xml::find(doc, UPLOADS_NEXT_UPLOAD_ID_MARKER_XPATH, &upload_id_marker)))
+        return r;
+    }
+
+    for (key = keys.begin(), upload_id = upload_ids.begin(), initiated_at = initiated.begin(); key != keys.end(); ++key, ++upload_id, ++initiated_at) {
+      time_t started = parse_initiated_time(*initiated_at);
+
+      if (started == 0 || started > cutoff || journaled.find(*upload_id) != journaled.end())
+        continue;
+
+      upload_multi_cancel(req, service::get_bucket_url() + "/" + request::url_encode(*key), *upload_id);
+
+      ++s_orphaned_uploads_aborted;
+    }
+  }
+
+  return 0;
+}
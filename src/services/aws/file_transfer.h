@@ -23,6 +23,7 @@
 #define S3_SERVICES_AWS_FILE_TRANSFER_H
 
 #include <string>
+#include <vector>
 
 #include "services/file_transfer.h"
 
@@ -39,35 +40,73 @@ namespace s3
 
         virtual size_t get_upload_chunk_size();
 
+        virtual upload_stream::ptr begin_upload_stream(const std::string &url, const read_chunk_fn &on_read);
+
+        virtual void resume_uploads();
+
       protected:
         virtual int upload_multi(
           const std::string &url, 
           size_t size, 
           const read_chunk_fn &on_read, 
-          std::string *returned_etag);
+          std::string *returned_etag,
+          const is_range_modified_fn &on_is_modified,
+          const std::string &stored_etag,
+          const upload_journal::source *journal_source);
 
       private:
+        class stream;
+
         struct upload_range
         {
           int id;
           size_t size;
           off_t offset;
           std::string etag;
+          bool copy;
+          bool sent;
+
+          inline upload_range() : id(0), size(0), offset(0), copy(false), sent(false) { }
         };
 
+        typedef std::vector<upload_range> upload_range_list;
+
+        int upload_parts(
+          const std::string &url, 
+          const std::string &upload_id, 
+          const read_chunk_fn &on_read, 
+          const std::string &stored_etag, 
+          const upload_journal::entry::ptr &journal, 
+          upload_range_list *parts);
+
         int upload_part(
           const base::request::ptr &req, 
           const std::string &url, 
           const std::string &upload_id, 
           const read_chunk_fn &on_read, 
+          const std::string &stored_etag, 
+          const upload_journal::entry::ptr &journal, 
           upload_range *range, 
           bool is_retry);
 
+        int copy_part(
+          const base::request::ptr &req, 
+          const std::string &url, 
+          const std::string &upload_id, 
+          const std::string &stored_etag, 
+          upload_range *range);
+
         int upload_multi_init(
           const base::request::ptr &req, 
           const std::string &url, 
+          const base::header_map &headers, 
           std::string *upload_id);
 
+        int upload_multi_check(
+          const base::request::ptr &req, 
+          const std::string &url, 
+          const std::string &upload_id);
+
         int upload_multi_cancel(
           const base::request::ptr &req, 
           const std::string &url, 
@@ -80,6 +119,16 @@ namespace s3
           const std::string &upload_metadata, 
           std::string *etag);
 
+        int resume_interrupted_uploads(
+          const base::request::ptr &req, 
+          const upload_journal::entry_list &entries);
+
+        int resume_upload(const upload_journal::entry::ptr &e);
+
+        int abort_orphaned_uploads(
+          const base::request::ptr &req, 
+          const upload_journal::entry_list &entries);
+
         size_t _upload_chunk_size;
       };
     }
@@ -0,0 +1,191 @@
+/*
+ * services/chunk_sink.h
+ * -------------------------------------------------------------------------
+ * Collects downloaded data into whole hash list chunks.
+ * -------------------------------------------------------------------------
+ *
+ * Copyright (c) 2013, Tarick Bedeir.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_SERVICES_CHUNK_SINK_H
+#define S3_SERVICES_CHUNK_SINK_H
+
+#include <errno.h>
+
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "base/request.h"
+#include "crypto/hash_list.h"
+#include "crypto/sha256.h"
+
+namespace s3
+{
+  namespace services
+  {
+    // collects the pieces of a response body that libcurl hands us into
+    // whole hash list chunks (which is what on_write expects, and what files
+    // hash and track downloads by), so that at most one chunk per transfer
+    // is held in memory.
+    //
+    // more than one request can feed the same sink (a retry, or a hedge and
+    // the request it hedges), in which case each piece of the range goes to
+    // on_write once, from whichever request gets to it first. a request
+    // that only asks for the part of the range that hasn't arrived yet
+    // passes the offset it starts at to write().
+    class chunk_sink
+    {
+    public:
+      typedef boost::function3<int, const char *, size_t, off_t> write_chunk_fn;
+
+      static const size_t CHUNK_SIZE = crypto::hash_list<crypto::sha256>::CHUNK_SIZE;
+
+      inline chunk_sink(const write_chunk_fn &on_write, off_t offset, size_t size)
+        : _on_write(on_write),
+          _offset(offset),
+          _size(size),
+          _written(0),
+          _done(false)
+      {
+      }
+
+      // how much of the range has arrived, counting from the start of the
+      // range
+      inline size_t get_received()
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+
+        return _written + _buffer.size();
+      }
+
+      // body_offset counts from request_offset, which counts from the start
+      // of the range
+      int write(size_t request_offset, const char *data, size_t size, size_t body_offset)
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+        size_t received = _written + _buffer.size();
+        int r;
+
+        // someone else finished the range
+        if (_done)
+          return -ECANCELED;
+
+        body_offset += request_offset;
+
+        // ignore anything past the range we asked for
+        if (body_offset >= _size)
+          return 0;
+
+        if (size > _size - body_offset)
+          size = _size - body_offset;
+
+        // and anything we already have
+        if (body_offset + size <= received)
+          return 0;
+
+        // a gap can't be filled later, since pieces are only ever appended
+        if (body_offset > received)
+          return -EIO;
+
+        data += received - body_offset;
+        size -= received - body_offset;
+
+        while (size) {
+          size_t n;
+
+          // skip the copy if we've been given a whole chunk
+          if (_buffer.empty() && size >= CHUNK_SIZE) {
+            r = _on_write(data, CHUNK_SIZE, _offset + _written);
+
+            if (r)
+              return r;
+
+            _written += CHUNK_SIZE;
+            data += CHUNK_SIZE;
+            size -= CHUNK_SIZE;
+
+            continue;
+          }
+
+          n = CHUNK_SIZE - _buffer.size();
+
+          if (n > size)
+            n = size;
+
+          if (_buffer.capacity() < CHUNK_SIZE)
+            _buffer.reserve(CHUNK_SIZE);
+
+          _buffer.insert(_buffer.end(), data, data + n);
+          data += n;
+          size -= n;
+
+          if (_buffer.size() == CHUNK_SIZE) {
+            r = flush();
+
+            if (r)
+              return r;
+          }
+        }
+
+        return 0;
+      }
+
+      // flushes what's left, after which any further writes fail
+      int finish()
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+        int r;
+
+        r = flush();
+
+        if (r)
+          return r;
+
+        _done = true;
+        base::char_vector().swap(_buffer); // for the memory
+
+        return 0;
+      }
+
+    private:
+      int flush()
+      {
+        int r;
+
+        if (_buffer.empty())
+          return 0;
+
+        r = _on_write(&_buffer[0], _buffer.size(), _offset + _written);
+
+        if (r)
+          return r;
+
+        _written += _buffer.size();
+        _buffer.clear();
+
+        return 0;
+      }
+
+      boost::mutex _mutex;
+      write_chunk_fn _on_write;
+      off_t _offset;
+      size_t _size, _written;
+      base::char_vector _buffer;
+      bool _done;
+    };
+  }
+}
+
+#endif
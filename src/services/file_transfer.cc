@@ -20,23 +20,30 @@
  */
 
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/detail/atomic_count.hpp>
 
 #include "base/config.h"
 #include "base/logger.h"
 #include "base/request.h"
 #include "base/statistics.h"
+#include "base/transfer_scheduler.h"
 #include "crypto/base64.h"
 #include "crypto/encoder.h"
 #include "crypto/hash.h"
+#include "crypto/hash_list.h"
 #include "crypto/hex_with_quotes.h"
 #include "crypto/md5.h"
+#include "crypto/sha256.h"
+#include "services/chunk_sink.h"
 #include "services/file_transfer.h"
 #include "threads/parallel_work_queue.h"
 #include "threads/pool.h"
 
 using boost::lexical_cast;
+using boost::mutex;
 using boost::scoped_ptr;
+using boost::shared_ptr;
 using boost::detail::atomic_count;
 using std::ostream;
 using std::string;
@@ -47,28 +54,118 @@ using s3::base::char_vector_ptr;
 using s3::base::config;
 using s3::base::request;
 using s3::base::statistics;
+using s3::base::transfer_scheduler;
 using s3::crypto::base64;
 using s3::crypto::encoder;
 using s3::crypto::hash;
+using s3::crypto::hash_list;
 using s3::crypto::hex_with_quotes;
 using s3::crypto::md5;
+using s3::crypto::sha256;
+using s3::services::chunk_sink;
 using s3::services::file_transfer;
+using s3::services::upload_journal;
 using s3::threads::parallel_work_queue;
 using s3::threads::pool;
 
 namespace
 {
-  struct download_range
-  {
-    size_t size;
-    off_t offset;
-  };
+  // single-part uploads up to this size are read into memory before they're
+  // sent, so that they can carry Content-MD5
+  const size_t UPLOAD_IN_MEMORY_MAX_SIZE = 128 * 1024;
 
   atomic_count s_downloads_single(0), s_downloads_single_failed(0);
   atomic_count s_downloads_multi(0), s_downloads_multi_failed(0), s_downloads_multi_chunks_failed(0);
+  atomic_count s_downloads_streamed(0), s_downloads_streamed_failed(0);
   atomic_count s_uploads_single(0), s_uploads_single_failed(0);
   atomic_count s_uploads_multi(0), s_uploads_multi_failed(0);
 
+  // parts hedged, and hedges that finished first, across multi-part and 
+  // streamed downloads
+  mutex s_hedge_mutex;
+  uint64_t s_hedged_chunks = 0, s_hedges_won = 0;
+
+  // averages the throughput and latency of download parts, from which
+  // download_multi() picks part sizes big enough that waiting for the first
+  // byte doesn't dominate the time each part takes
+  class part_estimator
+  {
+  public:
+    inline part_estimator()
+      : _rate(0.0),
+        _latency(0.0),
+        _last_chunk_size(0),
+        _last_peak_parts(0)
+    {
+    }
+
+    void update(size_t size, double run_time, double first_byte_time)
+    {
+      // weight of each new sample in the averages
+      const double WEIGHT = 0.2;
+
+      mutex::scoped_lock lock(_mutex);
+      double body_time = run_time - first_byte_time;
+
+      if (body_time <= 0.0 || first_byte_time <= 0.0)
+        return;
+
+      _rate = (_rate == 0.0) ? (size / body_time) : ((1.0 - WEIGHT) * _rate + WEIGHT * (size / body_time));
+      _latency = (_latency == 0.0) ? first_byte_time : ((1.0 - WEIGHT) * _latency + WEIGHT * first_byte_time);
+    }
+
+    size_t choose_chunk_size(size_t size, size_t min_chunk_size, size_t max_chunk_size, size_t parts_in_progress)
+    {
+      // parts should take at least this many times as long as the wait for
+      // their first byte
+      const double LATENCY_MULTIPLE = 3.0;
+
+      mutex::scoped_lock lock(_mutex);
+      size_t chunk_size = static_cast<size_t>(LATENCY_MULTIPLE * _latency * _rate);
+
+      // there should still be enough parts to keep parts_in_progress busy
+      if (chunk_size > size / parts_in_progress)
+        chunk_size = size / parts_in_progress;
+
+      if (chunk_size > max_chunk_size)
+        chunk_size = max_chunk_size;
+
+      // parts have to line up with the chunks files track downloads by
+      chunk_size -= chunk_size % min_chunk_size;
+
+      if (chunk_size < min_chunk_size)
+        chunk_size = min_chunk_size;
+
+      _last_chunk_size = chunk_size;
+
+      return chunk_size;
+    }
+
+    inline void set_last_peak_parts(size_t parts)
+    {
+      mutex::scoped_lock lock(_mutex);
+
+      _last_peak_parts = parts;
+    }
+
+    void write(ostream *o)
+    {
+      mutex::scoped_lock lock(_mutex);
+
+      *o <<
+        "adaptive downloads:\n"
+        "  throughput per part: " << _rate / 1024.0 << " KB/s, latency: " << _latency * 1.0e3 << " ms\n"
+        "  last part size: " << _last_chunk_size << ", last peak parts in progress: " << _last_peak_parts << "\n";
+    }
+
+  private:
+    mutex _mutex;
+    double _rate, _latency;
+    size_t _last_chunk_size, _last_peak_parts;
+  };
+
+  part_estimator s_part_estimator;
+
   void statistics_writer(ostream *o)
   {
     *o <<
@@ -79,38 +176,162 @@ namespace
       "  succeeded: " << s_downloads_multi << "\n"
       "  failed: " << s_downloads_multi_failed << "\n"
       "  chunks failed: " << s_downloads_multi_chunks_failed << "\n"
+      "common streamed downloads:\n"
+      "  succeeded: " << s_downloads_streamed << "\n"
+      "  failed: " << s_downloads_streamed_failed << "\n"
+      "download hedging:\n"
+      "  chunks hedged: " << s_hedged_chunks << ", won by hedge: " << s_hedges_won << "\n"
       "common single-part uploads:\n"
       "  succeeded: " << s_uploads_single << "\n"
       "  failed: " << s_uploads_single_failed << "\n"
       "common multi-part uploads:\n"
       "  succeeded: " << s_uploads_multi << "\n"
       "  failed: " << s_uploads_multi_failed << "\n";
+
+    s_part_estimator.write(o);
   }
 
   statistics::writers::entry s_writer(statistics_writer, 0);
 
-  int download_part(const request::ptr &req, const string &url, download_range *range, const file_transfer::write_chunk_fn &on_write, bool is_retry)
+  struct download_range
+  {
+    size_t size;
+    off_t offset;
+
+    // shared by every request for the range, so that a retry picks up 
+    // where the last attempt left off
+    shared_ptr<chunk_sink> sink;
+  };
+
+  // reads the body of an upload from on_read, computing its md5 as it goes
+  class md5_source
+  {
+  public:
+    inline md5_source(const file_transfer::read_chunk_fn &on_read)
+      : _on_read(on_read),
+        _size(0)
+    {
+    }
+
+    int read(size_t size, off_t offset, const char_vector_ptr &buffer)
+    {
+      int r;
+
+      // the request was retried, so start over
+      if (offset == 0) {
+        _ctx.reset();
+        _size = 0;
+      }
+
+      r = _on_read(size, offset, buffer);
+
+      if (r)
+        return r;
+
+      if (static_cast<size_t>(offset) != _size)
+        return -EINVAL; // requests read their bodies in order
+
+      _ctx.update(reinterpret_cast<const uint8_t *>(&(*buffer)[0]), size);
+      _size += size;
+
+      return 0;
+    }
+
+    inline size_t get_size() { return _size; }
+
+    inline void finalize(uint8_t *hash) { _ctx.finalize(hash); }
+
+  private:
+    file_transfer::read_chunk_fn _on_read;
+    md5::context _ctx;
+    size_t _size;
+  };
+
+  // sets up the request for a part -- see complete_download_part()
+  int prepare_download_part(const request::ptr &req, const string &url, download_range *range, const file_transfer::write_chunk_fn &on_write, bool is_retry)
   {
     // yes, relying on is_retry will result in the chunks failed count being off by one, maybe, but we don't care
     if (is_retry)
       ++s_downloads_multi_chunks_failed; 
 
+    size_t start;
+
+    if (!range->sink)
+      range->sink.reset(new chunk_sink(on_write, range->offset, range->size));
+
+    // retries and hedges only ask for what hasn't arrived yet (but always 
+    // for at least one byte, so that the range stays valid)
+    start = range->sink->get_received();
+
+    if (start >= range->size)
+      start = range->size - 1;
+
     req->init(s3::base::HTTP_GET);
     req->set_url(url);
     req->set_header("Range", 
       string("bytes=") + 
-      lexical_cast<string>(range->offset) + 
+      lexical_cast<string>(range->offset + start) + 
       string("-") + 
       lexical_cast<string>(range->offset + range->size));
 
-    req->run(config::get_transfer_timeout_in_s());
+    // write the body to the file as it arrives rather than buffering it
+    req->set_output_sink(bind(&chunk_sink::write, range->sink, start, _1, _2, _3), s3::base::HTTP_SC_PARTIAL_CONTENT);
+
+    return 0;
+  }
 
+  int complete_download_part(const request::ptr &req, download_range *range)
+  {
+    // this request may have started part-way through the range, so check
+    // that the range as a whole has arrived
     if (req->get_response_code() != s3::base::HTTP_SC_PARTIAL_CONTENT)
       return -EIO;
-    else if (req->get_output_buffer().size() < range->size)
+    else if (range->sink->get_received() < range->size)
       return -EIO;
 
-    return on_write(&req->get_output_buffer()[0], range->size, range->offset);
+    if (config::get_adaptive_transfers())
+      s_part_estimator.update(range->size, req->get_last_run_time(), req->get_last_run_first_byte_time());
+
+    return range->sink->finish();
+  }
+
+  template <class queue_type>
+  int record_hedges(queue_type *queue, int r)
+  {
+    mutex::scoped_lock lock(s_hedge_mutex);
+
+    s_hedged_chunks += queue->get_hedged_parts();
+    s_hedges_won += queue->get_hedges_won();
+
+    return r;
+  }
+
+  int select_priority_part(const file_transfer::get_priority_offset_fn &on_get_priority, size_t chunk_size)
+  {
+    off_t offset = on_get_priority();
+
+    return (offset < 0) ? -1 : (offset / chunk_size);
+  }
+
+  download_range * select_stream_part(const file_transfer::get_next_chunk_fn &on_get_next_chunk, vector<download_range> *parts)
+  {
+    int chunk = on_get_next_chunk();
+
+    return (chunk < 0 || static_cast<size_t>(chunk) >= parts->size()) ? NULL : &(*parts)[chunk];
+  }
+
+  void build_download_ranges(size_t size, size_t chunk_size, vector<download_range> *parts)
+  {
+    size_t num_parts = (size + chunk_size - 1) / chunk_size;
+
+    parts->resize(num_parts);
+
+    for (size_t i = 0; i < num_parts; i++) {
+      download_range *range = &(*parts)[i];
+
+      range->offset = i * chunk_size;
+      range->size = (i != num_parts - 1) ? chunk_size : (size - chunk_size * i);
+    }
   }
 
   int increment_on_result(int r, atomic_count *success, atomic_count *failure)
@@ -124,6 +345,44 @@ namespace
   }
 }
 
+file_transfer::upload_stream::~upload_stream()
+{
+}
+
+int file_transfer::read_with_md5(
+  const read_chunk_fn &on_read, 
+  size_t size, 
+  off_t offset, 
+  const char_vector_ptr &buffer, 
+  uint8_t *md5_hash)
+{
+  // pieces are hash list chunks, since that's what files read (and hash, and
+  // encrypt) at a time anyway
+  const size_t PIECE_SIZE = hash_list<sha256>::CHUNK_SIZE;
+
+  char_vector_ptr piece(new char_vector());
+  md5::context ctx;
+
+  buffer->clear();
+  buffer->reserve(size);
+
+  for (size_t pos = 0; pos < size; pos += PIECE_SIZE) {
+    int r;
+
+    r = on_read((size - pos < PIECE_SIZE) ? size - pos : PIECE_SIZE, offset + pos, piece);
+
+    if (r)
+      return r;
+
+    ctx.update(reinterpret_cast<const uint8_t *>(&(*piece)[0]), piece->size());
+    buffer->insert(buffer->end(), piece->begin(), piece->end());
+  }
+
+  ctx.finalize(md5_hash);
+
+  return 0;
+}
+
 file_transfer::~file_transfer()
 {
 }
@@ -138,40 +397,72 @@ size_t file_transfer::get_upload_chunk_size()
   return 0; // this file_transfer impl doesn't do chunks
 }
 
-int file_transfer::download(const string &url, size_t size, const write_chunk_fn &on_write)
+file_transfer::upload_stream::ptr file_transfer::begin_upload_stream(const string &url, const read_chunk_fn &on_read)
+{
+  return upload_stream::ptr();
+}
+
+void file_transfer::resume_uploads()
+{
+  upload_journal::entry_list entries;
+
+  upload_journal::take_interrupted(&entries);
+
+  // leave them be, in case we're mounted with a service that can resume
+  // them later
+  for (size_t i = 0; i < entries.size(); i++)
+    S3_LOG(LOG_WARNING, "file_transfer::resume_uploads", "can't resume upload of [%s] with this service.\n", entries[i]->url.c_str());
+}
+
+int file_transfer::download(const string &url, size_t size, const write_chunk_fn &on_write, const get_priority_offset_fn &on_get_priority)
 {
   if (get_download_chunk_size() > 0 && size > get_download_chunk_size())
     return increment_on_result(
-      download_multi(url, size, on_write), 
+      download_multi(url, size, on_write, on_get_priority), 
       &s_downloads_multi,
       &s_downloads_multi_failed);
-  else
+  else {
+    transfer_scheduler::wait_for_bandwidth(transfer_scheduler::TD_DOWNLOAD);
+
     return increment_on_result(
       pool::call(threads::PR_REQ_1, bind(&file_transfer::download_single, this, _1, url, size, on_write)),
       &s_downloads_single, 
       &s_downloads_single_failed);
+  }
 }
 
-int file_transfer::upload(const string &url, size_t size, const read_chunk_fn &on_read, string *returned_etag)
+int file_transfer::upload(
+  const string &url, 
+  size_t size, 
+  const read_chunk_fn &on_read, 
+  string *returned_etag, 
+  const is_range_modified_fn &on_is_modified, 
+  const string &stored_etag,
+  const upload_journal::source *journal_source)
 {
   if (get_upload_chunk_size() > 0 && size > get_upload_chunk_size())
     return increment_on_result(
-      upload_multi(url, size, on_read, returned_etag),
+      upload_multi(url, size, on_read, returned_etag, on_is_modified, stored_etag, journal_source),
       &s_uploads_multi,
       &s_uploads_multi_failed);
-  else
+  else {
+    transfer_scheduler::wait_for_bandwidth(transfer_scheduler::TD_UPLOAD);
+
     return increment_on_result(
       pool::call(threads::PR_REQ_1, bind(&file_transfer::upload_single, this, _1, url, size, on_read, returned_etag)),
       &s_uploads_single,
       &s_uploads_single_failed);
+  }
 }
 
 int file_transfer::download_single(const request::ptr &req, const string &url, size_t size, const write_chunk_fn &on_write)
 {
   long rc = 0;
+  chunk_sink sink(on_write, 0, size);
 
   req->init(base::HTTP_GET);
   req->set_url(url);
+  req->set_output_sink(bind(&chunk_sink::write, &sink, 0, _1, _2, _3), base::HTTP_SC_OK);
 
   req->run(config::get_transfer_timeout_in_s());
   rc = req->get_response_code();
@@ -181,55 +472,104 @@ int file_transfer::download_single(const request::ptr &req, const string &url, s
   else if (rc != base::HTTP_SC_OK)
     return -EIO;
 
-  return on_write(&req->get_output_buffer()[0], req->get_output_buffer().size(), 0);
+  return sink.finish();
 }
 
-int file_transfer::download_multi(const string &url, size_t size, const file_transfer::write_chunk_fn &on_write)
+int file_transfer::download_multi(const string &url, size_t size, const write_chunk_fn &on_write, const get_priority_offset_fn &on_get_priority)
 {
   typedef parallel_work_queue<download_range> multipart_download;
 
   scoped_ptr<multipart_download> dl;
-  size_t num_parts = (size + get_download_chunk_size() - 1) / get_download_chunk_size();
-  vector<download_range> parts(num_parts);
+  vector<download_range> parts;
+  size_t chunk_size = get_download_chunk_size();
+  int r;
 
-  for (size_t i = 0; i < num_parts; i++) {
-    download_range *range = &parts[i];
+  // files only care that parts are made up of whole chunks, so whole-file
+  // downloads can use larger parts
+  if (config::get_adaptive_transfers())
+    chunk_size = s_part_estimator.choose_chunk_size(
+      size, 
+      chunk_size, 
+      config::get_max_download_chunk_size(), 
+      config::get_max_parts_in_progress());
 
-    range->offset = i * get_download_chunk_size();
-    range->size = (i != num_parts - 1) ? get_download_chunk_size() : (size - get_download_chunk_size() * i);
-  }
+  build_download_ranges(size, chunk_size, &parts);
 
   dl.reset(new multipart_download(
     parts.begin(),
     parts.end(),
-    bind(&download_part, _1, url, _2, on_write, false),
-    bind(&download_part, _1, url, _2, on_write, true)));
+    bind(&prepare_download_part, _1, url, _2, on_write, false),
+    bind(&prepare_download_part, _1, url, _2, on_write, true),
+    -1, // default max_retries
+    -1, // default max_parts_in_progress
+    on_get_priority
+      ? multipart_download::select_part_fn(bind(&select_priority_part, on_get_priority, chunk_size))
+      : multipart_download::select_part_fn()));
+
+  dl->set_on_complete_part(bind(&complete_download_part, _1, _2), config::get_transfer_timeout_in_s());
+
+  r = record_hedges(dl.get(), dl->process());
+
+  if (config::get_adaptive_transfers())
+    s_part_estimator.set_last_peak_parts(dl->get_peak_parts_in_progress());
+
+  return r;
+}
+
+int file_transfer::download_stream(const string &url, size_t size, const write_chunk_fn &on_write, const get_next_chunk_fn &on_get_next_chunk)
+{
+  typedef parallel_work_queue<download_range> multipart_download;
+
+  scoped_ptr<multipart_download> dl;
+  vector<download_range> parts;
+
+  build_download_ranges(size, get_download_chunk_size(), &parts);
+
+  dl.reset(new multipart_download(
+    bind(&select_stream_part, on_get_next_chunk, &parts),
+    bind(&prepare_download_part, _1, url, _2, on_write, false),
+    bind(&prepare_download_part, _1, url, _2, on_write, true)));
+
+  dl->set_on_complete_part(bind(&complete_download_part, _1, _2), config::get_transfer_timeout_in_s());
 
-  return dl->process();
+  return increment_on_result(
+    record_hedges(dl.get(), dl->process()),
+    &s_downloads_streamed,
+    &s_downloads_streamed_failed);
 }
 
 int file_transfer::upload_single(const request::ptr &req, const string &url, size_t size, const read_chunk_fn &on_read, string *returned_etag)
 {
   int r = 0;
-  char_vector_ptr buffer(new char_vector());
-  string expected_md5_b64, expected_md5_hex, etag;
+  md5_source source(on_read);
+  char_vector_ptr buffer;
+  string expected_md5_hex, etag;
   uint8_t read_hash[md5::HASH_LEN];
 
-  r = on_read(size, 0, buffer);
+  req->init(base::HTTP_PUT);
+  req->set_url(url);
 
-  if (r)
-    return r;
+  if (size <= UPLOAD_IN_MEMORY_MAX_SIZE) {
+    // small enough to hold, so its md5 is known in time for Content-MD5
+    // (which lets the server reject a body that was corrupted in transit)
+    buffer.reset(new char_vector());
 
-  hash::compute<md5>(*buffer, read_hash);
+    r = on_read(size, 0, buffer);
 
-  expected_md5_b64 = encoder::encode<base64>(read_hash, md5::HASH_LEN);
-  expected_md5_hex = encoder::encode<hex_with_quotes>(read_hash, md5::HASH_LEN);
+    if (r)
+      return r;
 
-  req->init(base::HTTP_PUT);
-  req->set_url(url);
+    hash::compute<md5>(*buffer, read_hash);
 
-  req->set_header("Content-MD5", expected_md5_b64);
-  req->set_input_buffer(buffer);
+    req->set_header("Content-MD5", encoder::encode<base64>(read_hash, md5::HASH_LEN));
+    req->set_input_buffer(buffer);
+
+  } else {
+    // otherwise the body is read from on_read as it's sent, and hashed on
+    // the way -- we can't know its md5 in time to send Content-MD5, so
+    // instead we check it against the etag we get back
+    req->set_input_source(bind(&md5_source::read, &source, _1, _2, _3), size);
+  }
 
   req->run(config::get_transfer_timeout_in_s());
 
@@ -238,6 +578,16 @@ int file_transfer::upload_single(const request::ptr &req, const string &url, siz
     return -EIO;
   }
 
+  if (!buffer) {
+    if (source.get_size() != size) {
+      S3_LOG(LOG_WARNING, "file_transfer::upload_single", "short read while uploading [%s].\n", url.c_str());
+      return -EIO;
+    }
+
+    source.finalize(read_hash);
+  }
+
+  expected_md5_hex = encoder::encode<hex_with_quotes>(read_hash, md5::HASH_LEN);
   etag = req->get_response_header("ETag");
 
   if (md5::is_valid_quoted_hex_hash(etag) && etag != expected_md5_hex) {
@@ -250,7 +600,14 @@ int file_transfer::upload_single(const request::ptr &req, const string &url, siz
   return 0;
 }
 
-int file_transfer::upload_multi(const string &url, size_t size, const read_chunk_fn &on_read, string *returned_etag)
+int file_transfer::upload_multi(
+  const string &url, 
+  size_t size, 
+  const read_chunk_fn &on_read, 
+  string *returned_etag, 
+  const is_range_modified_fn &on_is_modified, 
+  const string &stored_etag,
+  const upload_journal::source *journal_source)
 {
   return -ENOTSUP;
 }
@@ -27,6 +27,7 @@
 #include <boost/smart_ptr.hpp>
 
 #include "base/request.h"
+#include "services/upload_journal.h"
 
 namespace s3
 {
@@ -38,15 +39,89 @@ namespace s3
       typedef boost::function3<int, const char *, size_t, off_t> write_chunk_fn;
       typedef boost::function3<int, size_t, off_t, const base::char_vector_ptr &> read_chunk_fn;
 
+      // returns the offset of a byte that a reader is blocked on, or -1
+      typedef boost::function0<off_t> get_priority_offset_fn;
+
+      // returns the index of the next download chunk to fetch, or -1 if
+      // nothing more is wanted for now
+      typedef boost::function0<int> get_next_chunk_fn;
+
+      // returns true if the local range [offset, offset + size) may differ
+      // from the same range in the object already stored at the upload URL
+      typedef boost::function2<bool, off_t, size_t> is_range_modified_fn;
+
+      // a multipart upload whose parts can be sent while the file is still
+      // being written
+      class upload_stream
+      {
+      public:
+        typedef boost::shared_ptr<upload_stream> ptr;
+
+        virtual ~upload_stream();
+
+        // sends, in the background, the part at index * get_upload_chunk_size()
+        virtual void send_part(size_t index) = 0;
+
+        // waits for any parts that are being sent
+        virtual void wait_for_parts() = 0;
+
+        // sends whatever hasn't been sent (or has changed since it was) and
+        // completes the upload
+        virtual int complete(size_t size, std::string *returned_etag) = 0;
+
+        virtual int cancel(const base::request::ptr &req) = 0;
+      };
+
       virtual ~file_transfer();
 
       virtual size_t get_download_chunk_size();
       virtual size_t get_upload_chunk_size();
 
-      int download(const std::string &url, size_t size, const write_chunk_fn &on_write);
-      int upload(const std::string &url, size_t size, const read_chunk_fn &on_read, std::string *returned_etag);
+      // returns an empty pointer if this service can't stream uploads
+      virtual upload_stream::ptr begin_upload_stream(const std::string &url, const read_chunk_fn &on_read);
+
+      int download(
+        const std::string &url,
+        size_t size,
+        const write_chunk_fn &on_write,
+        const get_priority_offset_fn &on_get_priority = get_priority_offset_fn());
+      // if on_is_modified is set, parts that it reports as unmodified may be
+      // copied server-side from the object at url, provided its etag is still
+      // stored_etag. if journal_source is set, and the upload is sent in
+      // parts, it's recorded in the upload journal as it progresses.
+      int upload(
+        const std::string &url,
+        size_t size,
+        const read_chunk_fn &on_read,
+        std::string *returned_etag,
+        const is_range_modified_fn &on_is_modified = is_range_modified_fn(),
+        const std::string &stored_etag = "",
+        const upload_journal::source *journal_source = NULL);
+
+      // finishes uploads that an earlier mount left in the upload journal
+      // (in the background, once the thread pools are up)
+      virtual void resume_uploads();
+
+      // fetches chunks of get_download_chunk_size() bytes, in parallel, as
+      // on_get_next_chunk asks for them, and returns once it stops asking and
+      // nothing is left in flight. may be called repeatedly for the same
+      // object.
+      int download_stream(
+        const std::string &url,
+        size_t size,
+        const write_chunk_fn &on_write,
+        const get_next_chunk_fn &on_get_next_chunk);
 
     protected:
+      // reads size bytes at offset with on_read, a piece at a time, computing
+      // the md5 hash of each piece while it's still in cache
+      static int read_with_md5(
+        const read_chunk_fn &on_read, 
+        size_t size, 
+        off_t offset, 
+        const base::char_vector_ptr &buffer, 
+        uint8_t *md5_hash);
+
       virtual int download_single(
         const base::request::ptr &req, 
         const std::string &url,
@@ -56,7 +131,8 @@ namespace s3
       virtual int download_multi(
         const std::string &url,
         size_t size,
-        const write_chunk_fn &on_write);
+        const write_chunk_fn &on_write,
+        const get_priority_offset_fn &on_get_priority);
 
       virtual int upload_single(
         const base::request::ptr &req, 
@@ -69,7 +145,10 @@ namespace s3
         const std::string &url,
         size_t size,
         const read_chunk_fn &on_read,
-        std::string *returned_etag);
+        std::string *returned_etag,
+        const is_range_modified_fn &on_is_modified,
+        const std::string &stored_etag,
+        const upload_journal::source *journal_source);
     };
   }
 }
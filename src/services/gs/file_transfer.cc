@@ -25,6 +25,9 @@
 #include "base/config.h"
 #include "base/logger.h"
 #include "base/statistics.h"
+#include "base/transfer_scheduler.h"
+#include "crypto/buffer.h"
+#include "services/service.h"
 #include "services/gs/file_transfer.h"
 #include "threads/parallel_work_queue.h"
 #include "threads/pool.h"
@@ -41,6 +44,9 @@ using s3::base::char_vector_ptr;
 using s3::base::config;
 using s3::base::request;
 using s3::base::statistics;
+using s3::base::transfer_scheduler;
+using s3::crypto::buffer;
+using s3::services::service;
 using s3::services::gs::file_transfer;
 using s3::threads::parallel_work_queue;
 using s3::threads::pool;
@@ -51,16 +57,49 @@ namespace
 
   const string UPLOAD_ID_DELIM = "?upload_id=";
 
+  // the fs layer keeps objects with this prefix out of directory listings
+  const string COMPONENT_PREFIX = "$s3fuse$_component_";
+  const size_t COMPONENT_ID_LEN = 16; // bytes, before hex encoding
+
+  // service limits on composite objects
+  const size_t MAX_COMPONENTS = 1024;
+  const size_t MAX_COMPOSE_SOURCES = 32;
+
   atomic_count s_uploads_multi_chunks_failed(0);
+  atomic_count s_uploads_composite(0), s_uploads_composite_failed(0);
+  atomic_count s_components(0), s_components_failed(0), s_components_not_removed(0);
 
   void statistics_writer(ostream *o)
   {
     *o <<
       "google storage multi-part uploads:\n"
-      "  chunks failed: " << s_uploads_multi_chunks_failed << "\n";
+      "  chunks failed: " << s_uploads_multi_chunks_failed << "\n"
+      "google storage parallel composite uploads:\n"
+      "  uploads: " << s_uploads_composite << ", failed: " << s_uploads_composite_failed << "\n"
+      "  components: " << s_components << ", failed: " << s_components_failed << ", not removed: " << s_components_not_removed << "\n";
   }
 
   statistics::writers::entry s_writer(statistics_writer, 0);
+
+  inline string get_component_url(const string &name)
+  {
+    return service::get_bucket_url() + "/" + request::url_encode(name);
+  }
+
+  int read_component(const file_transfer::read_chunk_fn &on_read, off_t component_offset, size_t size, off_t offset, const char_vector_ptr &buffer)
+  {
+    return on_read(size, component_offset + offset, buffer);
+  }
+
+  int remove_object(const request::ptr &req, const string &url)
+  {
+    req->init(s3::base::HTTP_DELETE);
+    req->set_url(url);
+
+    req->run();
+
+    return (req->get_response_code() == s3::base::HTTP_SC_NO_CONTENT || req->get_response_code() == s3::base::HTTP_SC_NOT_FOUND) ? 0 : -EIO;
+  }
 }
 
 file_transfer::file_transfer()
@@ -76,10 +115,20 @@ size_t file_transfer::get_upload_chunk_size()
   return _upload_chunk_size;
 }
 
-int file_transfer::upload_multi(const string &url, size_t size, const read_chunk_fn &on_read, string *returned_etag)
+int file_transfer::upload_multi(
+  const string &url, 
+  size_t size, 
+  const read_chunk_fn &on_read, 
+  string *returned_etag, 
+  const is_range_modified_fn & /* ignored: resumable uploads can't copy ranges */, 
+  const string & /* ignored */,
+  const upload_journal::source * /* ignored: only aws uploads are journaled */)
 {
   typedef parallel_work_queue<upload_range> multipart_upload;
 
+  if (config::get_gs_parallel_composite_uploads() && size > get_component_size(size))
+    return upload_composite(url, size, on_read, returned_etag);
+
   string location;
   const size_t num_parts = (size + _upload_chunk_size - 1) / _upload_chunk_size;
   vector<upload_range> parts(num_parts);
@@ -110,6 +159,8 @@ int file_transfer::upload_multi(const string &url, size_t size, const read_chunk
     -1, // default max_retries
     1)); // only one part at a time
 
+  upload->set_direction(transfer_scheduler::TD_UPLOAD);
+
   r = upload->process();
 
   if (r)
@@ -222,3 +273,173 @@ int file_transfer::upload_multi_init(const request::ptr &req, const string &url,
 
   return 0;
 }
+
+size_t file_transfer::get_component_size(size_t total_size)
+{
+  size_t component_size = config::get_gs_composite_component_size();
+  size_t min_size = (total_size + MAX_COMPONENTS - 1) / MAX_COMPONENTS;
+
+  if (component_size < min_size)
+    component_size = min_size;
+
+  // keep components aligned to upload chunks, since files only hash whole
+  // chunks
+  return (component_size + _upload_chunk_size - 1) / _upload_chunk_size * _upload_chunk_size;
+}
+
+int file_transfer::upload_composite(
+  const string &url,
+  size_t size,
+  const read_chunk_fn &on_read,
+  string *returned_etag)
+{
+  typedef parallel_work_queue<component> component_upload;
+
+  const string prefix = COMPONENT_PREFIX + buffer::generate(COMPONENT_ID_LEN)->to_string() + "_";
+  const size_t component_size = get_component_size(size);
+  const size_t num_components = (size + component_size - 1) / component_size;
+  vector<component> components(num_components);
+  name_list names, intermediates;
+  scoped_ptr<component_upload> upload;
+  int r;
+
+  for (size_t i = 0; i < num_components; i++) {
+    component *c = &components[i];
+
+    c->offset = i * component_size;
+    c->size = (i != num_components - 1) ? component_size : (size - component_size * i);
+    c->name = prefix + lexical_cast<string>(i);
+
+    names.push_back(c->name);
+  }
+
+  upload.reset(new component_upload(
+    components.begin(),
+    components.end(),
+    bind(&file_transfer::upload_component, this, _1, on_read, _2, false),
+    bind(&file_transfer::upload_component, this, _1, on_read, _2, true)));
+
+  upload->set_direction(transfer_scheduler::TD_UPLOAD);
+
+  r = upload->process();
+
+  if (!r)
+    r = compose_components(url, prefix, names, &intermediates, returned_etag);
+
+  // components (and anything composed from them along the way) are removed
+  // whether or not the upload worked, so that failures don't leave them
+  // around in the bucket
+  names.insert(names.end(), intermediates.begin(), intermediates.end());
+  remove_components(names);
+
+  ++s_uploads_composite;
+
+  if (r) {
+    S3_LOG(LOG_WARNING, "file_transfer::upload_composite", "failed to upload [%s]: %i\n", url.c_str(), r);
+    ++s_uploads_composite_failed;
+  }
+
+  return r;
+}
+
+int file_transfer::upload_component(
+  const request::ptr &req,
+  const read_chunk_fn &on_read,
+  component *c,
+  bool is_retry)
+{
+  read_chunk_fn read_fn(bind(&read_component, on_read, c->offset, _1, _2, _3));
+  string etag;
+
+  ++s_components;
+
+  if (is_retry)
+    ++s_components_failed;
+
+  // upload_single() checks the component's md5 against its etag
+  return upload_single(req, get_component_url(c->name), c->size, read_fn, &etag);
+}
+
+int file_transfer::compose_components(
+  const string &url,
+  const string &prefix,
+  const name_list &components,
+  name_list *intermediates,
+  string *returned_etag)
+{
+  name_list sources(components);
+
+  // compose can only take so many sources at a time, so larger sets of 
+  // components are first composed, in groups, into intermediate objects
+  for (int level = 0; sources.size() > MAX_COMPOSE_SOURCES; level++) {
+    name_list composed;
+
+    for (size_t i = 0; i < sources.size(); i += MAX_COMPOSE_SOURCES) {
+      size_t end = (i + MAX_COMPOSE_SOURCES < sources.size()) ? (i + MAX_COMPOSE_SOURCES) : sources.size();
+      string name = prefix + "l" + lexical_cast<string>(level) + "." + lexical_cast<string>(i / MAX_COMPOSE_SOURCES);
+      string etag;
+      int r;
+
+      intermediates->push_back(name);
+
+      r = pool::call(
+        threads::PR_REQ_0, 
+        bind(&file_transfer::compose, this, _1, get_component_url(name), name_list(sources.begin() + i, sources.begin() + end), &etag));
+
+      if (r)
+        return r;
+
+      composed.push_back(name);
+    }
+
+    sources.swap(composed);
+  }
+
+  return pool::call(threads::PR_REQ_0, bind(&file_transfer::compose, this, _1, url, sources, returned_etag));
+}
+
+int file_transfer::compose(
+  const request::ptr &req,
+  const string &url,
+  const name_list &sources,
+  string *returned_etag)
+{
+  string compose_request = "<ComposeRequest>";
+
+  for (name_list::const_iterator itor = sources.begin(); itor != sources.end(); ++itor)
+    compose_request += "<Component><Name>" + *itor + "</Name></Component>";
+
+  compose_request += "</ComposeRequest>";
+
+  req->init(base::HTTP_PUT);
+  req->set_url(url, "compose");
+  req->set_input_buffer(compose_request);
+
+  req->run(config::get_transfer_timeout_in_s());
+
+  if (req->get_response_code() != base::HTTP_SC_OK) {
+    S3_LOG(LOG_WARNING, "file_transfer::compose", "failed to compose [%s].\n", url.c_str());
+    return -EIO;
+  }
+
+  *returned_etag = req->get_response_header("ETag");
+
+  return 0;
+}
+
+void file_transfer::remove_components(const name_list &names)
+{
+  vector<threads::wait_async_handle::ptr> handles;
+
+  handles.reserve(names.size());
+
+  for (name_list::const_iterator itor = names.begin(); itor != names.end(); ++itor)
+    handles.push_back(pool::post(threads::PR_REQ_1, bind(&remove_object, _1, get_component_url(*itor))));
+
+  for (size_t i = 0; i < handles.size(); i++) {
+    if (handles[i]->wait()) {
+      S3_LOG(LOG_WARNING, "file_transfer::remove_components", "failed to remove component [%s].\n", names[i].c_str());
+      ++s_components_not_removed;
+    }
+  }
+}
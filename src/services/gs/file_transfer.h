@@ -23,6 +23,7 @@
 #define S3_SERVICES_GS_FILE_TRANSFER_H
 
 #include <string>
+#include <vector>
 
 #include "services/file_transfer.h"
 
@@ -40,7 +41,14 @@ namespace s3
         virtual size_t get_upload_chunk_size();
 
       protected:
-        virtual int upload_multi(const std::string &url, size_t size, const read_chunk_fn &on_read, std::string *returned_etag);
+        virtual int upload_multi(
+          const std::string &url, 
+          size_t size, 
+          const read_chunk_fn &on_read, 
+          std::string *returned_etag,
+          const is_range_modified_fn &on_is_modified,
+          const std::string &stored_etag,
+          const upload_journal::source *journal_source);
 
       private:
         struct upload_range
@@ -49,6 +57,15 @@ namespace s3
           off_t offset;
         };
 
+        struct component
+        {
+          size_t size;
+          off_t offset;
+          std::string name;
+        };
+
+        typedef std::vector<std::string> name_list;
+
         int read_and_upload(
           const base::request::ptr &req,
           const std::string &url,
@@ -76,6 +93,35 @@ namespace s3
           const std::string &url, 
           std::string *location);
 
+        size_t get_component_size(size_t total_size);
+
+        int upload_composite(
+          const std::string &url,
+          size_t size,
+          const read_chunk_fn &on_read,
+          std::string *returned_etag);
+
+        int upload_component(
+          const base::request::ptr &req,
+          const read_chunk_fn &on_read,
+          component *c,
+          bool is_retry);
+
+        int compose_components(
+          const std::string &url,
+          const std::string &prefix,
+          const name_list &components,
+          name_list *intermediates,
+          std::string *returned_etag);
+
+        int compose(
+          const base::request::ptr &req,
+          const std::string &url,
+          const name_list &sources,
+          std::string *returned_etag);
+
+        void remove_components(const name_list &names);
+
         size_t _upload_chunk_size;
       };
     }
@@ -0,0 +1,175 @@
+#include <errno.h>
+
+#include <vector>
+#include <boost/bind.hpp>
+#include <gtest/gtest.h>
+
+#include "services/chunk_sink.h"
+
+using std::vector;
+
+using s3::services::chunk_sink;
+
+namespace
+{
+  const off_t RANGE_OFFSET = 1000;
+  const size_t RANGE_SIZE = 2 * chunk_sink::CHUNK_SIZE + chunk_sink::CHUNK_SIZE / 2;
+
+  struct written
+  {
+    vector<char> data;
+    vector<off_t> offsets;
+  };
+
+  int record(written *w, const char *data, size_t size, off_t offset)
+  {
+    EXPECT_EQ(RANGE_OFFSET + static_cast<off_t>(w->data.size()), offset);
+
+    w->data.insert(w->data.end(), data, data + size);
+    w->offsets.push_back(offset);
+
+    return 0;
+  }
+
+  int fail_write(const char *data, size_t size, off_t offset)
+  {
+    return -ENOSPC;
+  }
+
+  void fill_body(vector<char> *body)
+  {
+    body->resize(RANGE_SIZE);
+
+    for (size_t i = 0; i < RANGE_SIZE; i++)
+      (*body)[i] = static_cast<char>(i * 7 + i / 251);
+  }
+
+  // delivers body[from, to) to the sink in pieces of piece_size, as a 
+  // request that started at request_offset would
+  int deliver(chunk_sink *sink, const vector<char> &body, size_t request_offset, size_t from, size_t to, size_t piece_size)
+  {
+    for (size_t pos = from; pos < to; pos += piece_size) {
+      size_t size = (to - pos < piece_size) ? to - pos : piece_size;
+      int r = sink->write(request_offset, &body[pos], size, pos - request_offset);
+
+      if (r)
+        return r;
+    }
+
+    return 0;
+  }
+}
+
+TEST(chunk_sink, whole_chunks)
+{
+  written w;
+  vector<char> body;
+  chunk_sink sink(boost::bind(&record, &w, _1, _2, _3), RANGE_OFFSET, RANGE_SIZE);
+
+  fill_body(&body);
+
+  ASSERT_EQ(0, deliver(&sink, body, 0, 0, RANGE_SIZE, 1000));
+  ASSERT_EQ(0, sink.finish());
+
+  ASSERT_EQ(3u, w.offsets.size());
+  EXPECT_EQ(RANGE_OFFSET + static_cast<off_t>(chunk_sink::CHUNK_SIZE), w.offsets[1]);
+  EXPECT_TRUE(w.data == body);
+}
+
+TEST(chunk_sink, ignores_past_range)
+{
+  written w;
+  vector<char> body;
+  chunk_sink sink(boost::bind(&record, &w, _1, _2, _3), RANGE_OFFSET, RANGE_SIZE - 1);
+
+  fill_body(&body);
+
+  // ranges are inclusive, so services send one byte more than we want
+  ASSERT_EQ(0, deliver(&sink, body, 0, 0, RANGE_SIZE, chunk_sink::CHUNK_SIZE));
+  ASSERT_EQ(0, sink.finish());
+
+  EXPECT_EQ(RANGE_SIZE - 1, w.data.size());
+}
+
+TEST(chunk_sink, overlapping_requests_write_once)
+{
+  written w;
+  vector<char> body;
+  chunk_sink sink(boost::bind(&record, &w, _1, _2, _3), RANGE_OFFSET, RANGE_SIZE);
+
+  fill_body(&body);
+
+  // a hedge that starts from the beginning repeats what the first request
+  // already delivered, and only what's new is written
+  ASSERT_EQ(0, deliver(&sink, body, 0, 0, RANGE_SIZE / 2, 3000));
+  ASSERT_EQ(0, deliver(&sink, body, 0, 0, RANGE_SIZE / 3, 5000));
+  ASSERT_EQ(0, deliver(&sink, body, 0, RANGE_SIZE / 3, RANGE_SIZE, 7000));
+  ASSERT_EQ(0, deliver(&sink, body, 0, RANGE_SIZE / 2, RANGE_SIZE, 3000));
+  ASSERT_EQ(0, sink.finish());
+
+  EXPECT_TRUE(w.data == body);
+}
+
+TEST(chunk_sink, retry_from_received_offset)
+{
+  written w;
+  vector<char> body;
+  chunk_sink sink(boost::bind(&record, &w, _1, _2, _3), RANGE_OFFSET, RANGE_SIZE);
+  size_t received;
+
+  fill_body(&body);
+
+  // the first attempt fails part-way through a chunk
+  ASSERT_EQ(0, deliver(&sink, body, 0, 0, chunk_sink::CHUNK_SIZE + 12345, 4096));
+
+  received = sink.get_received();
+  EXPECT_EQ(chunk_sink::CHUNK_SIZE + 12345, received);
+
+  // the retry asks for the rest, so its body starts at received
+  ASSERT_EQ(0, deliver(&sink, body, received, received, RANGE_SIZE, 4096));
+  ASSERT_EQ(0, sink.finish());
+
+  EXPECT_EQ(RANGE_SIZE, sink.get_received());
+  EXPECT_TRUE(w.data == body);
+}
+
+TEST(chunk_sink, gap_fails)
+{
+  written w;
+  vector<char> body;
+  chunk_sink sink(boost::bind(&record, &w, _1, _2, _3), RANGE_OFFSET, RANGE_SIZE);
+
+  fill_body(&body);
+
+  EXPECT_EQ(-EIO, deliver(&sink, body, 100, 100, RANGE_SIZE, 4096));
+  EXPECT_EQ(0u, sink.get_received());
+}
+
+TEST(chunk_sink, canceled_after_finish)
+{
+  written w;
+  vector<char> body;
+  chunk_sink sink(boost::bind(&record, &w, _1, _2, _3), RANGE_OFFSET, RANGE_SIZE);
+
+  fill_body(&body);
+
+  ASSERT_EQ(0, deliver(&sink, body, 0, 0, RANGE_SIZE, chunk_sink::CHUNK_SIZE));
+  ASSERT_EQ(0, sink.finish());
+
+  // the losing request of a hedged pair is told to stop
+  EXPECT_EQ(-ECANCELED, deliver(&sink, body, 0, 0, 100, 100));
+  EXPECT_EQ(RANGE_SIZE, w.data.size());
+}
+
+TEST(chunk_sink, write_errors_are_returned)
+{
+  vector<char> body;
+  chunk_sink sink(boost::bind(&fail_write, _1, _2, _3), RANGE_OFFSET, RANGE_SIZE);
+
+  fill_body(&body);
+
+  // the chunk that couldn't be written is held, but nothing after it is
+  // taken
+  EXPECT_EQ(-ENOSPC, deliver(&sink, body, 0, 0, RANGE_SIZE, 4096));
+  EXPECT_EQ(static_cast<size_t>(chunk_sink::CHUNK_SIZE), sink.get_received());
+}
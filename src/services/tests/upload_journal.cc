@@ -0,0 +1,336 @@
+#include <dirent.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "base/config.h"
+#include "services/upload_journal.h"
+
+using std::ofstream;
+using std::string;
+using std::vector;
+
+using s3::base::config;
+using s3::services::upload_journal;
+
+namespace
+{
+  const char *CONFIG_FILE = "/tmp/s3fuse.test-upload_journal";
+  const char *JOURNAL_DIR = "/tmp/s3fuse.test-upload_journal.d";
+
+  const size_t PART_SIZE = 1024;
+  const size_t UPLOAD_SIZE = 3 * PART_SIZE - 100;
+
+  class journal_environment : public testing::Environment
+  {
+  public:
+    virtual void SetUp()
+    {
+      ofstream f(CONFIG_FILE, ofstream::out | ofstream::trunc);
+
+      f <<
+        "bucket_name=test\n"
+        "service=aws\n"
+        "upload_journal_dir=" << JOURNAL_DIR << "\n";
+
+      f.close();
+
+      config::init(CONFIG_FILE);
+      unlink(CONFIG_FILE);
+    }
+
+    virtual void TearDown()
+    {
+      remove_all();
+      rmdir(JOURNAL_DIR);
+    }
+
+    static void remove_all()
+    {
+      DIR *dir = opendir(JOURNAL_DIR);
+      struct dirent *de;
+
+      if (!dir)
+        return;
+
+      while ((de = readdir(dir)))
+        if (de->d_name[0] != '.')
+          unlink((string(JOURNAL_DIR) + "/" + de->d_name).c_str());
+
+      closedir(dir);
+    }
+  };
+
+  testing::Environment *s_environment = testing::AddGlobalTestEnvironment(new journal_environment());
+
+  // starts each test with an empty journal
+  void reset()
+  {
+    upload_journal::entry_list leftovers;
+
+    journal_environment::remove_all();
+
+    upload_journal::init();
+    upload_journal::take_interrupted(&leftovers);
+  }
+
+  // what the next mount would find
+  void remount(upload_journal::entry_list *entries)
+  {
+    upload_journal::init();
+    upload_journal::take_interrupted(entries);
+  }
+
+  bool exists(const string &path)
+  {
+    return access(path.c_str(), F_OK) == 0;
+  }
+
+  vector<string> list_entries()
+  {
+    vector<string> names;
+    DIR *dir = opendir(JOURNAL_DIR);
+    struct dirent *de;
+
+    if (!dir)
+      return names;
+
+    while ((de = readdir(dir)))
+      if (strncmp(de->d_name, "upload.", 7) == 0)
+        names.push_back(string(JOURNAL_DIR) + "/" + de->d_name);
+
+    closedir(dir);
+
+    return names;
+  }
+
+  void append(const string &path, const string &text)
+  {
+    ofstream f(path.c_str(), ofstream::out | ofstream::app);
+
+    f << text;
+  }
+
+  upload_journal::source make_source()
+  {
+    upload_journal::source src;
+    int fd;
+
+    fd = upload_journal::create_local_file(&src.local_path);
+
+    EXPECT_NE(-1, fd);
+    EXPECT_EQ(0, ftruncate(fd, UPLOAD_SIZE));
+
+    close(fd);
+
+    src.headers["Content-Type"] = "text/plain";
+    src.headers["x-amz-meta-s3fuse-mode"] = "0644";
+
+    return src;
+  }
+}
+
+TEST(upload_journal, entries_survive_remount)
+{
+  upload_journal::source src;
+  upload_journal::entry::ptr e;
+  upload_journal::entry_list found;
+
+  reset();
+
+  ASSERT_TRUE(upload_journal::is_enabled());
+
+  src = make_source();
+  e = upload_journal::begin("/bucket/object", "upload-id-1", UPLOAD_SIZE, PART_SIZE, src);
+
+  ASSERT_TRUE(e.get());
+
+  upload_journal::record_part(e, 0, "\"etag-0\"");
+  upload_journal::record_part(e, 2, "\"etag-2\"");
+
+  remount(&found);
+
+  ASSERT_EQ(1u, found.size());
+  EXPECT_EQ("/bucket/object", found[0]->url);
+  EXPECT_EQ("upload-id-1", found[0]->upload_id);
+  EXPECT_EQ(UPLOAD_SIZE, found[0]->size);
+  EXPECT_EQ(PART_SIZE, found[0]->part_size);
+  EXPECT_EQ(src.local_path, found[0]->src.local_path);
+  EXPECT_TRUE(src.headers == found[0]->src.headers);
+
+  ASSERT_EQ(3u, found[0]->etags.size());
+  EXPECT_EQ("\"etag-0\"", found[0]->etags[0]);
+  EXPECT_EQ("", found[0]->etags[1]);
+  EXPECT_EQ("\"etag-2\"", found[0]->etags[2]);
+
+  // and once it's handed over, it's not handed over again
+  found.clear();
+  upload_journal::take_interrupted(&found);
+
+  EXPECT_TRUE(found.empty());
+}
+
+TEST(upload_journal, restart_clears_parts)
+{
+  upload_journal::entry::ptr e;
+  upload_journal::entry_list found;
+
+  reset();
+
+  e = upload_journal::begin("/bucket/object", "upload-id-1", UPLOAD_SIZE, PART_SIZE, make_source());
+
+  ASSERT_TRUE(e.get());
+
+  upload_journal::record_part(e, 0, "\"etag-0\"");
+
+  ASSERT_TRUE(upload_journal::restart(e, "upload-id-2"));
+
+  upload_journal::record_part(e, 1, "\"etag-1\"");
+
+  remount(&found);
+
+  ASSERT_EQ(1u, found.size());
+  EXPECT_EQ("upload-id-2", found[0]->upload_id);
+  EXPECT_EQ("", found[0]->etags[0]);
+  EXPECT_EQ("\"etag-1\"", found[0]->etags[1]);
+}
+
+TEST(upload_journal, end_removes_entry)
+{
+  upload_journal::source src;
+  upload_journal::entry::ptr e;
+  upload_journal::entry_list found;
+
+  reset();
+
+  src = make_source();
+  e = upload_journal::begin("/bucket/object", "upload-id-1", UPLOAD_SIZE, PART_SIZE, src);
+
+  ASSERT_TRUE(e.get());
+
+  upload_journal::end(e, true);
+
+  EXPECT_TRUE(list_entries().empty());
+  EXPECT_FALSE(exists(src.local_path));
+
+  remount(&found);
+
+  EXPECT_TRUE(found.empty());
+}
+
+TEST(upload_journal, torn_last_line_is_ignored)
+{
+  upload_journal::entry::ptr e;
+  upload_journal::entry_list found;
+  vector<string> entries;
+
+  reset();
+
+  e = upload_journal::begin("/bucket/object", "upload-id-1", UPLOAD_SIZE, PART_SIZE, make_source());
+
+  ASSERT_TRUE(e.get());
+
+  upload_journal::record_part(e, 0, "\"etag-0\"");
+
+  entries = list_entries();
+
+  ASSERT_EQ(1u, entries.size());
+
+  // as if we'd crashed halfway through recording part 1
+  append(entries[0], "part 1 \"eta");
+
+  remount(&found);
+
+  ASSERT_EQ(1u, found.size());
+  EXPECT_EQ("\"etag-0\"", found[0]->etags[0]);
+  EXPECT_EQ("", found[0]->etags[1]);
+
+  // the entry is still usable
+  upload_journal::record_part(found[0], 1, "\"etag-1\"");
+
+  found.clear();
+  remount(&found);
+
+  ASSERT_EQ(1u, found.size());
+  EXPECT_EQ("\"etag-0\"", found[0]->etags[0]);
+  EXPECT_EQ("\"etag-1\"", found[0]->etags[1]);
+}
+
+TEST(upload_journal, corrupt_entries_are_discarded)
+{
+  upload_journal::entry::ptr e;
+  upload_journal::entry_list found;
+  string garbage = string(JOURNAL_DIR) + "/upload.garbage";
+  string bad_size = string(JOURNAL_DIR) + "/upload.bad_size";
+  string temp = string(JOURNAL_DIR) + "/upload.temp.tmp";
+
+  reset();
+
+  e = upload_journal::begin("/bucket/object", "upload-id-1", UPLOAD_SIZE, PART_SIZE, make_source());
+
+  ASSERT_TRUE(e.get());
+
+  append(garbage, "this isn't a journal entry\n");
+  append(bad_size,
+    "url /bucket/other\n"
+    "upload_id upload-id-2\n"
+    "local_path /tmp/nowhere\n"
+    "size lots\n"
+    "part_size 1024\n");
+  append(temp, "url /bucket/partial\n");
+
+  remount(&found);
+
+  ASSERT_EQ(1u, found.size());
+  EXPECT_EQ("/bucket/object", found[0]->url);
+
+  EXPECT_FALSE(exists(garbage));
+  EXPECT_FALSE(exists(bad_size));
+  EXPECT_FALSE(exists(temp));
+}
+
+TEST(upload_journal, missing_local_file)
+{
+  upload_journal::source src;
+  upload_journal::entry::ptr e;
+  upload_journal::entry_list found;
+  string stray;
+  int fd;
+
+  reset();
+
+  src = make_source();
+  e = upload_journal::begin("/bucket/object", "upload-id-1", UPLOAD_SIZE, PART_SIZE, src);
+
+  ASSERT_TRUE(e.get());
+
+  unlink(src.local_path.c_str());
+
+  // nothing refers to this one, so the next mount removes it
+  fd = upload_journal::create_local_file(&stray);
+
+  ASSERT_NE(-1, fd);
+  close(fd);
+
+  // beginning an upload without a local copy fails
+  src.local_path = string(JOURNAL_DIR) + "/local.missing";
+
+  EXPECT_FALSE(upload_journal::begin("/bucket/other", "upload-id-2", UPLOAD_SIZE, PART_SIZE, src).get());
+
+  remount(&found);
+
+  EXPECT_FALSE(exists(stray));
+
+  // the entry is still handed over, since the upload it names has to be
+  // aborted, and ending it doesn't need the local copy
+  ASSERT_EQ(1u, found.size());
+  EXPECT_FALSE(exists(found[0]->src.local_path));
+
+  upload_journal::end(found[0], true);
+
+  EXPECT_TRUE(list_entries().empty());
+}
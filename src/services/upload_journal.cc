@@ -0,0 +1,493 @@
+/*
+ * services/upload_journal.cc
+ * -------------------------------------------------------------------------
+ * On-disk record of multipart uploads in progress (implementation).
+ * -------------------------------------------------------------------------
+ * 
+ * Copyright (c) 2013, Tarick Bedeir.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <boost/lexical_cast.hpp>
+#include <boost/detail/atomic_count.hpp>
+#include <boost/thread.hpp>
+
+#include "base/config.h"
+#include "base/logger.h"
+#include "base/paths.h"
+#include "base/statistics.h"
+#include "services/upload_journal.h"
+
+using boost::lexical_cast;
+using boost::mutex;
+using boost::detail::atomic_count;
+using std::ostream;
+using std::ostringstream;
+using std::runtime_error;
+using std::set;
+using std::string;
+using std::vector;
+
+using s3::base::config;
+using s3::base::header_map;
+using s3::base::paths;
+using s3::base::statistics;
+using s3::services::upload_journal;
+
+namespace
+{
+  const char *ENTRY_PREFIX = "upload.";
+  const char *LOCAL_FILE_PREFIX = "local.";
+  const char *TEMP_SUFFIX = ".tmp";
+
+  // protected by s_mutex
+  mutex s_mutex;
+  upload_journal::entry_list s_interrupted;
+
+  bool s_enabled = false;
+  string s_dir;
+
+  atomic_count s_next_id(0);
+  atomic_count s_uploads(0), s_parts(0), s_failures(0), s_interrupted_found(0);
+
+  void statistics_writer(ostream *o)
+  {
+    if (!s_enabled)
+      return;
+
+    *o <<
+      "upload journal:\n"
+      "  uploads journaled: " << s_uploads << ", parts recorded: " << s_parts << ", failures: " << s_failures << "\n"
+      "  interrupted uploads found: " << s_interrupted_found << "\n";
+  }
+
+  statistics::writers::entry s_writer(statistics_writer, 0);
+
+  inline string build_path(const string &name)
+  {
+    return s_dir + "/" + name;
+  }
+
+  inline bool has_prefix(const string &s, const char *prefix)
+  {
+    return s.compare(0, strlen(prefix), prefix) == 0;
+  }
+
+  bool write_all(int fd, const char *buffer, size_t size)
+  {
+    while (size) {
+      ssize_t r = write(fd, buffer, size);
+
+      if (r == -1) {
+        if (errno == EINTR)
+          continue;
+
+        return false;
+      }
+
+      buffer += r;
+      size -= r;
+    }
+
+    return true;
+  }
+
+  bool read_all(const string &path, string *contents)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    char buffer[4096];
+    ssize_t r;
+
+    if (fd == -1)
+      return false;
+
+    while ((r = read(fd, buffer, sizeof(buffer))) != 0) {
+      if (r == -1) {
+        if (errno == EINTR)
+          continue;
+
+        close(fd);
+        return false;
+      }
+
+      contents->append(buffer, r);
+    }
+
+    close(fd);
+    return true;
+  }
+
+  // entries are line-oriented, so nothing in them can contain a newline
+  bool is_writable(const string &url, const string &upload_id, const upload_journal::source &src)
+  {
+    if (url.find('\n') != string::npos || upload_id.find('\n') != string::npos || src.local_path.find('\n') != string::npos)
+      return false;
+
+    for (header_map::const_iterator itor = src.headers.begin(); itor != src.headers.end(); ++itor)
+      if (itor->first.find_first_of(" \n") != string::npos || itor->second.find('\n') != string::npos)
+        return false;
+
+    return true;
+  }
+
+  string serialize(const upload_journal::entry &e)
+  {
+    ostringstream s;
+
+    s <<
+      "url " << e.url << "\n"
+      "upload_id " << e.upload_id << "\n"
+      "local_path " << e.src.local_path << "\n"
+      "size " << e.size << "\n"
+      "part_size " << e.part_size << "\n";
+
+    for (header_map::const_iterator itor = e.src.headers.begin(); itor != e.src.headers.end(); ++itor)
+      s << "header " << itor->first << " " << itor->second << "\n";
+
+    return s.str();
+  }
+
+  // parts are appended one line at a time, so a crash can leave the last
+  // line incomplete -- we just ignore it (and send the part again)
+  bool parse(const string &contents, upload_journal::entry *e)
+  {
+    size_t begin = 0, end, num_parts;
+    vector<string> parts;
+
+    while ((end = contents.find('\n', begin)) != string::npos) {
+      string line = contents.substr(begin, end - begin);
+      size_t space = line.find(' ');
+      string key, value;
+
+      begin = end + 1;
+
+      if (space == string::npos)
+        return false;
+
+      key = line.substr(0, space);
+      value = line.substr(space + 1);
+
+      try {
+        if (key == "url")
+          e->url = value;
+        else if (key == "upload_id")
+          e->upload_id = value;
+        else if (key == "local_path")
+          e->src.local_path = value;
+        else if (key == "size")
+          e->size = lexical_cast<size_t>(value);
+        else if (key == "part_size")
+          e->part_size = lexical_cast<size_t>(value);
+        else if (key == "header" && (space = value.find(' ')) != string::npos)
+          e->src.headers[value.substr(0, space)] = value.substr(space + 1);
+        else if (key == "part")
+          parts.push_back(value);
+        else
+          return false;
+
+      } catch (const boost::bad_lexical_cast &) {
+        return false;
+      }
+    }
+
+    if (e->url.empty() || e->upload_id.empty() || e->src.local_path.empty() || e->size == 0 || e->part_size == 0)
+      return false;
+
+    num_parts = (e->size + e->part_size - 1) / e->part_size;
+    e->etags.resize(num_parts);
+
+    for (size_t i = 0; i < parts.size(); i++) {
+      size_t space = parts[i].find(' ');
+      size_t index = strtoul(parts[i].c_str(), NULL, 10);
+
+      if (space != string::npos && index < num_parts)
+        e->etags[index] = parts[i].substr(space + 1);
+    }
+
+    return true;
+  }
+
+  // writes the entry to a temporary file and renames it into place so that
+  // a crash never leaves a partial header, then opens it for appending
+  bool write_entry(upload_journal::entry *e, const string &name, int *fd)
+  {
+    string path = build_path(name);
+    string temp_path = path + TEMP_SUFFIX;
+    string contents = serialize(*e);
+    int temp_fd;
+    bool ok;
+
+    temp_fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+    if (temp_fd == -1)
+      return false;
+
+    ok = write_all(temp_fd, contents.c_str(), contents.size()) && fsync(temp_fd) == 0;
+
+    close(temp_fd);
+
+    if (!ok || rename(temp_path.c_str(), path.c_str())) {
+      unlink(temp_path.c_str());
+      return false;
+    }
+
+    *fd = open(path.c_str(), O_WRONLY | O_APPEND);
+
+    return *fd != -1;
+  }
+}
+
+upload_journal::entry::entry()
+  : size(0),
+    part_size(0),
+    _fd(-1)
+{
+}
+
+upload_journal::entry::~entry()
+{
+  if (_fd != -1)
+    close(_fd);
+}
+
+void upload_journal::init()
+{
+  mutex::scoped_lock lock(s_mutex);
+  vector<string> entry_names, local_names;
+  set<string> referenced;
+  DIR *dir;
+  struct dirent *de;
+
+  if (config::get_upload_journal_dir().empty())
+    return;
+
+  s_dir = paths::transform(config::get_upload_journal_dir());
+
+  if (mkdir(s_dir.c_str(), S_IRWXU) && errno != EEXIST) {
+    S3_LOG(LOG_ERR, "upload_journal::init", "failed to create upload journal directory [%s]: %s\n", s_dir.c_str(), strerror(errno));
+    throw runtime_error("failed to create upload journal directory");
+  }
+
+  dir = opendir(s_dir.c_str());
+
+  if (!dir) {
+    S3_LOG(LOG_ERR, "upload_journal::init", "failed to open upload journal directory [%s]: %s\n", s_dir.c_str(), strerror(errno));
+    throw runtime_error("failed to open upload journal directory");
+  }
+
+  while ((de = readdir(dir))) {
+    string name = de->d_name;
+
+    // temporary files are left behind if we crashed mid-write
+    if (name.find(TEMP_SUFFIX) != string::npos)
+      unlink(build_path(name).c_str());
+    else if (has_prefix(name, ENTRY_PREFIX))
+      entry_names.push_back(name);
+    else if (has_prefix(name, LOCAL_FILE_PREFIX))
+      local_names.push_back(name);
+  }
+
+  closedir(dir);
+
+  for (size_t i = 0; i < entry_names.size(); i++) {
+    entry::ptr e(new entry());
+    string contents;
+
+    e->_name = entry_names[i];
+
+    if (!read_all(build_path(e->_name), &contents) || !parse(contents, e.get())) {
+      S3_LOG(LOG_WARNING, "upload_journal::init", "discarding unreadable journal entry [%s].\n", e->_name.c_str());
+
+      unlink(build_path(e->_name).c_str());
+      continue;
+    }
+
+    // parts recorded when the upload resumes are appended, so they mustn't
+    // land on the end of a torn line
+    if (contents[contents.size() - 1] != '\n' && truncate(build_path(e->_name).c_str(), contents.rfind('\n') + 1)) {
+      S3_LOG(LOG_WARNING, "upload_journal::init", "failed to truncate journal entry [%s]: %s\n", e->_name.c_str(), strerror(errno));
+      continue;
+    }
+
+    e->_fd = open(build_path(e->_name).c_str(), O_WRONLY | O_APPEND);
+
+    if (e->_fd == -1) {
+      S3_LOG(LOG_WARNING, "upload_journal::init", "failed to open journal entry [%s]: %s\n", e->_name.c_str(), strerror(errno));
+      continue;
+    }
+
+    ++s_interrupted_found;
+    s_interrupted.push_back(e);
+    referenced.insert(e->src.local_path);
+  }
+
+  // everything else is the local copy of a file that was open when we
+  // stopped, but that had nothing to upload
+  for (size_t i = 0; i < local_names.size(); i++) {
+    string path = build_path(local_names[i]);
+
+    if (referenced.find(path) == referenced.end())
+      unlink(path.c_str());
+  }
+
+  s_enabled = true;
+
+  S3_LOG(
+    LOG_DEBUG,
+    "upload_journal::init",
+    "using [%s], found %zu interrupted uploads.\n",
+    s_dir.c_str(),
+    s_interrupted.size());
+}
+
+bool upload_journal::is_enabled()
+{
+  return s_enabled;
+}
+
+int upload_journal::create_local_file(string *path)
+{
+  string name_template = build_path(string(LOCAL_FILE_PREFIX) + "XXXXXX");
+  vector<char> name(name_template.begin(), name_template.end());
+  int fd;
+
+  name.push_back('\0');
+
+  fd = mkstemp(&name[0]);
+
+  if (fd != -1)
+    *path = &name[0];
+
+  return fd;
+}
+
+upload_journal::entry::ptr upload_journal::begin(
+  const string &url,
+  const string &upload_id,
+  size_t size,
+  size_t part_size,
+  const source &src)
+{
+  entry::ptr e(new entry());
+  ostringstream name;
+  int fd;
+
+  if (!is_writable(url, upload_id, src)) {
+    ++s_failures;
+    return entry::ptr();
+  }
+
+  // nothing in the journal is any use if the data it refers to doesn't
+  // survive the crash too
+  fd = open(src.local_path.c_str(), O_RDONLY);
+
+  if (fd == -1 || fsync(fd)) {
+    S3_LOG(LOG_WARNING, "upload_journal::begin", "failed to sync [%s]: %s\n", src.local_path.c_str(), strerror(errno));
+
+    if (fd != -1)
+      close(fd);
+
+    ++s_failures;
+    return entry::ptr();
+  }
+
+  close(fd);
+
+  e->url = url;
+  e->upload_id = upload_id;
+  e->size = size;
+  e->part_size = part_size;
+  e->src = src;
+
+  name << ENTRY_PREFIX << time(NULL) << "." << getpid() << "." << ++s_next_id;
+
+  e->_name = name.str();
+
+  if (!write_entry(e.get(), e->_name, &e->_fd)) {
+    S3_LOG(LOG_WARNING, "upload_journal::begin", "failed to write journal entry for [%s]: %s\n", url.c_str(), strerror(errno));
+
+    ++s_failures;
+    return entry::ptr();
+  }
+
+  ++s_uploads;
+
+  return e;
+}
+
+void upload_journal::record_part(const entry::ptr &e, size_t index, const string &etag)
+{
+  string line = string("part ") + lexical_cast<string>(index) + " " + etag + "\n";
+
+  // O_APPEND keeps lines written by parts finishing at the same time from
+  // interleaving
+  if (!write_all(e->_fd, line.c_str(), line.size()) || fdatasync(e->_fd)) {
+    ++s_failures;
+    return;
+  }
+
+  ++s_parts;
+}
+
+bool upload_journal::restart(const entry::ptr &e, const string &upload_id)
+{
+  if (e->_fd != -1) {
+    close(e->_fd);
+    e->_fd = -1;
+  }
+
+  e->upload_id = upload_id;
+  e->etags.assign(e->etags.size(), string());
+
+  if (!write_entry(e.get(), e->_name, &e->_fd)) {
+    ++s_failures;
+    return false;
+  }
+
+  return true;
+}
+
+void upload_journal::end(const entry::ptr &e, bool remove_local_file)
+{
+  if (e->_fd != -1) {
+    close(e->_fd);
+    e->_fd = -1;
+  }
+
+  unlink(build_path(e->_name).c_str());
+
+  if (remove_local_file)
+    unlink(e->src.local_path.c_str());
+}
+
+void upload_journal::take_interrupted(entry_list *entries)
+{
+  mutex::scoped_lock lock(s_mutex);
+
+  entries->swap(s_interrupted);
+  s_interrupted.clear();
+}
@@ -0,0 +1,115 @@
+/*
+ * services/upload_journal.h
+ * -------------------------------------------------------------------------
+ * On-disk record of multipart uploads in progress.
+ * -------------------------------------------------------------------------
+ * 
+ * Copyright (c) 2013, Tarick Bedeir.
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef S3_SERVICES_UPLOAD_JOURNAL_H
+#define S3_SERVICES_UPLOAD_JOURNAL_H
+
+#include <string>
+#include <vector>
+#include <boost/smart_ptr.hpp>
+#include <boost/utility.hpp>
+
+#include "base/request.h"
+
+namespace s3
+{
+  namespace services
+  {
+    // each multipart upload gets a file in upload_journal_dir naming the
+    // upload and the local copy being uploaded, to which the etag of each
+    // part is appended as it's sent. local copies are kept in the same
+    // directory (rather than unlinked as soon as they're created) so that
+    // if we die mid-upload, the next mount can send whatever's missing and
+    // complete the upload.
+    class upload_journal
+    {
+    public:
+      // what an upload needs, besides the object's data, to be completed
+      // without the object that started it
+      struct source
+      {
+        std::string local_path;
+
+        // sent when the upload is initiated, so that a completed upload
+        // carries the object's metadata even if we don't get to commit it
+        base::header_map headers;
+      };
+
+      class entry : boost::noncopyable
+      {
+      public:
+        typedef boost::shared_ptr<entry> ptr;
+
+        ~entry();
+
+        std::string url, upload_id;
+        size_t size, part_size;
+        source src;
+
+        // indexed by part, and empty for parts not known to have been sent.
+        // only filled in for entries found by init().
+        std::vector<std::string> etags;
+
+      private:
+        friend class upload_journal;
+
+        entry();
+
+        std::string _name;
+        int _fd;
+      };
+
+      typedef std::vector<entry::ptr> entry_list;
+
+      // reads entries left behind by an earlier mount, and removes local
+      // copies that none of them refer to
+      static void init();
+
+      static bool is_enabled();
+
+      // like mkstemp(), but in upload_journal_dir
+      static int create_local_file(std::string *path);
+
+      // returns an empty pointer if the entry couldn't be written, in which
+      // case the upload should go ahead without it
+      static entry::ptr begin(
+        const std::string &url,
+        const std::string &upload_id,
+        size_t size,
+        size_t part_size,
+        const source &src);
+
+      static void record_part(const entry::ptr &e, size_t index, const std::string &etag);
+
+      // points e at a new upload of the same data, with no parts sent
+      static bool restart(const entry::ptr &e, const std::string &upload_id);
+
+      // removes e from the journal, along with its local copy if
+      // remove_local_file is set
+      static void end(const entry::ptr &e, bool remove_local_file);
+
+      // hands over (once) the entries that init() found
+      static void take_interrupted(entry_list *entries);
+    };
+  }
+}
+
+#endif
@@ -27,6 +27,7 @@
 #include <sys/stat.h>
 
 #include <iostream>
+#include <vector>
 
 #include "crypto/hash_list.h"
 #include "crypto/hex.h"
@@ -36,6 +37,7 @@ using std::cerr;
 using std::cout;
 using std::endl;
 using std::runtime_error;
+using std::vector;
 
 using s3::crypto::hash_list;
 using s3::crypto::hex;
@@ -44,6 +46,9 @@ using s3::crypto::sha256;
 namespace
 {
   typedef hash_list<sha256> sha256_hash;
+
+  // read this many chunks at a time, and hash them in parallel
+  const size_t CHUNKS_PER_READ = 128;
 }
 
 int main(int argc, char **argv)
@@ -76,20 +81,21 @@ int main(int argc, char **argv)
   try {
     off_t offset = 0;
     size_t remaining = s.st_size;
-    uint8_t buffer[sha256_hash::CHUNK_SIZE];
+    const size_t read_size = CHUNKS_PER_READ * sha256_hash::CHUNK_SIZE;
+    vector<uint8_t> buffer(read_size);
 
     hash.reset(new sha256_hash(remaining));
 
     while (remaining) {
-      size_t this_chunk = (remaining > sha256_hash::CHUNK_SIZE) ? sha256_hash::CHUNK_SIZE : remaining;
+      size_t this_read = (remaining > read_size) ? read_size : remaining;
 
-      if (pread(fd, buffer, this_chunk, offset) != static_cast<ssize_t>(this_chunk))
+      if (pread(fd, &buffer[0], this_read, offset) != static_cast<ssize_t>(this_read))
         throw runtime_error("pread() failed");
 
-      hash->compute_hash(offset, buffer, this_chunk);
+      hash->compute_hash_parallel(offset, &buffer[0], this_read);
 
-      remaining -= this_chunk;
-      offset += this_chunk;
+      remaining -= this_read;
+      offset += this_read;
     }
 
     cout << hash->get_root_hash<hex>() << endl;
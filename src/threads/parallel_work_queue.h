@@ -22,20 +22,24 @@
 #ifndef S3_THREADS_PARALLEL_WORK_QUEUE_H
 #define S3_THREADS_PARALLEL_WORK_QUEUE_H
 
+#include <algorithm>
+#include <deque>
 #include <iostream>
+#include <list>
 #include <vector>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
 
 #include "base/config.h"
 #include "base/logger.h"
+#include "base/request.h"
+#include "base/timer.h"
+#include "base/transfer_reactor.h"
+#include "base/transfer_scheduler.h"
 #include "threads/pool.h"
 
 namespace s3
 {
-  namespace base
-  {
-    class request;
-  }
-
   namespace threads
   {
     template <class T>
@@ -45,6 +49,18 @@ namespace s3
       typedef boost::function2<int, const boost::shared_ptr<base::request> &, T *> process_part_fn;
       typedef boost::function2<int, const boost::shared_ptr<base::request> &, T *> retry_part_fn;
 
+      // looks at the response to a request set up by process_part_fn or 
+      // retry_part_fn (see set_on_complete_part())
+      typedef boost::function2<int, const boost::shared_ptr<base::request> &, T *> complete_part_fn;
+
+      // returns the index of a part that should be posted ahead of the others
+      // (e.g., because someone is waiting on it), or -1 if there isn't one
+      typedef boost::function0<int> select_part_fn;
+
+      // returns the next part to process, or NULL if there's nothing more to
+      // do for now
+      typedef boost::function0<T *> next_part_fn;
+
       template <class iterator_type>
       inline parallel_work_queue(
         iterator_type begin,
@@ -52,9 +68,13 @@ namespace s3
         const process_part_fn &on_process_part,
         const retry_part_fn &on_retry_part,
         int max_retries = -1,
-        int max_parts_in_progress = -1)
+        int max_parts_in_progress = -1,
+        const select_part_fn &on_select_part = select_part_fn())
         : _on_process_part(on_process_part),
-          _on_retry_part(on_retry_part)
+          _on_retry_part(on_retry_part),
+          _on_select_part(on_select_part),
+          _transfer(base::transfer_scheduler::TD_DOWNLOAD),
+          _next_part(0)
       {
         size_t id = 0;
 
@@ -67,65 +87,116 @@ namespace s3
           _parts.push_back(p);
         }
 
-        _max_retries = (max_retries == -1) ? base::config::get_max_transfer_retries() : max_retries;
-        _max_parts_in_progress = (max_parts_in_progress == -1) ? base::config::get_max_parts_in_progress() : max_parts_in_progress;
+        init(max_retries, max_parts_in_progress);
       }
 
+      // parts aren't known up front, but are pulled from on_next_part as
+      // slots free up. process() returns once nothing is in progress and 
+      // on_next_part has nothing more to offer.
+      inline parallel_work_queue(
+        const next_part_fn &on_next_part,
+        const process_part_fn &on_process_part,
+        const retry_part_fn &on_retry_part,
+        int max_retries = -1,
+        int max_parts_in_progress = -1)
+        : _on_process_part(on_process_part),
+          _on_retry_part(on_retry_part),
+          _on_next_part(on_next_part),
+          _transfer(base::transfer_scheduler::TD_DOWNLOAD),
+          _next_part(0)
+      {
+        init(max_retries, max_parts_in_progress);
+      }
+
+      // rather than run their requests, on_process_part and on_retry_part
+      // only set them up. the requests then run on the transfer reactor 
+      // (see pool::post_request()), and on_complete_part gets the response.
+      inline void set_on_complete_part(const complete_part_fn &on_complete_part, int request_timeout_in_s)
+      {
+        _on_complete_part = on_complete_part;
+        _request_timeout_in_s = request_timeout_in_s;
+      }
+
+      // queues download by default. this decides which bandwidth cap
+      // applies to parts (see transfer_scheduler).
+      inline void set_direction(base::transfer_scheduler::direction d)
+      {
+        _transfer.set_direction(d);
+      }
+
+      // the most parts this queue had in progress at once
+      inline size_t get_peak_parts_in_progress() { return _peak_parts_in_progress; }
+
+      // parts for which a second request was sent, and how many of those
+      // second requests finished first
+      inline size_t get_hedged_parts() { return _hedged_parts; }
+      inline size_t get_hedges_won() { return _hedges_won; }
+
       int process()
       {
-        size_t last_part = 0;
         std::list<process_part *> parts_in_progress;
+        process_part *part = NULL;
         int r = 0;
 
-        for (last_part = 0; last_part < std::min(_max_parts_in_progress, _parts.size()); last_part++) {
-          process_part *part = &_parts[last_part];
-
-          part->handle = threads::pool::post(
-            threads::PR_REQ_1, 
-            bind(_on_process_part, _1, part->part),
-            0 /* don't retry on timeout since we handle that here */);
+        // hedging relies on being able to cancel the losing request, which
+        // we can only do on the reactor
+        _hedge = 
+          _on_complete_part && 
+          base::config::get_hedge_slow_parts() && 
+          base::transfer_reactor::is_running();
 
-          parts_in_progress.push_back(part);
-        }
+        while (post_next_part(&parts_in_progress))
+          ;
 
         while (!parts_in_progress.empty()) {
-          process_part *part = parts_in_progress.front();
           int part_r;
 
-          parts_in_progress.pop_front();
-          part_r = part->handle->wait();
+          // whichever part finishes first, rather than the oldest, so that
+          // one slow part doesn't leave the others' slots idle
+          part = wait_for_next_part(parts_in_progress);
+          part_r = part->result;
+          parts_in_progress.remove(part);
+
+          if (part->hedge_slot) {
+            _transfer.release_slot();
+            part->hedge_slot = false;
+          }
 
           if (part_r) {
             S3_LOG(LOG_DEBUG, "parallel_work_queue::process", "part %i returned status %i.\n", part->id, part_r);
 
-            if ((part_r == -EAGAIN || part_r == -ETIMEDOUT) && part->retry_count < _max_retries) {
-              part->handle = threads::pool::post(
-                threads::PR_REQ_1, 
-                bind(_on_retry_part, _1, part->part),
-                0);
+            if (part_r == -EAGAIN || part_r == -ETIMEDOUT)
+              back_off();
 
+            if ((part_r == -EAGAIN || part_r == -ETIMEDOUT) && part->retry_count < _max_retries) {
+              post_part(_on_retry_part, part);
               part->retry_count++;
 
               parts_in_progress.push_back(part);
             } else {
               if (r == 0) // only save the first non-successful return code
                 r = part_r;
+
+              _transfer.release_slot();
             }
+          } else {
+            _transfer.release_slot();
+            adapt();
           }
 
           // keep collecting parts until we have nothing left pending
           // if one part fails, keep going but stop posting new parts
 
-          if (r == 0 && last_part < _parts.size()) {
-            part = &_parts[last_part++];
+          while (r == 0 && post_next_part(&parts_in_progress))
+            ;
+        }
 
-            part->handle = threads::pool::post(
-              threads::PR_REQ_1, 
-              bind(_on_process_part, _1, part->part),
-              0);
+        // the losers of any hedging races still refer to us
+        {
+          boost::mutex::scoped_lock lock(_mutex);
 
-            parts_in_progress.push_back(part);
-          }
+          while (_attempts_in_flight)
+            _condition.wait(lock);
         }
 
         return r;
@@ -136,25 +207,468 @@ namespace s3
       {
         int id;
         int retry_count;
-        threads::wait_async_handle::ptr handle;
+        bool posted;
 
         T *part;
 
+        // protected by _mutex
+        int result;
+        double start_time;
+        bool hedged, hedge_slot, completing, succeeded, resolved;
+        int attempts_in_flight, first_error;
+        std::vector<boost::weak_ptr<base::request> > requests;
+
         inline process_part()
           : id(-1),
             retry_count(0),
-            part(NULL)
+            posted(false),
+            part(NULL),
+            result(0),
+            start_time(0.0),
+            hedged(false),
+            hedge_slot(false),
+            completing(false),
+            succeeded(false),
+            resolved(false),
+            attempts_in_flight(0),
+            first_error(0)
         {
         }
       };
 
-      std::vector<process_part> _parts;
+      inline void init(int max_retries, int max_parts_in_progress)
+      {
+        _request_timeout_in_s = base::request::DEFAULT_REQUEST_TIMEOUT;
+        _max_retries = (max_retries == -1) ? base::config::get_max_transfer_retries() : max_retries;
+        _max_parts_in_progress = (max_parts_in_progress == -1) ? base::config::get_max_parts_in_progress() : max_parts_in_progress;
+        _peak_parts_in_progress = 0;
+
+        // callers that ask for a specific number of parts get just that
+        _adaptive = (max_parts_in_progress == -1) && base::config::get_adaptive_transfers();
+        _adaptive_limit = base::config::get_max_adaptive_parts_in_progress();
+        _round_parts = 0;
+        _round_start = base::timer::get_current_time();
+        _last_round_rate = 0.0;
+
+        _hedge = false;
+        _hedged_parts = 0;
+        _hedges_won = 0;
+        _attempts_in_flight = 0;
+      }
+
+      // once per round (as many completed parts as we're allowed to have in
+      // progress), add a part in progress if that improved the rate at 
+      // which parts complete, or take one away if the rate fell
+      inline void adapt()
+      {
+        // changes in rate smaller than this are noise
+        const double ROUND_RATE_MARGIN = 1.1;
+
+        double now, rate;
+
+        if (!_adaptive || ++_round_parts < _max_parts_in_progress)
+          return;
+
+        now = base::timer::get_current_time();
+        rate = (now > _round_start) ? _round_parts / (now - _round_start) : 0.0;
+
+        if (rate > _last_round_rate * ROUND_RATE_MARGIN && _max_parts_in_progress < _adaptive_limit)
+          _max_parts_in_progress++;
+        else if (rate * ROUND_RATE_MARGIN < _last_round_rate && _max_parts_in_progress > 1)
+          _max_parts_in_progress--;
+
+        _last_round_rate = rate;
+        _round_parts = 0;
+        _round_start = now;
+      }
+
+      // timeouts mean we're asking for more than the path can take
+      inline void back_off()
+      {
+        if (!_adaptive)
+          return;
+
+        _max_parts_in_progress = (_max_parts_in_progress > 1) ? _max_parts_in_progress / 2 : 1;
+        _last_round_rate = 0.0;
+        _round_parts = 0;
+        _round_start = base::timer::get_current_time();
+      }
+
+      inline bool post_next_part(std::list<process_part *> *parts_in_progress)
+      {
+        process_part *part = NULL;
+
+        if (parts_in_progress->size() >= _max_parts_in_progress)
+          return false;
+
+        // only wait for a slot if we'd otherwise have nothing in progress --
+        // if we have parts in progress, we'll try again when one finishes
+        if (!_transfer.acquire_slot(parts_in_progress->empty()))
+          return false;
+
+        part = get_next_part();
+
+        if (!part) {
+          _transfer.release_slot();
+          return false;
+        }
+
+        _transfer.wait_for_bandwidth();
+
+        post_part(_on_process_part, part);
+        parts_in_progress->push_back(part);
+
+        if (parts_in_progress->size() > _peak_parts_in_progress)
+          _peak_parts_in_progress = parts_in_progress->size();
+
+        return true;
+      }
+
+      inline void post_part(const process_part_fn &fn, process_part *part)
+      {
+        {
+          boost::mutex::scoped_lock lock(_mutex);
+
+          part->result = 0;
+          part->start_time = base::timer::get_current_time();
+          part->hedged = false;
+          part->succeeded = false;
+          part->resolved = false;
+          part->first_error = 0;
+          part->requests.clear();
+        }
+
+        post_attempt(fn, part, false);
+      }
+
+      // a part's "attempts" are its original request and, if that takes
+      // too long, a second, hedging, request for the same part. whichever
+      // succeeds first completes the part, and the other is canceled.
+      inline void post_attempt(const process_part_fn &fn, process_part *part, bool is_hedge)
+      {
+        {
+          boost::mutex::scoped_lock lock(_mutex);
+
+          part->attempts_in_flight++;
+          _attempts_in_flight++;
+        }
+
+        // don't retry on timeout since we handle that here
+
+        if (_on_complete_part)
+          threads::pool::post_request(
+            threads::PR_REQ_1,
+            bind(&parallel_work_queue::prepare_attempt, this, fn, _1, part),
+            bind(&parallel_work_queue::complete_attempt, this, _1, part),
+            bind(&parallel_work_queue::on_attempt_done, this, part, is_hedge, _1),
+            _request_timeout_in_s,
+            0);
+        else
+          threads::pool::post(
+            threads::PR_REQ_1, 
+            bind(fn, _1, part->part),
+            bind(&parallel_work_queue::on_attempt_done, this, part, is_hedge, _1),
+            0);
+      }
+
+      int prepare_attempt(const process_part_fn &fn, const boost::shared_ptr<base::request> &req, process_part *part)
+      {
+        {
+          boost::mutex::scoped_lock lock(_mutex);
+
+          if (part->succeeded)
+            return -ECANCELED;
+
+          part->requests.push_back(req);
+        }
+
+        return fn(req, part->part);
+      }
+
+      // on_complete_part only ever sees one attempt at a time, and never 
+      // sees another once one has succeeded
+      int complete_attempt(const boost::shared_ptr<base::request> &req, process_part *part)
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+        int r;
+
+        while (part->completing)
+          _condition.wait(lock);
+
+        if (part->succeeded)
+          return -ECANCELED;
+
+        part->completing = true;
+        lock.unlock();
+
+        r = _on_complete_part(req, part->part);
+
+        lock.lock();
+        part->completing = false;
+
+        if (r == 0) {
+          part->succeeded = true;
+
+          // so that cancel_attempts() leaves this one alone
+          for (size_t i = 0; i < part->requests.size(); i++) {
+            if (part->requests[i].lock() == req) {
+              part->requests.erase(part->requests.begin() + i);
+              break;
+            }
+          }
+        }
+
+        _condition.notify_all();
+
+        return r;
+      }
+
+      void on_attempt_done(process_part *part, bool is_hedge, int r)
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+
+        part->attempts_in_flight--;
+        _attempts_in_flight--;
+
+        if (!part->resolved) {
+          if (r == 0) {
+            part->resolved = true;
+
+            if (is_hedge)
+              _hedges_won++;
+
+            add_duration(base::timer::get_current_time() - part->start_time);
+
+            if (part->hedged)
+              cancel_attempts(part);
+
+            part->result = 0;
+            _completed.push_back(part);
+
+          } else if (part->attempts_in_flight == 0) {
+            part->resolved = true;
+            part->result = part->first_error ? part->first_error : r;
+            _completed.push_back(part);
+
+          } else if (part->first_error == 0) {
+            part->first_error = r;
+          }
+        }
+
+        // process() may return (and destroy us) as soon as we let go of 
+        // _mutex, so this has to happen first
+        _condition.notify_all();
+      }
+
+      // call with _mutex held
+      inline void cancel_attempts(process_part *part)
+      {
+        for (size_t i = 0; i < part->requests.size(); i++) {
+          boost::shared_ptr<base::request> req = part->requests[i].lock();
+
+          if (req)
+            base::transfer_reactor::cancel(req);
+        }
+
+        part->requests.clear();
+      }
+
+      // call with _mutex held. we only hang on to the most recent durations,
+      // since conditions change over the course of large transfers.
+      inline void add_duration(double duration)
+      {
+        const size_t MAX_DURATIONS = 64;
+
+        _durations.push_back(duration);
+
+        if (_durations.size() > MAX_DURATIONS)
+          _durations.pop_front();
+      }
+
+      // returns how long a part can take before we hedge it, or a negative
+      // value if we haven't seen enough parts to tell
+      inline double get_hedge_threshold()
+      {
+        const size_t MIN_DURATIONS = 4;
+
+        boost::mutex::scoped_lock lock(_mutex);
+        std::vector<double> sorted;
+        size_t index;
+
+        if (_durations.size() < MIN_DURATIONS)
+          return -1.0;
+
+        sorted.assign(_durations.begin(), _durations.end());
+        std::sort(sorted.begin(), sorted.end());
+
+        index = (sorted.size() * base::config::get_hedge_percentile() + 99) / 100;
+
+        return sorted[(index > 0) ? index - 1 : 0];
+      }
+
+      // waits for any of the parts in parts_in_progress to finish, hedging 
+      // those that take longer than their siblings do
+      process_part * wait_for_next_part(const std::list<process_part *> &parts_in_progress)
+      {
+        while (true) {
+          double next_check = _hedge ? hedge_slow_parts(parts_in_progress) : -1.0;
+          boost::mutex::scoped_lock lock(_mutex);
+          process_part *part = NULL;
+
+          if (_completed.empty()) {
+            if (next_check < 0.0) {
+              while (_completed.empty())
+                _condition.wait(lock);
+            } else {
+              _condition.timed_wait(
+                lock, 
+                boost::get_system_time() + 
+                  boost::posix_time::microseconds(static_cast<int64_t>((next_check - base::timer::get_current_time()) * 1.0e6)));
+            }
+          }
+
+          if (_completed.empty())
+            continue;
+
+          part = _completed.front();
+          _completed.pop_front();
+
+          return part;
+        }
+      }
+
+      // hedges parts that are due, and returns when the next one will be 
+      // (or a negative value if none will be)
+      double hedge_slow_parts(const std::list<process_part *> &parts_in_progress)
+      {
+        // if we couldn't get a slot for a hedge, try again after this long
+        const double HEDGE_RETRY_DELAY_IN_S = 0.1;
+
+        double threshold = get_hedge_threshold();
+        double now = base::timer::get_current_time();
+        double next_check = -1.0;
+
+        if (threshold < 0.0)
+          return -1.0;
+
+        for (typename std::list<process_part *>::const_iterator itor = parts_in_progress.begin(); itor != parts_in_progress.end(); ++itor) {
+          process_part *part = *itor;
+          double due = part->start_time + threshold;
+
+          if (!should_hedge(part))
+            continue;
+
+          if (due <= now) {
+            if (hedge(part))
+              continue;
+
+            due = now + HEDGE_RETRY_DELAY_IN_S;
+          }
+
+          if (next_check < 0.0 || due < next_check)
+            next_check = due;
+        }
+
+        return next_check;
+      }
+
+      inline bool should_hedge(process_part *part)
+      {
+        boost::mutex::scoped_lock lock(_mutex);
+
+        return !part->hedged && !part->resolved;
+      }
+
+      inline bool hedge(process_part *part)
+      {
+        // hedges don't get to jump ahead of other transfers
+        if (!_transfer.acquire_slot(false))
+          return false;
+
+        {
+          boost::mutex::scoped_lock lock(_mutex);
+
+          part->hedged = true;
+          part->hedge_slot = true;
+          _hedged_parts++;
+        }
+
+        S3_LOG(LOG_DEBUG, "parallel_work_queue::hedge", "hedging part %i.\n", part->id);
+
+        post_attempt(_on_process_part, part, true);
+
+        return true;
+      }
+
+      inline process_part * get_next_part()
+      {
+        process_part *part = NULL;
+
+        if (_on_next_part) {
+          process_part p;
+
+          p.part = _on_next_part();
+
+          if (!p.part)
+            return NULL;
+
+          p.id = _parts.size();
+          p.posted = true;
+
+          // deque::push_back() doesn't invalidate references to existing 
+          // elements, so pointers held in process() remain valid
+          _parts.push_back(p);
+
+          return &_parts.back();
+        }
+
+        if (_on_select_part) {
+          int selected = _on_select_part();
+
+          if (selected >= 0 && static_cast<size_t>(selected) < _parts.size() && !_parts[selected].posted)
+            part = &_parts[selected];
+        }
+
+        if (!part) {
+          while (_next_part < _parts.size() && _parts[_next_part].posted)
+            _next_part++;
+
+          if (_next_part == _parts.size())
+            return NULL;
+
+          part = &_parts[_next_part++];
+        }
+
+        part->posted = true;
+
+        return part;
+      }
+
+      std::deque<process_part> _parts;
 
       process_part_fn _on_process_part;
       retry_part_fn _on_retry_part;
+      select_part_fn _on_select_part;
+      next_part_fn _on_next_part;
+      complete_part_fn _on_complete_part;
+
+      base::transfer_scheduler::transfer _transfer;
 
+      int _request_timeout_in_s;
       int _max_retries;
       size_t _max_parts_in_progress;
+      size_t _next_part;
+
+      bool _adaptive;
+      size_t _adaptive_limit, _peak_parts_in_progress, _round_parts;
+      double _round_start, _last_round_rate;
+
+      boost::mutex _mutex;
+      boost::condition _condition;
+      bool _hedge;
+      size_t _hedged_parts, _hedges_won, _attempts_in_flight;
+      std::deque<double> _durations;
+      std::deque<process_part *> _completed;
     };
   }
 }
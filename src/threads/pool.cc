@@ -23,19 +23,27 @@
 
 #include "base/config.h"
 #include "base/logger.h"
+#include "base/request.h"
 #include "base/statistics.h"
+#include "base/transfer_reactor.h"
+#include "services/service.h"
 #include "threads/request_worker.h"
 #include "threads/pool.h"
 #include "threads/work_item_queue.h"
 #include "threads/worker.h"
 
 using boost::bind;
+using boost::enable_shared_from_this;
 using boost::scoped_ptr;
+using boost::shared_ptr;
 using boost::thread;
 using std::string;
 
 using s3::base::config;
+using s3::base::request;
 using s3::base::statistics;
+using s3::base::transfer_reactor;
+using s3::services::service;
 using s3::threads::async_handle;
 using s3::threads::pool;
 using s3::threads::work_item;
@@ -149,19 +157,124 @@ namespace
   };
 
   _pool *s_pools[POOL_COUNT];
+
+  // request completions get a pool of their own, since the threads waiting
+  // on them (in parallel_work_queue::process(), for instance) are usually in
+  // PR_0, and completions queued behind those threads would never run
+  _pool *s_completion_pool = NULL;
+
+  // see pool::post_request()
+  class request_op : public enable_shared_from_this<request_op>
+  {
+  public:
+    typedef shared_ptr<request_op> ptr;
+
+    inline request_op(
+      const work_item::worker_function &prepare, 
+      const work_item::worker_function &complete, 
+      int timeout_in_s, 
+      const async_handle::ptr &ah)
+      : _prepare(prepare),
+        _complete(complete),
+        _timeout_in_s(timeout_in_s),
+        _ah(ah)
+    {
+    }
+
+    // the request belongs to this op rather than to the pool thread, since
+    // it outlives the call
+    int prepare(const request::ptr & /* ignored */)
+    {
+      int r;
+
+      _req.reset(new request());
+      _req->set_hook(service::get_request_hook());
+
+      r = _prepare(_req);
+
+      if (r)
+        return r;
+
+      _req->run_async(bind(&request_op::on_run, shared_from_this(), _1), _timeout_in_s);
+
+      return 0;
+    }
+
+    void on_prepared(int r)
+    {
+      if (r)
+        _ah->complete(r);
+    }
+
+    int complete(const request::ptr & /* ignored */)
+    {
+      return _complete(_req);
+    }
+
+  private:
+    void on_run(int r)
+    {
+      if (r) {
+        _ah->complete(r);
+        return;
+      }
+
+      // don't hold up the reactor
+      s_completion_pool->post(
+        bind(&request_op::complete, shared_from_this(), _1), 
+        _ah,
+        config::get_timeout_retries());
+    }
+
+    work_item::worker_function _prepare, _complete;
+    int _timeout_in_s;
+    async_handle::ptr _ah;
+    request::ptr _req;
+  };
+
+  int run_request(
+    const work_item::worker_function &prepare, 
+    const work_item::worker_function &complete, 
+    int timeout_in_s, 
+    const request::ptr &req)
+  {
+    int r;
+
+    r = prepare(req);
+
+    if (r)
+      return r;
+
+    req->run(timeout_in_s);
+
+    return complete(req);
+  }
 }
 
 void pool::init()
 {
+  if (config::get_use_transfer_reactor())
+    transfer_reactor::init();
+
   s_pools[PR_0] = new _pool_impl<worker, false>("PR_0");
   s_pools[PR_REQ_0] = new _pool_impl<request_worker, true>("PR_REQ_0");
   s_pools[PR_REQ_1] = new _pool_impl<request_worker, true>("PR_REQ_1");
+
+  s_completion_pool = new _pool_impl<worker, false>("PR_COMPLETION");
 }
 
 void pool::terminate()
 {
+  // this fails whatever's in flight, which posts completions to the pools
+  transfer_reactor::terminate();
+
   for (int i = 0; i < POOL_COUNT; i++)
     delete s_pools[i];
+
+  // last, so that threads still waiting on requests in the other pools get
+  // their completions
+  delete s_completion_pool;
+  s_completion_pool = NULL;
 }
 
 void pool::internal_post(
@@ -177,3 +290,28 @@ void pool::internal_post(
     ah,
     (timeout_retries == DEFAULT_TIMEOUT_RETRIES) ? config::get_timeout_retries() : timeout_retries);
 }
+
+void pool::internal_post_request(
+  pool_id p,
+  const work_item::worker_function &prepare,
+  const work_item::worker_function &complete,
+  int request_timeout_in_s,
+  const async_handle::ptr &ah,
+  int timeout_retries)
+{
+  request_op::ptr op;
+
+  if (!transfer_reactor::is_running()) {
+    internal_post(p, bind(&run_request, prepare, complete, request_timeout_in_s, _1), ah, timeout_retries);
+
+    return;
+  }
+
+  op.reset(new request_op(prepare, complete, request_timeout_in_s, ah));
+
+  internal_post(
+    p, 
+    bind(&request_op::prepare, op, _1), 
+    async_handle::ptr(new callback_async_handle(bind(&request_op::on_prepared, op, _1))), 
+    timeout_retries);
+}
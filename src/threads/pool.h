@@ -87,12 +87,59 @@ namespace s3
         post(p, fn, timeout_retries);
       }
 
+      // for work that comes down to a single request: prepare sets up the
+      // request on a thread in p, the request then runs on the transfer 
+      // reactor (so no thread waits on it while it's in flight), and 
+      // complete looks at the response on a pool reserved for completions
+      // (not PR_0, whose threads are often the ones waiting). the handle 
+      // returns the result of complete, or the error that kept the request 
+      // from running. without the reactor, all three run in turn on a thread
+      // in p.
+      inline static wait_async_handle::ptr post_request(
+        pool_id p,
+        const worker_function &prepare,
+        const worker_function &complete,
+        int request_timeout_in_s,
+        int timeout_retries = DEFAULT_TIMEOUT_RETRIES)
+      {
+        wait_async_handle::ptr ah(new wait_async_handle());
+
+        internal_post_request(p, prepare, complete, request_timeout_in_s, ah, timeout_retries);
+
+        return ah;
+      }
+
+      inline static void post_request(
+        pool_id p,
+        const worker_function &prepare,
+        const worker_function &complete,
+        const callback_async_handle::callback_function &cb,
+        int request_timeout_in_s,
+        int timeout_retries = DEFAULT_TIMEOUT_RETRIES)
+      {
+        internal_post_request(
+          p, 
+          prepare, 
+          complete, 
+          request_timeout_in_s, 
+          async_handle::ptr(new callback_async_handle(cb)), 
+          timeout_retries);
+      }
+
     private:
       static void internal_post(
         pool_id p, 
         const worker_function &fn, 
         const async_handle::ptr &ah,
         int timeout_retries);
+
+      static void internal_post_request(
+        pool_id p,
+        const worker_function &prepare,
+        const worker_function &complete,
+        int request_timeout_in_s,
+        const async_handle::ptr &ah,
+        int timeout_retries);
     };
   }
 }
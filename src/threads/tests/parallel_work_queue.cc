@@ -0,0 +1,336 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
+#include <gtest/gtest.h>
+
+#include "base/config.h"
+#include "base/request.h"
+#include "threads/parallel_work_queue.h"
+#include "threads/pool.h"
+
+using boost::condition;
+using boost::mutex;
+using boost::shared_ptr;
+using std::ofstream;
+using std::vector;
+
+using s3::base::config;
+using s3::base::request;
+using s3::threads::parallel_work_queue;
+using s3::threads::pool;
+
+namespace
+{
+  const char *CONFIG_FILE = "/tmp/s3fuse.test-parallel_work_queue";
+
+  // parts that wait on other parts give up after this long, so that a
+  // broken queue fails the test rather than hanging it
+  const int WAIT_LIMIT_IN_S = 10;
+
+  struct test_part
+  {
+    int id;
+    int process_calls, retry_calls;
+    bool done;
+  };
+
+  typedef parallel_work_queue<test_part> queue;
+
+  mutex s_mutex;
+  condition s_condition;
+  vector<int> s_finished; // part ids, in the order the parts finished
+  bool s_failed = false;
+
+  // starting and stopping the pools takes several seconds, so all of the
+  // tests share them. hedging needs the transfer reactor, which 
+  // pool::init() starts.
+  class pool_environment : public testing::Environment
+  {
+  public:
+    virtual void SetUp()
+    {
+      ofstream f(CONFIG_FILE, ofstream::out | ofstream::trunc);
+
+      f <<
+        "bucket_name=test\n"
+        "service=aws\n"
+        "use_transfer_reactor=true\n"
+        "hedge_slow_parts=true\n";
+
+      f.close();
+
+      config::init(CONFIG_FILE);
+      unlink(CONFIG_FILE);
+
+      pool::init();
+    }
+
+    virtual void TearDown()
+    {
+      pool::terminate();
+    }
+  };
+
+  testing::Environment *s_environment = testing::AddGlobalTestEnvironment(new pool_environment());
+
+  void init_parts(vector<test_part> *parts, int count)
+  {
+    s_finished.clear();
+    s_failed = false;
+
+    parts->resize(count);
+
+    for (int i = 0; i < count; i++) {
+      test_part &p = (*parts)[i];
+
+      p.id = i;
+      p.process_calls = 0;
+      p.retry_calls = 0;
+      p.done = false;
+    }
+  }
+
+  // call with s_mutex held
+  bool has_finished(int id)
+  {
+    for (size_t i = 0; i < s_finished.size(); i++)
+      if (s_finished[i] == id)
+        return true;
+
+    return false;
+  }
+
+  // call with s_mutex held. returns false if we gave up waiting.
+  template <class predicate>
+  bool wait_until(mutex::scoped_lock &lock, predicate p)
+  {
+    boost::system_time limit = boost::get_system_time() + boost::posix_time::seconds(WAIT_LIMIT_IN_S);
+
+    while (!p()) {
+      if (!s_condition.timed_wait(lock, limit))
+        return p();
+    }
+
+    return true;
+  }
+
+  int finish(test_part *part, int r)
+  {
+    mutex::scoped_lock lock(s_mutex);
+
+    if (r == 0) {
+      part->done = true;
+      s_finished.push_back(part->id);
+    } else {
+      s_failed = true;
+    }
+
+    s_condition.notify_all();
+
+    return r;
+  }
+
+  int count_call(int *calls)
+  {
+    mutex::scoped_lock lock(s_mutex);
+
+    return ++(*calls);
+  }
+
+  // part 0 holds on to its slot until part 2 (which can only be posted once
+  // part 1's slot is freed) has finished
+  int process_zero_after_two(const shared_ptr<request> &, test_part *part)
+  {
+    count_call(&part->process_calls);
+
+    if (part->id == 0) {
+      mutex::scoped_lock lock(s_mutex);
+
+      if (!wait_until(lock, boost::bind(has_finished, 2)))
+        return -EIO;
+    }
+
+    return finish(part, 0);
+  }
+
+  int process_fail_one(int r, const shared_ptr<request> &, test_part *part)
+  {
+    count_call(&part->process_calls);
+
+    return finish(part, (part->id == 1) ? r : 0);
+  }
+
+  int retry_with(int r, const shared_ptr<request> &, test_part *part)
+  {
+    count_call(&part->retry_calls);
+
+    return finish(part, r);
+  }
+
+  bool failed()
+  {
+    return s_failed;
+  }
+
+  // part 0 doesn't finish until part 1 has failed
+  int process_zero_after_failure(const shared_ptr<request> &, test_part *part)
+  {
+    count_call(&part->process_calls);
+
+    if (part->id == 1)
+      return finish(part, -ECANCELED);
+
+    if (part->id == 0) {
+      mutex::scoped_lock lock(s_mutex);
+
+      if (!wait_until(lock, failed))
+        return -EIO;
+    }
+
+    return finish(part, 0);
+  }
+
+  bool is_done(const test_part *part)
+  {
+    return part->done;
+  }
+
+  // sets up a request the reactor can run without a server. the first
+  // attempt at the last part stalls until a second attempt has completed it.
+  int prepare_stall_last(int last, const shared_ptr<request> &req, test_part *part)
+  {
+    int calls = count_call(&part->process_calls);
+
+    req->init(s3::base::HTTP_GET);
+    req->set_url("file:///dev/null");
+
+    if (part->id == last && calls == 1) {
+      mutex::scoped_lock lock(s_mutex);
+
+      if (!wait_until(lock, boost::bind(is_done, part)))
+        return -EIO;
+    }
+
+    return 0;
+  }
+
+  int complete_part(const shared_ptr<request> &, test_part *part)
+  {
+    return finish(part, 0);
+  }
+}
+
+TEST(parallel_work_queue, out_of_order_completion)
+{
+  vector<test_part> parts;
+
+  init_parts(&parts, 3);
+
+  queue q(parts.begin(), parts.end(), process_zero_after_two, process_zero_after_two, 0, 2);
+
+  // if the queue waited on its oldest part, part 2 would never be posted
+  ASSERT_EQ(0, q.process());
+  ASSERT_EQ(static_cast<size_t>(3), s_finished.size());
+
+  EXPECT_EQ(1, s_finished[0]);
+  EXPECT_EQ(2, s_finished[1]);
+  EXPECT_EQ(0, s_finished[2]);
+}
+
+TEST(parallel_work_queue, retry_after_failure)
+{
+  vector<test_part> parts;
+
+  init_parts(&parts, 4);
+
+  queue q(parts.begin(), parts.end(), boost::bind(process_fail_one, -EAGAIN, _1, _2), boost::bind(retry_with, 0, _1, _2), 2, 2);
+
+  EXPECT_EQ(0, q.process());
+
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(parts[i].done) << "part " << i;
+    EXPECT_EQ(1, parts[i].process_calls) << "part " << i;
+    EXPECT_EQ((i == 1) ? 1 : 0, parts[i].retry_calls) << "part " << i;
+  }
+}
+
+TEST(parallel_work_queue, retries_run_out)
+{
+  vector<test_part> parts;
+
+  init_parts(&parts, 4);
+
+  queue q(parts.begin(), parts.end(), boost::bind(process_fail_one, -ETIMEDOUT, _1, _2), boost::bind(retry_with, -ETIMEDOUT, _1, _2), 2, 1);
+
+  EXPECT_EQ(-ETIMEDOUT, q.process());
+  EXPECT_EQ(2, parts[1].retry_calls);
+  EXPECT_FALSE(parts[1].done);
+
+  // once a part has failed, nothing new is posted
+  EXPECT_EQ(0, parts[2].process_calls);
+  EXPECT_EQ(0, parts[3].process_calls);
+}
+
+TEST(parallel_work_queue, hedge_finishes_first)
+{
+  const int PART_COUNT = 5;
+
+  vector<test_part> parts;
+
+  init_parts(&parts, PART_COUNT);
+
+  // one part at a time, so that the first four set the bar for the last
+  queue q(
+    parts.begin(),
+    parts.end(),
+    boost::bind(prepare_stall_last, PART_COUNT - 1, _1, _2),
+    boost::bind(prepare_stall_last, PART_COUNT - 1, _1, _2),
+    0,
+    1);
+
+  q.set_on_complete_part(complete_part, WAIT_LIMIT_IN_S);
+
+  EXPECT_EQ(0, q.process());
+  EXPECT_EQ(static_cast<size_t>(1), q.get_hedged_parts());
+  EXPECT_EQ(static_cast<size_t>(1), q.get_hedges_won());
+  EXPECT_EQ(2, parts[PART_COUNT - 1].process_calls);
+
+  // the stalled attempt lost, so the part was only completed once
+  EXPECT_EQ(static_cast<size_t>(PART_COUNT), s_finished.size());
+}
+
+TEST(parallel_work_queue, abort_partway)
+{
+  vector<test_part> parts;
+
+  init_parts(&parts, 6);
+
+  queue q(parts.begin(), parts.end(), boost::bind(process_fail_one, -ECANCELED, _1, _2), boost::bind(retry_with, 0, _1, _2), 5, 1);
+
+  // -ECANCELED isn't retried
+  EXPECT_EQ(-ECANCELED, q.process());
+  EXPECT_EQ(0, parts[1].retry_calls);
+  EXPECT_TRUE(parts[0].done);
+
+  for (int i = 2; i < 6; i++)
+    EXPECT_EQ(0, parts[i].process_calls) << "part " << i;
+}
+
+TEST(parallel_work_queue, abort_waits_for_parts_in_progress)
+{
+  vector<test_part> parts;
+
+  init_parts(&parts, 6);
+
+  queue q(parts.begin(), parts.end(), process_zero_after_failure, process_zero_after_failure, 5, 2);
+
+  EXPECT_EQ(-ECANCELED, q.process());
+
+  // part 0 was still running when part 1 failed
+  EXPECT_TRUE(parts[0].done);
+  EXPECT_FALSE(parts[1].done);
+}